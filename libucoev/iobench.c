@@ -0,0 +1,260 @@
+/*
+ * I/O backend benchmark: syscalls per message, libev vs io_uring.
+ *
+ * PAIRS socketpairs with a coroutine on each end, that is 10k
+ * connections, ping-ponging small messages with coev_send() and
+ * cnrbuf_read(). The run is done twice in forked children: once for
+ * time, once under ptrace(PTRACE_SYSCALL) to count the syscalls made
+ * between two getppid() markers.
+ *
+ * Arguments:
+ *   heap        I/O timeouts are ev_timer-s instead of timeout lists,
+ *               see coev_settimeoutlists().
+ *   persistent  cnrbuf_t-s in CNRBUF_PERSISTENT mode.
+ *   spin=N      cnrbuf_t-s spin-yield N times before waiting.
+ *
+ * Build and run both backends with `make iobench`.
+ *
+ * License: MIT License
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+
+#include "ucoev.h"
+
+#define PAIRS     5000
+#define ROUNDS    20
+#define MSGLEN    64
+#define TIMEOUT   10.0
+
+static coev_t root;
+static int heap_timeouts;
+static int nb_flags, nb_spin;
+static char mode[64];
+
+static void
+bench_abort(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    abort();
+}
+
+static void
+bench_eabort(const char *msg, int e) {
+    fprintf(stderr, "%s: %s\n", msg, strerror(e));
+    abort();
+}
+
+static void
+bench_dm_flush(const char *p, size_t l) {
+    fwrite(p, l, 1, stderr);
+}
+
+static coev_frameth_t bench_fm = {
+    malloc, realloc, free,
+    bench_abort, bench_eabort,
+    NULL,
+    0x10000,
+    bench_dm_flush,
+    0,
+};
+
+static double
+now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* coev_t::A is the fd, ::X is non-NULL for the side that speaks first */
+static void
+conn_runner(coev_t *self) {
+    int fd = (int)(long) self->A;
+    char msg[MSGLEN];
+    cnrbuf_t buf;
+    ssize_t sent;
+    void *p;
+    int i;
+
+    memset(msg, 'x', MSGLEN);
+    cnrbuf_init(&buf, fd, TIMEOUT, 4096, 65536);
+    cnrbuf_setmode(&buf, nb_flags, nb_spin);
+    for (i = 0; i < ROUNDS; i++) {
+        if (self->X && coev_send(fd, msg, MSGLEN, &sent, TIMEOUT))
+            bench_eabort("coev_send()", errno);
+        if (cnrbuf_read(&buf, &p, MSGLEN) != MSGLEN)
+            bench_eabort("cnrbuf_read()", errno);
+        if (!self->X && coev_send(fd, p, MSGLEN, &sent, TIMEOUT))
+            bench_eabort("coev_send()", errno);
+    }
+    cnrbuf_fini(&buf);
+}
+
+static void
+spawner_runner(coev_t *self) {
+    int i, sv[2];
+    coev_t *c;
+
+    for (i = 0; i < PAIRS; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+            bench_eabort("socketpair()", errno);
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+        fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+        c = coev_new(conn_runner, 64 * 1024);
+        c->A = (void *)(long) sv[0];
+        c->X = c;
+        coev_schedule(c);
+        c = coev_new(conn_runner, 64 * 1024);
+        c->A = (void *)(long) sv[1];
+        c->X = NULL;
+        coev_schedule(c);
+    }
+
+    getppid(); /* start marker */
+    coev_loop();
+    getppid(); /* end marker */
+}
+
+static void
+workload(int traced) {
+    coev_instrumentation_t st;
+    struct rlimit rl;
+    coev_t *spawner;
+    double t0;
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    coev_libinit(&bench_fm, &root);
+    if (heap_timeouts)
+        coev_settimeoutlists(0);
+    spawner = coev_new(spawner_runner, 64 * 1024);
+    t0 = now();
+    coev_switch(spawner);
+    coev_getstats(&st);
+    if (!traced)
+        printf("%-8s %s: %d connections, %d messages in %.3fs: %.0f msgs/s, "
+            "%.2f timer ops per message\n"
+            "%-8s %s: direct %lu spun %lu parked %lu persistent %lu uring %lu\n",
+            coev_iobackend(), mode, 2 * PAIRS, 2 * PAIRS * ROUNDS, now() - t0, 
+            2 * PAIRS * ROUNDS / (now() - t0),
+            (double) st.c_iotimer_ops / (2 * PAIRS * ROUNDS),
+            coev_iobackend(), mode, 
+            (unsigned long) st.c_io_direct, (unsigned long) st.c_io_spun,
+            (unsigned long) st.c_io_parked, (unsigned long) st.c_io_persistent,
+            (unsigned long) st.c_io_uring);
+    exit(0);
+}
+
+static struct { long nr; const char *name; } named[] = {
+#ifdef SYS_epoll_wait
+    { SYS_epoll_wait, "epoll_wait" },
+#endif
+    { SYS_epoll_pwait, "epoll_pwait" },
+    { SYS_epoll_ctl, "epoll_ctl" },
+    { SYS_recvfrom, "recvfrom" },
+    { SYS_sendto, "sendto" },
+    { SYS_io_uring_enter, "io_uring_enter" },
+    { SYS_rt_sigprocmask, "rt_sigprocmask" },
+    { -1, NULL }
+};
+
+#define MAXNR 1024
+
+static void
+count_syscalls(const char *backend) {
+    struct ptrace_syscall_info si;
+    static unsigned long counts[MAXNR];
+    unsigned long total = 0, other;
+    int status, on = 0, i;
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        workload(1);
+    }
+
+    waitpid(pid, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *) PTRACE_O_TRACESYSGOOD);
+    for (;;) {
+        if (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == -1)
+            bench_eabort("ptrace(PTRACE_SYSCALL)", errno);
+        if (waitpid(pid, &status, 0) == -1)
+            bench_eabort("waitpid()", errno);
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            break;
+        if (!(WIFSTOPPED(status) && (WSTOPSIG(status) == (SIGTRAP | 0x80))))
+            continue;
+        if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *) sizeof(si), &si) == -1)
+            bench_eabort("ptrace(PTRACE_GET_SYSCALL_INFO)", errno);
+        if (si.op != PTRACE_SYSCALL_INFO_ENTRY)
+            continue;
+        if (si.entry.nr == SYS_getppid) {
+            on = !on;
+            continue;
+        }
+        if (on && (si.entry.nr < MAXNR)) {
+            counts[si.entry.nr] ++;
+            total ++;
+        }
+    }
+
+    printf("%-8s %s: %lu syscalls, %.2f per message:", backend, mode, total,
+        (double) total / (2 * PAIRS * ROUNDS));
+    other = total;
+    for (i = 0; named[i].name; i++) {
+        if (!counts[named[i].nr])
+            continue;
+        printf(" %s %lu", named[i].name, counts[named[i].nr]);
+        other -= counts[named[i].nr];
+    }
+    printf(" other %lu\n", other);
+}
+
+int
+main(int argc, char **argv) {
+    int status, i;
+    pid_t pid;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "heap"))
+            heap_timeouts = 1;
+        else if (!strcmp(argv[i], "persistent"))
+            nb_flags |= CNRBUF_PERSISTENT;
+        else if (!strncmp(argv[i], "spin=", 5))
+            nb_spin = atoi(argv[i] + 5);
+        else
+            bench_abort("usage: iobench [heap] [persistent] [spin=N]");
+    }
+    snprintf(mode, sizeof(mode), "%s%s spin=%d", heap_timeouts ? "heap" : "lists",
+        nb_flags & CNRBUF_PERSISTENT ? " persistent" : "", nb_spin);
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+        workload(0);
+    waitpid(pid, &status, 0);
+    fflush(stdout);
+
+#ifdef COEV_URING
+    count_syscalls("io_uring");
+#else
+    count_syscalls("libev");
+#endif
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Context switch microbenchmark: switches per second.
+ *
+ * Build and run both backends with `make bench`.
+ *
+ * License: MIT License
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "ucoev.h"
+
+#ifdef COEV_FASTCTX
+#define BACKEND "fast"
+#else
+#define BACKEND "ucontext"
+#endif
+
+#define SWITCHES  2000000
+#define STALLERS  100
+#define STALLS    20000
+
+static coev_t root;
+
+static void
+bench_abort(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    abort();
+}
+
+static void
+bench_eabort(const char *msg, int e) {
+    fprintf(stderr, "%s: %s\n", msg, strerror(e));
+    abort();
+}
+
+static void
+bench_dm_flush(const char *p, size_t l) {
+    fwrite(p, l, 1, stderr);
+}
+
+static coev_frameth_t bench_fm = {
+    malloc, realloc, free,
+    bench_abort, bench_eabort,
+    NULL,
+    0x10000,
+    bench_dm_flush,
+    0,
+};
+
+static double
+now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+report(const char *what, long count, double elapsed) {
+    printf("%-8s %-10s %10ld switches in %.3fs: %12.0f switches/s\n",
+        BACKEND, what, count, elapsed, count / elapsed);
+}
+
+/* ping-pong: coev_switch() back and forth between root and a child */
+static void
+pingpong_runner(coev_t *self) {
+    for (;;)
+        coev_switch(self->parent);
+}
+
+/* runqueue: coroutines yielding through coev_stall() to coev_loop() */
+static void
+staller_runner(coev_t *self) {
+    int i;
+    for (i = 0; i < STALLS; i++)
+        coev_stall();
+}
+
+static void
+scheduler_runner(coev_t *self) {
+    coev_loop();
+}
+
+int
+main(int argc, char **argv) {
+    coev_t *c, *sched;
+    double t0;
+    long i;
+
+    coev_libinit(&bench_fm, &root);
+
+    c = coev_new(pingpong_runner, 64 * 1024);
+    t0 = now();
+    for (i = 0; i < SWITCHES / 2; i++)
+        coev_switch(c);
+    report("switch", SWITCHES, now() - t0);
+
+    for (i = 0; i < STALLERS; i++)
+        coev_schedule(coev_new(staller_runner, 64 * 1024));
+    sched = coev_new(scheduler_runner, 64 * 1024);
+    t0 = now();
+    coev_switch(sched);
+    /* each stall is a switch into the staller and one back into the loop */
+    report("runqueue", 2L * STALLERS * (STALLS + 1), now() - t0);
+
+    return 0;
+}
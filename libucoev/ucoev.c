@@ -18,7 +18,16 @@
 #include <sys/mman.h> /* mmap/munmap */
 #include <stdlib.h> /* malloc/free */
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 #include <ucontext.h>
 #include <errno.h>
 
@@ -30,11 +39,40 @@
 #include "valgrind.h"
 #endif
 
+#ifdef COEV_URING
+#include <endian.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 static coev_frameth_t _fm;
 static char *dmesg = NULL;
 static char *dm_cp = NULL; /* points at the first 0 byte in the dmesg */
 static struct timeval started_at;
-static int _ev_initialized = 0;
+
+#ifdef THREADING_MADNESS
+#define TLS_ATTR __thread
+#define CROSSTHREAD_CHECK(target, rv) \
+    if (!pthread_equal(pthread_self(), (target)->thread)) \
+        fm_abort("crossthread switch prohibited");
+/* a coroutine moved with coev_migrate() resumes on another thread, and gcc
+   is free to reuse TLS addresses computed before a switch (gcc PR 26461). 
+   Code that runs after a switch such a coroutine can return from 
+   reads its ts_* through a function marked with this. */
+#define COEV_NOINLINE __attribute__((noinline))
+static pthread_mutex_t dm_lock = PTHREAD_MUTEX_INITIALIZER;
+#define DM_LOCK() pthread_mutex_lock(&dm_lock)
+#define DM_UNLOCK() pthread_mutex_unlock(&dm_lock)
+#else
+#define TLS_ATTR
+#define CROSSTHREAD_CHECK(target, rv)
+#define COEV_NOINLINE
+#define DM_LOCK()
+#define DM_UNLOCK()
+#endif
+
+static TLS_ATTR int ts_ev_initialized = 0;
 
 static void
 flush_dmesg(void) {
@@ -58,6 +96,7 @@ coev_dmprintf(const char *fmt, ...) {
     saved_errno = errno;
     
     gettimeofday(&tv, NULL);
+    DM_LOCK();
     
     if (tv.tv_usec > started_at.tv_usec) {
         delta.tv_sec = tv.tv_sec - started_at.tv_sec;
@@ -79,13 +118,16 @@ coev_dmprintf(const char *fmt, ...) {
         dm_cp += rv;
     else
         flush_dmesg();
+    DM_UNLOCK();
     errno = saved_errno;
 }
 
 void
 coev_dmflush(void) {
+    DM_LOCK();
     _fm.dm_flush(dmesg, dm_cp - dmesg);
     dm_cp = dmesg;
+    DM_UNLOCK();
 }
 
 #define cgen_dprintf(t, fmt, args...) do { if (_fm.debug & t) \
@@ -135,27 +177,143 @@ fm_eabort(const char *msg, int err_no) {
     _fm.eabort(msg, err_no);
 }
 
-#ifdef THREADING_MADNESS
-#define TLS_ATTR __thread
-#define CROSSTHREAD_CHECK(target, rv) \
-    if (pthread_equal(ts_current->thread, (target)->thread)) \
-        fm_abort("crossthread switch prohibited");
+/* Cheap timestamps, for tracing and latency histograms: the cycle 
+   counter where there is one usable from userspace, nanoseconds 
+   otherwise. Converted to time against CLOCK_MONOTONIC readings taken 
+   at coev_libinit() and when the conversion is asked for. */
+static uint64_t clk_ticks0;
+static struct timespec clk_mono0;
+
+static inline uint64_t
+_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (v));
+    return v;
 #else
-#define TLS_ATTR
-#define CROSSTHREAD_CHECK(target, rv)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 #endif
+}
+
+static void
+_ticks_init(void) {
+    clk_ticks0 = _ticks();
+    clock_gettime(CLOCK_MONOTONIC, &clk_mono0);
+}
+
+static double
+_ns_per_tick(void) {
+    struct timespec mono1;
+    uint64_t ticks1 = _ticks();
+    double ns;
+    
+    clock_gettime(CLOCK_MONOTONIC, &mono1);
+    ns = (mono1.tv_sec - clk_mono0.tv_sec) * 1e9 + (mono1.tv_nsec - clk_mono0.tv_nsec);
+    if ((ns <= 0.0) || (ticks1 <= clk_ticks0))
+        return 1.0;
+    return ns / (ticks1 - clk_ticks0);
+}
+
+/* CPU time accounting, at every context switch */
+static inline void
+_account_switch(coev_t *from, coev_t *to, uint64_t now) {
+    from->cpu_ticks += now - from->sw_stamp;
+    from->sw_stamp = now;
+    to->sw_stamp = now;
+    to->sw_count ++;
+}
+
+static inline void
+_hist_add(coev_hist_t *h, uint64_t v) {
+    int b = v, msb;
+    
+    if (v >= (1 << COEV_HIST_SUB_BITS)) {
+        msb = 63 - __builtin_clzll(v);
+        b = ((msb - COEV_HIST_SUB_BITS + 1) << COEV_HIST_SUB_BITS) 
+          + ((v >> (msb - COEV_HIST_SUB_BITS)) & ((1 << COEV_HIST_SUB_BITS) - 1));
+        if (b >= COEV_HIST_BUCKETS)
+            b = COEV_HIST_BUCKETS - 1;
+    }
+    h->buckets[b] ++;
+    h->count ++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Event trace ring.
+
+   Fixed-size binary records in a power-of-two ring, per thread, 
+   overwriting the oldest. Recording is a timestamp read and a store,
+   so that it can stay on in production; all the formatting is done 
+   by coev_trace_dump() after the fact. 
+   
+   Timestamps are _ticks(), converted to microseconds since 
+   coev_trace_enable() at dump time. */
+#define TR_SWITCH       1  /* co -> peer, reason is peer's new status */
+#define TR_WAIT         2  /* co parks on fd, reason is COEV_READ/WRITE bits */
+#define TR_SLEEP        3
+#define TR_WAKEUP       4  /* co made runnable, reason is its CSW_* */
+#define TR_TIMEOUT      5
+#define TR_SPAWN        6  /* co created peer */
+#define TR_DEATH        7
+#define TR_LOCKWAIT     8  /* co queued on a held colock */
+#define TR_LOCKHANDOFF  9  /* co released a colock straight to peer */
+#define TR_CHANWAIT    10  /* co waits to send to or receive from a channel */
+#define TR_SYNCWAIT    11  /* co waits on a semaphore, event or condition */
+#define TR_OFFLOAD     12  /* co waits for an offload pool job */
+#define TR_CHILDWAIT   13  /* co waits for a child process */
+#define TR_TYPES       14
+
+#define TR_NOPEER ((uint32_t) -1)
+
+struct _coev_trace_event {
+    uint64_t tsc;
+    uint32_t co;    /* coev_t::id */
+    uint32_t peer;  /* coev_t::id, if applicable */
+    int32_t fd;
+    uint16_t type;  /* TR_* */
+    uint16_t reason;
+};
+
+static TLS_ATTR
+struct _coev_trace {
+    struct _coev_trace_event *ring; /* NULL if tracing is off */
+    uint64_t mask;
+    uint64_t head;        /* total events recorded */
+    uint64_t tsc0;        /* _ticks() at coev_trace_enable() */
+} ts_trace;
+
+static inline void
+_trace_rec(int type, coev_t *co, coev_t *peer, int fd, int reason) {
+    struct _coev_trace_event *e = &ts_trace.ring[ts_trace.head++ & ts_trace.mask];
+    
+    e->tsc = _ticks();
+    e->co = co ? co->id : 0;
+    e->peer = peer ? peer->id : TR_NOPEER;
+    e->fd = fd;
+    e->type = type;
+    e->reason = reason;
+}
+
+#define COEV_TRACE(type, co, peer, fd, reason) do { if (ts_trace.ring) \
+    _trace_rec(type, co, peer, fd, reason); } while(0)
 
 typedef struct _coev_lock_bunch colbunch_t;
 struct _coev_lock_bunch {
     colbunch_t *next;  /* in case we run out of space */
-    colock_t *avail;   /* freed locks are stuffed here */
     colock_t *used;    /* allocated locks are stuffed here */
     colock_t *area;    /* what to free() */
     size_t allocated;  /* tracking how much was allocated (in colock count) */
 };
 /* colock_t declared in headed */
 struct _coev_lock {
-    colock_t *next;
+    colock_t *next;    /* in bunch's used list, or in ts_colock_avail */
+    colock_t *prev;    /* in bunch's used list */
     coev_t *owner;
     coev_t *queue_head;
     coev_t *queue_tail;
@@ -166,48 +324,165 @@ static TLS_ATTR coev_t * volatile ts_current;
 static TLS_ATTR volatile int ts_count;
 static TLS_ATTR coev_t *ts_root;
 static TLS_ATTR colbunch_t *ts_rootlockbunch;
-static TLS_ATTR long ts_cls_last_key;
+static TLS_ATTR colock_t *ts_colock_avail; /* freed locks of all bunches */
+/* keys are process-wide: generation of each index, 0 if not in use */
+static long cls_keygen[CLS_MAX_KEYS];
+static long cls_last_gen;
+#ifdef THREADING_MADNESS
+static pthread_mutex_t cls_key_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#ifdef COEV_URING
+#define COEV_URING_ENTRIES 4096
+struct _coev_uring {
+    int fd;                 /* -1 if not in use */
+    void *ring;             /* SQ and CQ rings, single mmap */
+    size_t ring_sz;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_flags, *sq_array;
+    unsigned sq_mask;
+    unsigned local_tail;    /* SQEs prepared up to here, not yet published */
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct __kernel_timespec *ts; /* linked timeout values, by SQE slot */
+    struct ev_io w;         /* ring fd: completions are there */
+};
+#endif
+
+#ifdef MSG_ZEROCOPY
+/* a coev_sendv() whose buffers the kernel still has */
+struct _coev_zccall {
+    uint32_t upto;          /* done when the socket's completions get here */
+    ev_tstamp deadline;     /* or when this passes, 0 if never */
+    coev_zcdone_fn done;
+    void *arg;
+    struct _coev_zccall *next;
+};
+
+/* a socket with zerocopy sends in flight */
+struct _coev_zcsock {
+    int fd;
+    uint32_t sent;          /* zerocopy sendmsg()-s since this was made */
+    uint32_t reaped;        /* completions for those */
+    int senders;            /* coev_sendv()-s not yet returned */
+    struct _coev_zccall *calls;
+    struct _coev_zcsock *next;
+};
+#endif
+
+/* waiters with the same I/O timeout value, by deadline */
+struct _coev_tolist {
+    ev_tstamp timeout;      /* 0.0 if the slot is free */
+    coev_t *head;
+    coev_t *tail;
+    struct ev_timer timer;  /* for the head, or earlier */
+};
 
 static TLS_ATTR
 struct _coev_scheduler_stuff {
     coev_t *scheduler;
     struct ev_loop *loop;
     struct ev_signal intsig;
-    coev_t *runq_head;
-    coev_t *runq_tail;
+    struct _coev_runqueue {
+        coev_t *head;
+        coev_t *tail;
+        coev_t *pass_last; /* last one to run in current coev_loop() pass */
+    } runq[COEV_PRIO_LEVELS];
     int waiters;
     int slackers;
-    int stop_flag;
+    volatile int stop_flag;
+    struct _coev_tolist tol[COEV_TIMEOUT_LISTS];
+    int tol_count;            /* how many of tol[] to use */
+#ifdef THREADING_MADNESS
+    int own_loop;             /* ev_loop_new()-ed, not the default one */
+    pthread_t thread;
+    volatile int runq_len;    /* published for stealers */
+    coev_t * volatile inbox;  /* migrated in, LIFO via rq_next */
+    struct ev_async inbox_w;  /* kicked after a push into the inbox */
+    struct _coev_scheduler_stuff * volatile thief; /* idle one asking for work */
+    struct ev_timer steal_timer;
+    int worker;               /* COEV_WORKER_* */
+    int registered;           /* is in sched_registry */
+#endif
+#ifdef COEV_URING
+    struct _coev_uring ring;
+#endif
+    int offload_fd;           /* eventfd, -1 until the first coev_offload() */
+    struct ev_io offload_w;
+    struct _coev_offload_job * volatile offload_done; /* finished, LIFO via next */
+    volatile int offload_busy;  /* jobs queued or running, till their write() to offload_fd */
+#ifdef MSG_ZEROCOPY
+    struct _coev_zcsock *zc_socks; /* with zerocopy sends in flight */
+    struct ev_timer zc_timer;      /* reaps their completions */
+#endif
 } ts_scheduler;
 
 /* coevst_t declared in header */
 struct _coev_stack {
-    void *base;     /* what to give to munmap */
-    void *sp;       /* what to put into stack_t */
-    size_t size;    /* what to put into stack_t */
-    coevst_t *next;
-    coevst_t *prev; /* used only in busylist for fast removal */
+    void *base;     /* what to give to munmap: guard page + stack */
+    void *sp;       /* lowest usable address, what to put into stack_t */
+    size_t size;    /* usable size, what to put into stack_t */
+    int sclass;     /* size class */
+    int dirty;      /* idle and not yet released via madvise() */
+    int zeroed;     /* never touched since mmap() or MADV_DONTNEED */
+    coevst_t *next; /* class avail list or busy list */
+    coevst_t *prev; 
+    coevst_t *lru_next; /* idle dirty stacks, most recently returned first */
+    coevst_t *lru_prev;
 #ifdef HAVE_VALGRIND
     int vg_id;
 #endif
 };
 
-static 
+/* Stack pool.
+
+   Stacks are grouped into power-of-two size classes, in pages: a class i 
+   stack has (pagesize << i) usable bytes and one PROT_NONE guard page 
+   below it. Requests are rounded up to the class size.
+   
+   Each class has its avail list, where dirty (recently used, thus resident)
+   stacks are kept at the head, and released ones at the tail. Get pops 
+   from the head, return pushes to the head, both O(1).
+   
+   Idle dirty stacks are also on the LRU list across all classes. When
+   their total size goes above the high-water mark, the least recently 
+   returned ones are released with madvise() and moved to the tail of 
+   their class' avail list. Address space is never given back until 
+   coev_libfini().
+*/
+static TLS_ATTR
 struct _coev_stack_bunch {
-    coevst_t *avail;
+    struct {
+        coevst_t *head;
+        coevst_t *tail;
+    } avail[COEV_STACK_CLASSES];
     coevst_t *busy;
+    coevst_t *lru_head;
+    coevst_t *lru_tail;
+    size_t pagesize;
+    size_t hiwat;       /* max idle dirty bytes */
+    size_t idle_dirty;  /* current idle dirty bytes */
 } ts_stack_bunch;
 
-static void
+static COEV_NOINLINE void
 _dump_stack_bunch(const char *msg) {
     coevst_t *p;
-    cstk_dprintf("%s, avail=%p, busy=%p\n\tAVAIL:\n", 
-        msg, ts_stack_bunch.avail, ts_stack_bunch.busy);
-    p = ts_stack_bunch.avail;
-    while(p) {
-        cstk_dprintf("\t<%p>: prev=%p next=%p size=%zd base=%p\n",
-            p, p->prev, p->next, p->size, p->base);
-        p = p->next;
+    int i;
+    cstk_dprintf("%s, busy=%p idle_dirty=%zd hiwat=%zd\n", 
+        msg, ts_stack_bunch.busy, ts_stack_bunch.idle_dirty, ts_stack_bunch.hiwat);
+    for (i = 0; i < COEV_STACK_CLASSES; i++) {
+        p = ts_stack_bunch.avail[i].head;
+        if (!p)
+            continue;
+        cstk_dprintf("\tAVAIL class %d (%zd bytes):\n", i, ts_stack_bunch.pagesize << i);
+        while(p) {
+            cstk_dprintf("\t<%p>: prev=%p next=%p size=%zd base=%p dirty=%d\n",
+                p, p->prev, p->next, p->size, p->base, p->dirty);
+            p = p->next;
+        }
     }
     cstk_dprintf("\n\tBUSY:\n");
     p = ts_stack_bunch.busy;
@@ -218,65 +493,173 @@ _dump_stack_bunch(const char *msg) {
     }
 }
 
-/* for best performance of stack allocation, don't increase stack
-size after application startup. */
-/* TODO: 
-    - pay attention to stack growth direction.
-    - set up guard page. 
-    - align stack start on smallpage boundary (hugepages?)
-    - double check minimal size. 
-*/
+static int
+_stack_class(size_t size) {
+    size_t pages = (size + ts_stack_bunch.pagesize - 1) / ts_stack_bunch.pagesize;
+    int sclass = 0;
+    
+    while (((size_t)1 << sclass) < pages)
+        sclass ++;
+    return sclass;
+}
+
+static void
+_lru_unlink(coevst_t *st) {
+    if (st->lru_prev)
+        st->lru_prev->lru_next = st->lru_next;
+    else
+        ts_stack_bunch.lru_head = st->lru_next;
+    if (st->lru_next)
+        st->lru_next->lru_prev = st->lru_prev;
+    else
+        ts_stack_bunch.lru_tail = st->lru_prev;
+    st->lru_next = st->lru_prev = NULL;
+}
+
+static void
+_avail_unlink(coevst_t *st) {
+    if (st->prev)
+        st->prev->next = st->next;
+    else
+        ts_stack_bunch.avail[st->sclass].head = st->next;
+    if (st->next)
+        st->next->prev = st->prev;
+    else
+        ts_stack_bunch.avail[st->sclass].tail = st->prev;
+    st->next = st->prev = NULL;
+}
+
+/* give pages back to the OS, keep the mapping */
+static void
+_release_a_stack(coevst_t *st) {
+    int rv = -1;
+    
+#ifdef MADV_FREE
+    rv = madvise(st->sp, st->size, MADV_FREE);
+#endif
+    if (rv == 0)
+        st->zeroed = 0; /* until the kernel gets to it, that is */
+    else {
+        rv = madvise(st->sp, st->size, MADV_DONTNEED);
+        st->zeroed = 1;
+    }
+    if (rv != 0)
+        fm_eabort("_release_a_stack(): madvise() failed", errno);
+    
+    cstk_dprintf("_release_a_stack(%p): released %zd bytes\n", st, st->size);
+    
+    st->dirty = 0;
+    ts_stack_bunch.idle_dirty -= st->size;
+    _fm.i.stack_bytes_resident -= st->size;
+    _fm.i.c_stack_releases ++;
+}
+
+/* release least recently returned idle stacks until under the high-water mark.
+   Never touches the stack we're running on: a dying coroutine returns its
+   stack before it switches out. */
+static void
+_trim_stacks(void) {
+    coevst_t *st;
+    
+    while (ts_stack_bunch.idle_dirty > ts_stack_bunch.hiwat) {
+        st = ts_stack_bunch.lru_tail;
+        if (!st || (ts_current && (st == ts_current->stack)))
+            break;
+        _lru_unlink(st);
+        _release_a_stack(st);
+        
+        /* move to the tail of its class: clean ones are taken last */
+        _avail_unlink(st);
+        st->prev = ts_stack_bunch.avail[st->sclass].tail;
+        if (st->prev)
+            st->prev->next = st;
+        else
+            ts_stack_bunch.avail[st->sclass].head = st;
+        ts_stack_bunch.avail[st->sclass].tail = st;
+    }
+}
+
+/* busy list membership is all that ties a busy stack to a thread */
+static void
+_stack_busy_link(coevst_t *sp) {
+    if (ts_stack_bunch.busy) {
+        assert (ts_stack_bunch.busy->prev == NULL);
+        ts_stack_bunch.busy->prev = sp;
+    }
+    sp->prev = NULL;
+    sp->next = ts_stack_bunch.busy;
+    ts_stack_bunch.busy = sp;
+}
+
+static void
+_stack_busy_unlink(coevst_t *sp) {
+    if (sp->prev)
+        sp->prev->next = sp->next;
+    if (sp->next)
+        sp->next->prev = sp->prev;
+    if (sp == ts_stack_bunch.busy) {
+        ts_stack_bunch.busy = sp->next;
+        if (ts_stack_bunch.busy)
+            ts_stack_bunch.busy->prev = NULL;
+    }
+    sp->next = sp->prev = NULL;
+}
+
 static coevst_t *
 _get_a_stack(size_t size) {
-    coevst_t *rv, *prev_avail;
-    void *base;
+    coevst_t *rv;
+    int sclass;
     
     cstk_dump("_get_a_stack()");
     
-    rv = ts_stack_bunch.avail;
-    prev_avail = NULL;
-    while ( rv && (rv->size < size) ) {
-        prev_avail = rv;
-        rv = rv->next;
-    }
+    sclass = _stack_class(size);
+    if (sclass >= COEV_STACK_CLASSES)
+        fm_abort("_get_a_stack(): stack size too large");
 
-    if (!rv) {
-        size_t to_allocate = size + sizeof(coevst_t);
+    rv = ts_stack_bunch.avail[sclass].head;
     
-        base = mmap(NULL, to_allocate, PROT_EXEC|PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_GROWSDOWN, -1, 0); 
+    if (!rv) {
+        size_t class_size = ts_stack_bunch.pagesize << sclass;
+        size_t to_allocate = class_size + ts_stack_bunch.pagesize;
+        void *base;
+        
+        rv = _fm.malloc(sizeof(coevst_t));
+        if (rv == NULL)
+            fm_abort("_get_a_stack(): coevst_t allocation failed");
+        
+        base = mmap(NULL, to_allocate, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0); 
         if (base == MAP_FAILED)
             fm_eabort("_get_a_stack(): mmap() stack allocation failed", errno);
+        /* stacks grow down: guard page is at the bottom */
+        if (mprotect(base, ts_stack_bunch.pagesize, PROT_NONE))
+            fm_eabort("_get_a_stack(): mprotect() of guard page failed", errno);
         
-        rv = (coevst_t *) ( base + size );
         rv->base = base;
-        rv->size = size;
-        rv->sp = base;
+        rv->size = class_size;
+        rv->sp = (char *)base + ts_stack_bunch.pagesize;
+        rv->sclass = sclass;
+        rv->zeroed = 1;
+        rv->lru_next = rv->lru_prev = NULL;
 #ifdef HAVE_VALGRIND
-        rv->vg_id = VALGRIND_STACK_REGISTER( rv->sp, rv->sp + size);
+        rv->vg_id = VALGRIND_STACK_REGISTER( rv->sp, rv->sp + class_size);
 #endif
         cstk_dprintf("_get_a_stack(): requested %zd allocated %zd base %p sp %p rv %p\n",
-            rv->size, to_allocate, rv->base, rv->sp, rv);
+            size, to_allocate, rv->base, rv->sp, rv);
         _fm.i.stacks_allocated ++;
+        _fm.i.stack_bytes_reserved += to_allocate;
+        _fm.i.stack_bytes_resident += class_size;
     } else {
-        /* remove from the avail list if we took it from there */
-        if (prev_avail)
-            /* middle or end of the avail list */
-            prev_avail->next = rv->next;
-        else
-            /* head of the avail list */
-            ts_stack_bunch.avail = rv->next;
-    }
-    
-    /* add to the head of the busy list */
-    if (ts_stack_bunch.busy) {
-        assert (ts_stack_bunch.busy->prev == NULL);
-            
-        ts_stack_bunch.busy->prev = rv;
+        _avail_unlink(rv);
+        if (rv->dirty) {
+            _lru_unlink(rv);
+            ts_stack_bunch.idle_dirty -= rv->size;
+        } else
+            /* will be touched again */
+            _fm.i.stack_bytes_resident += rv->size;
     }
+    rv->dirty = 0;
     
-    rv->prev = NULL;
-    rv->next = ts_stack_bunch.busy;
-    ts_stack_bunch.busy = rv;
+    _stack_busy_link(rv);
     cstk_dump("_get_a_stack: resulting");
     
     _fm.i.stacks_used ++;
@@ -289,60 +672,193 @@ _return_a_stack(coevst_t *sp) {
     cstk_dump("");
     
     /* 1. remove sp from busy list */
-    if (sp->prev)
-        sp->prev->next = sp->next;
-    if (sp->next)
-        sp->next->prev = sp->prev;
-    if (sp == ts_stack_bunch.busy) {
-        ts_stack_bunch.busy = sp->next;
-        if (ts_stack_bunch.busy)
-            ts_stack_bunch.busy->prev = NULL;
-    }
+    _stack_busy_unlink(sp);
     
-    /* 2. add sp to avail list */
-    sp->prev = NULL; /* not used in avail list */
+    /* 2. add sp to the head of its class avail list and the LRU */
+    sp->prev = NULL;
+    sp->next = ts_stack_bunch.avail[sp->sclass].head;
+    if (sp->next)
+        sp->next->prev = sp;
+    else
+        ts_stack_bunch.avail[sp->sclass].tail = sp;
+    ts_stack_bunch.avail[sp->sclass].head = sp;
+    
+    sp->dirty = 1;
+    sp->zeroed = 0;
+    sp->lru_prev = NULL;
+    sp->lru_next = ts_stack_bunch.lru_head;
+    if (sp->lru_next)
+        sp->lru_next->lru_prev = sp;
+    else
+        ts_stack_bunch.lru_tail = sp;
+    ts_stack_bunch.lru_head = sp;
+    ts_stack_bunch.idle_dirty += sp->size;
     
-    sp->next = ts_stack_bunch.avail;
-    ts_stack_bunch.avail = sp;
+    _trim_stacks();
     
     cstk_dump("_return_a_stack: resulting");
     
     _fm.i.stacks_used --;
 }
 
+static void
+_free_stack_list(coevst_t *st) {
+    coevst_t *next;
+    
+    while (st) {
+        next = st->next;
+        if (0 != munmap(st->base, st->size + ts_stack_bunch.pagesize))
+            fm_eabort("_free_stacks(): munmap failed.", errno);
+#ifdef HAVE_VALGRIND
+        VALGRIND_STACK_DEREGISTER(st->vg_id);
+#endif
+        _fm.free(st);
+        st = next;
+    }
+}
+
 static void
 _free_stacks(void) {
-    coevst_t *spa, *spb, *span, *spbn;
-    spa = ts_stack_bunch.avail;
-    spb = ts_stack_bunch.busy;
+    int i;
+    
     cstk_dprintf("%s\n", "_free_stacks()");
+    
+    for (i = 0; i < COEV_STACK_CLASSES; i++)
+        _free_stack_list(ts_stack_bunch.avail[i].head);
+    _free_stack_list(ts_stack_bunch.busy);
+    
+    _fm.i.stacks_allocated = 0;
+    _fm.i.stack_bytes_reserved = 0;
+    _fm.i.stack_bytes_resident = 0;
+}
+
+void
+coev_setstackhiwat(size_t bytes) {
+    ts_stack_bunch.hiwat = bytes;
+    _trim_stacks();
+}
 
-    while (spa || spb) {
-        if (spa)
-            span = spa->next;
-        if (spb)
-            spbn = spb->next;
+/* stack usage profiles, see header. 
+   Open-addressed table keyed by the entry point key; when it is full,
+   new keys are simply not profiled. */
+struct _coev_stackprof_slot {
+    coev_stackprof_t info;
+};
 
-        if (spa && ( 0 != munmap(spa, spa->size + sizeof(coevst_t))))
-            fm_eabort("_free_stacks(): munmap failed.", errno);
-        if (spb && ( 0 != munmap(spb, spb->size + sizeof(coevst_t))))
-                fm_eabort("_free_stacks(): munmap failed.", errno);
+static TLS_ATTR
+struct _coev_stackprof_table {
+    int mode;
+    int used;
+    coevsp_t slots[COEV_STACKPROF_SLOTS];
+} ts_stackprof;
+
+static coevsp_t *
+_stackprof_find(const void *key) {
+    unsigned int i, h;
+    
+    h = ((uintptr_t) key >> 4) * 2654435761u;
+    for (i = 0; i < COEV_STACKPROF_SLOTS; i++) {
+        coevsp_t *slot = &ts_stackprof.slots[(h + i) % COEV_STACKPROF_SLOTS];
         
-#ifdef HAVE_VALGRIND
-        VALGRIND_STACK_DEREGISTER(spa->vg_id);
-        VALGRIND_STACK_DEREGISTER(spb->vg_id);
-#endif
+        if (slot->info.key == key)
+            return slot;
+        if (slot->info.key == NULL) {
+            slot->info.key = key;
+            ts_stackprof.used ++;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/* zero the stack so that usage can be measured at death */
+static void
+_zero_a_stack(coevst_t *st) {
+    if (madvise(st->sp, st->size, MADV_DONTNEED))
+        fm_eabort("_zero_a_stack(): madvise() failed", errno);
+    st->zeroed = 1;
+    cstk_dprintf("_zero_a_stack(%p): %zd bytes\n", st, st->size);
+}
+
+/* bytes between the top of a zeroed-at-start stack and the lowest 
+   non-zero word. 0 if it can't tell. */
+static size_t
+_stack_used(coevst_t *st) {
+    unsigned char vec[64];
+    size_t pagesize = ts_stack_bunch.pagesize;
+    size_t npages = st->size / pagesize;
+    size_t i, j, chunk;
+    char *lo = st->sp;
+    
+    for (i = 0; i < npages; i += chunk) {
+        chunk = npages - i;
+        if (chunk > sizeof(vec))
+            chunk = sizeof(vec);
+        if (mincore(lo + i * pagesize, chunk * pagesize, vec))
+            return 0;
+        for (j = 0; j < chunk; j++) {
+            long *w, *end;
+            
+            if (!(vec[j] & 1))
+                continue;
+            w = (long *) (lo + (i + j) * pagesize);
+            end = (long *) (lo + (i + j + 1) * pagesize);
+            while ((w < end) && (*w == 0))
+                w++;
+            if (w < end)
+                return (lo + st->size) - (char *) w;
+        }
+    }
+    return 0;
+}
 
-        spa = span;
-        spb = spbn;
+/* called by the dying coroutine itself */
+static void
+_stackprof_account(coev_t *self) {
+    coev_stackprof_t *info = &self->sprof->info;
+    size_t used = _stack_used(self->stack);
+    
+    self->sprof = NULL;
+    if (used == 0)
+        return;
+    
+    info->samples ++;
+    info->hist[_stack_class(used)] ++;
+    if (used > info->max_used)
+        info->max_used = used;
+    if (info->samples >= COEV_STACKPROF_WARMUP) {
+        int sclass = _stack_class(2 * info->max_used);
         
+        if (sclass < 3)
+            sclass = 3;
+        info->auto_size = ts_stack_bunch.pagesize << sclass;
     }
-    _fm.i.stacks_allocated = 0;
+    cstk_dprintf("_stackprof_account(): [%s] key %p used %zd max %zd auto %zd\n",
+        coev_treepos(self), info->key, used, info->max_used, info->auto_size);
+}
+
+void
+coev_setstackprof(int mode) {
+    ts_stackprof.mode = mode;
+}
+
+int
+coev_getstackprof(coev_stackprof_t *buf, int n) {
+    int i, k = 0;
+    
+    for (i = 0; i < COEV_STACKPROF_SLOTS; i++) {
+        if (ts_stackprof.slots[i].info.key == NULL)
+            continue;
+        if (k < n)
+            memmove(&buf[k], &ts_stackprof.slots[i].info, sizeof(coev_stackprof_t));
+        k ++;
+    }
+    return k;
 }
 
 /* the last, I hope, custom allocator, for the coev_t-s themselves. */
 
-static 
+static TLS_ATTR
 struct _coev_t_bunch {
     coev_t *avail;
     coev_t *busy;
@@ -350,6 +866,30 @@ struct _coev_t_bunch {
 
 static void _coev_dump_busy_bunch(void);
 
+static void
+_coev_busy_link(coev_t *sp) {
+    if (ts_coev_bunch.busy) {
+        assert (ts_coev_bunch.busy->cb_prev == NULL);
+        ts_coev_bunch.busy->cb_prev = sp;
+    }
+    sp->cb_prev = NULL;
+    sp->cb_next = ts_coev_bunch.busy;
+    ts_coev_bunch.busy = sp;
+}
+
+static void
+_coev_busy_unlink(coev_t *sp) {
+    if (sp->cb_prev)
+        sp->cb_prev->cb_next = sp->cb_next;
+    if (sp->cb_next)
+        sp->cb_next->cb_prev = sp->cb_prev;
+    if (sp == ts_coev_bunch.busy) {
+        ts_coev_bunch.busy = sp->cb_next;
+        if (ts_coev_bunch.busy)
+            ts_coev_bunch.busy->cb_prev = NULL;
+    }
+}
+
 static coev_t *
 _get_a_coev(void) {
     coev_t *rv, *prev_avail;
@@ -375,15 +915,7 @@ _get_a_coev(void) {
             ts_coev_bunch.avail = rv->cb_next;
     }
     
-    /* add to the head of the busy list */
-    if (ts_coev_bunch.busy) {
-        assert (ts_coev_bunch.busy->cb_prev == NULL);
-        ts_coev_bunch.busy->cb_prev = rv;
-    }
-    
-    rv->cb_prev = NULL;
-    rv->cb_next = ts_coev_bunch.busy;
-    ts_coev_bunch.busy = rv;
+    _coev_busy_link(rv);
     
     _fm.i.coevs_used ++;
 
@@ -394,15 +926,7 @@ static void
 _return_a_coev(coev_t *sp) {
     
     /* 1. remove from busy list */
-    if (sp->cb_prev)
-        sp->cb_prev->cb_next = sp->cb_next;
-    if (sp->cb_next)
-        sp->cb_next->cb_prev = sp->cb_prev;
-    if (sp == ts_coev_bunch.busy) {
-        ts_coev_bunch.busy = sp->cb_next;
-        if (ts_coev_bunch.busy)
-            ts_coev_bunch.busy->cb_prev = NULL;
-    }
+    _coev_busy_unlink(sp);
 /*
     sp->state = CSTATE_ZERO;
     sp->status = CSW_NONE;
@@ -417,27 +941,24 @@ _return_a_coev(coev_t *sp) {
 }
 
 static void
-_free_coevs(void) {
-    coev_t *spa, *spb, *span, *spbn;
-    spa = ts_coev_bunch.avail;
-    spb = ts_coev_bunch.busy;
-    while (spa || spb) {
-        if (spa)
-            span = spa->cb_next;
-        if (spb)
-            spbn = spb->cb_next;
-        if (spa->treepos)
-            _fm.free(spa->treepos);
-        if (spb->treepos)
-            _fm.free(spb->treepos);
-        if (spa)
-            free(spa);
-        if (spb)
-            free(spb);
-        
-        spa = span;
-        spb = spbn;
+_free_coev_list(coev_t *c) {
+    coev_t *next;
+    
+    while (c) {
+        next = c->cb_next;
+        if (c->treepos)
+            _fm.free(c->treepos);
+        if (c->mwpool)
+            _fm.free(c->mwpool);
+        free(c);
+        c = next;
     }
+}
+
+static void
+_free_coevs(void) {
+    _free_coev_list(ts_coev_bunch.avail);
+    _free_coev_list(ts_coev_bunch.busy);
     /* after this point all pointers to coev_t-s are totally invalid. */
     _fm.i.coevs_allocated = 0;
 }
@@ -447,6 +968,8 @@ _free_coevs(void) {
 static void io_callback(struct ev_loop *, ev_io *, int );
 static void sleep_callback(struct ev_loop *, ev_timer *, int );
 static void iotimeout_callback(struct ev_loop *, ev_timer *, int );
+static void _timeout_disarm(coev_t *);
+static void cnrbuf_io_callback(struct ev_loop *, ev_io *, int );
 
 /** initialize the root coroutine */
 static char *_root_treepos = "0";
@@ -459,7 +982,8 @@ coev_init_root(coev_t *root) {
     ts_root = root;
 
     memset(root, 0, sizeof(coev_t));
-    /* kc/kc_tail init not needed due to memset above */
+    root->cls_slots = root->cls_inline;
+    root->cls_size = CLS_INLINE_SLOTS;
     
     root->parent = NULL;
     root->run = NULL;
@@ -468,9 +992,15 @@ coev_init_root(coev_t *root) {
     root->state = CSTATE_CURRENT;
     root->status = CSW_NONE;
     root->rq_next = NULL;
+    root->rq_prev = NULL;
+    root->rq_prio = -1;
+    root->prio = COEV_PRIO_IO;
     root->lq_next = NULL;
+    root->lq_lock = NULL;
     root->lq_prev = NULL;
     root->child_count = 0;
+    root->tol = -1;
+    root->sw_stamp = _ticks();
     root->treepos = _root_treepos;
     root->treepos_is_stale = 0;
     
@@ -482,43 +1012,242 @@ coev_init_root(coev_t *root) {
 
 /** universal runner */
 static void coev_initialstub(void);
-static void cls_keychain_init(cokeychain_t **);
+static void cls_fini(coev_t *);
 static void coev_evinit(void);
 
-/** return a ready-to-run coroutine
-Note: stack is allocated using anonymous mmap, so be generous, it won't
-eat physical memory until needed. 2Mb is the libc's default on linux. */
-coev_t *
-coev_new(coev_runner_t runner, size_t stacksize) {
-    coevst_t *cstack;
-    coev_t *child;
-    
-    if (!_ev_initialized)
-        coev_evinit();
-    
-    if (ts_current == NULL)
-        fm_abort("coev_new(): library not initialized");
-    
-    if (stacksize < SIGSTKSZ)
-        fm_abort("coev_new(): stack size too small (less than SIGSTKSZ)");
+/* context switch backends.
+
+   _ctx_make() prepares a never-run coroutine to enter coev_initialstub()
+   on the given stack, _ctx_swap() saves current context into origin and
+   resumes target, _ctx_set() resumes target discarding current context.
+   _ctx_swap() returns -1 on failure. */
+
+#ifdef COEV_FASTCTX
+
+/* _coev_fctx_swap(&from->ctx_sp, to->ctx_sp): push callee-saved registers
+   onto the current stack, store the stack pointer, load the target's one,
+   pop its registers and return into it. A never-run coroutine gets a frame
+   that "returns" into coev_initialstub(). No signal mask manipulation. */
+void _coev_fctx_swap(void **from_sp, void *to_sp) __attribute__((visibility("hidden")));
+
+#if defined(__x86_64__)
+
+/* frame, from ctx_sp up: mxcsr+x87 cw, r15, r14, r13, r12, rbx, rbp, rip,
+   then a zero fake return address for coev_initialstub(), so that its 
+   entry sp is 8 mod 16 as the ABI wants. */
+#define FCTX_FRAME_BYTES 72
+#define FCTX_FRAME_PC    7
+
+__asm__ (
+    ".text\n"
+    ".p2align 4\n"
+    ".globl _coev_fctx_swap\n"
+    ".hidden _coev_fctx_swap\n"
+    ".type _coev_fctx_swap,@function\n"
+"_coev_fctx_swap:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size _coev_fctx_swap,.-_coev_fctx_swap\n"
+);
 
-    child = _get_a_coev();
-    cstack = _get_a_stack(stacksize);
-    
-    coev_dprintf("coev_new(): got %p: A=%p X=%p Y=%p S=%p\n", 
-        child, child->A, child->X, child->Y, child->S);
-    
-    if (getcontext(&child->ctx))
-	fm_eabort("coev_new(): getcontext() failed", errno);
-    
-    child->ctx.uc_stack.ss_sp = cstack->sp;
+static void
+_fctx_init_fpu(void **frame) {
+    uint32_t *fpu = (uint32_t *) frame;
+    __asm__ volatile ("stmxcsr %0" : "=m" (fpu[0]));
+    __asm__ volatile ("fnstcw %0" : "=m" (fpu[1]));
+}
+
+#elif defined(__aarch64__)
+
+/* frame, from ctx_sp up: x19-x28, x29 (fp), x30 (lr), d8-d15 */
+#define FCTX_FRAME_BYTES 160
+#define FCTX_FRAME_PC    11
+
+__asm__ (
+    ".text\n"
+    ".p2align 4\n"
+    ".globl _coev_fctx_swap\n"
+    ".hidden _coev_fctx_swap\n"
+    ".type _coev_fctx_swap,%function\n"
+"_coev_fctx_swap:\n"
+    "sub sp, sp, #160\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mov x2, sp\n"
+    "str x2, [x0]\n"
+    "mov sp, x1\n"
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "add sp, sp, #160\n"
+    "ret\n"
+    ".size _coev_fctx_swap,.-_coev_fctx_swap\n"
+);
+
+static void
+_fctx_init_fpu(void **frame) { }
+
+#else
+#error "COEV_FASTCTX is only supported on x86-64 and aarch64"
+#endif
+
+static void
+_ctx_make(coev_t *child, void *stack_lo, size_t size) {
+    void **frame;
+    uintptr_t top;
+
+    top = ((uintptr_t) stack_lo + size) & ~((uintptr_t) 15);
+    frame = (void **) (top - FCTX_FRAME_BYTES);
+    memset(frame, 0, FCTX_FRAME_BYTES);
+    _fctx_init_fpu(frame);
+    frame[FCTX_FRAME_PC] = (void *) coev_initialstub;
+    child->ctx_sp = frame;
+}
+
+static inline int
+_ctx_swap(coev_t *origin, coev_t *target) {
+    _coev_fctx_swap(&origin->ctx_sp, target->ctx_sp);
+    return 0;
+}
+
+static void
+_ctx_set(coev_t *target) {
+    void *discard;
+    _coev_fctx_swap(&discard, target->ctx_sp);
+}
+
+#else /* ucontext backend */
+
+static void
+_ctx_make(coev_t *child, void *stack_lo, size_t size) {
+    if (getcontext(&child->ctx))
+	fm_eabort("coev_new(): getcontext() failed", errno);
+
+    child->ctx.uc_stack.ss_sp = stack_lo;
     /* child->ctx.uc_stack.ss_flags = 0; */
-    child->ctx.uc_stack.ss_size = stacksize;
+    child->ctx.uc_stack.ss_size = size;
     child->ctx.uc_link = &(ts_current->ctx);
+
+    makecontext(&child->ctx, coev_initialstub, 0);
+}
+
+static inline int
+_ctx_swap(coev_t *origin, coev_t *target) {
+    return swapcontext(&origin->ctx, &target->ctx);
+}
+
+static void
+_ctx_set(coev_t *target) {
+    setcontext(&target->ctx);
+}
+
+#endif /* COEV_FASTCTX */
+
+static void _coev_reset(coev_t *child);
+
+/** return a ready-to-run coroutine
+Note: stack is allocated using anonymous mmap, so be generous, it won't
+eat physical memory until needed. 2Mb is the libc's default on linux. 
+It is rounded up to the stack pool size class (power of two pages). */
+coev_t *
+coev_new(coev_runner_t runner, size_t stacksize) {
+    return coev_new_keyed(runner, stacksize, runner);
+}
+
+coev_t *
+coev_new_keyed(coev_runner_t runner, size_t stacksize, const void *key) {
+    coevst_t *cstack;
+    coev_t *child;
+    coevsp_t *sprof = NULL;
+    int sample = 0;
+    
+    if (!ts_ev_initialized)
+        coev_evinit();
+    
+    if (ts_current == NULL)
+        fm_abort("coev_new(): library not initialized");
+    
+    if (stacksize < SIGSTKSZ)
+        fm_abort("coev_new(): stack size too small (less than SIGSTKSZ)");
+    
+    if (ts_stackprof.mode != COEV_STACKPROF_OFF)
+        sprof = _stackprof_find(key);
+    
+    if (sprof) {
+        coev_stackprof_t *info = &sprof->info;
+        
+        info->spawns ++;
+        sample = (info->spawns <= COEV_STACKPROF_WARMUP) 
+              || ((info->spawns % COEV_STACKPROF_EVERY) == 0);
+        if (   (ts_stackprof.mode == COEV_STACKPROF_AUTO) 
+            && info->auto_size 
+            && (info->auto_size < stacksize))
+            stacksize = info->auto_size;
+    }
+
+    child = _get_a_coev();
+    cstack = _get_a_stack(stacksize);
+    
+    coev_dprintf("coev_new(): got %p: A=%p X=%p Y=%p S=%p\n", 
+        child, child->A, child->X, child->Y, child->S);
+    
+    child->sprof = NULL;
+    if (sample) {
+        if (!cstack->zeroed)
+            _zero_a_stack(cstack);
+        child->sprof = sprof;
+    }
+    
     child->stack = cstack;
+    _ctx_make(child, cstack->sp, cstack->size);
     
-    makecontext(&child->ctx, coev_initialstub, 0);
+    child->run = runner;
+    _coev_reset(child);
+    
+    _fm.i.c_news ++;
+    COEV_TRACE(TR_SPAWN, ts_current, child, -1, 0);
     
+    return child;
+}
+
+/* everything but the stack, context, runner and stack profile,
+   for coev_new_keyed() and coev_unpark() */
+static void
+_coev_reset(coev_t *child) {
     child->id = ts_count++;
     
     child->child_count = 0;
@@ -526,29 +1255,38 @@ coev_new(coev_runner_t runner, size_t stacksize) {
     ts_current->child_count ++;
     
     child->treepos_is_stale = 1;
-    child->run = runner;
     child->state = CSTATE_RUNNABLE;
     child->status = CSW_NONE;
     child->rq_next = NULL;
+    child->rq_prev = NULL;
+    child->rq_prio = -1;
+    child->prio = COEV_PRIO_IO;
     child->lq_next = NULL;
+    child->lq_lock = NULL;
     child->lq_prev = NULL;
+    child->cq_queue = NULL;
+    child->dl_depth = 0;
+    child->dl_clamped = 0;
+    child->cancel_pending = 0;
+#ifdef THREADING_MADNESS
+    child->thread = pthread_self();
+    child->stealable = 0;
+#endif
 
-    {
-        cokeychain_t *kc = &child->kc;
-        cls_keychain_init(&kc);
-    }
-    
-    child->kc_tail = NULL;
+    memset(child->cls_inline, 0, sizeof(child->cls_inline));
+    child->cls_slots = child->cls_inline;
+    child->cls_size = CLS_INLINE_SLOTS;
     child->origin = NULL;
+    child->cpu_ticks = 0;
+    child->sw_count = 0;
+    child->sw_stamp = _ticks();
     
     ev_init(&child->watcher, io_callback);
     ev_timer_init(&child->io_timer, iotimeout_callback, 23., 42.);
     ev_set_priority(&child->io_timer, -1);
+    child->tol = -1;
+    child->to_next = child->to_prev = NULL;
     ev_timer_init(&child->sleep_timer, sleep_callback, 23., 42.);
-    
-    _fm.i.c_news ++;
-    
-    return child;
 }
 
 /* tree position reporting */
@@ -624,7 +1362,7 @@ coev_treepos(coev_t *coio) {
     return coio->treepos;
 }
 
-coev_t *
+COEV_NOINLINE coev_t *
 coev_current(void) {
     return ts_current;
 }
@@ -639,6 +1377,10 @@ str_coev_state[] = {
     "SLEEP    ",
     "LOCKWAIT ",
     "DEAD     ",
+    "CHANWAIT ",
+    "SYNCWAIT ",
+    "OFFLOAD  ",
+    "CHILDWAIT",
     0
 };
 
@@ -651,8 +1393,8 @@ str_coev_status[] = {
     "TIMEOUT  ",
     "YOURTURN ",
     "SIGCHLD  ",
-    "(not defined)",
-    "(not defined)",
+    "DEADLINE ",
+    "CANCELLED",
     "(less than an error)",
     "SCHEDULER_NEEDED ",
     "TARGET_SELF",
@@ -750,6 +1492,10 @@ coev_switch(coev_t *target) {
         
         case CSTATE_IOWAIT:
         case CSTATE_SLEEP:
+        case CSTATE_CHANWAIT:
+        case CSTATE_SYNCWAIT:
+        case CSTATE_OFFLOAD:
+        case CSTATE_CHILDWAIT:
             origin->status = CSW_TARGET_BUSY;
             origin->origin = origin;
             return;
@@ -773,8 +1519,10 @@ coev_switch(coev_t *target) {
     ts_current = target;
     
     cstk_dump("before switch\n");
+    _account_switch(origin, target, _ticks());
+    COEV_TRACE(TR_SWITCH, origin, target, -1, CSW_VOLUNTARY);
     
-    if (swapcontext(&origin->ctx, &target->ctx) == -1)
+    if (_ctx_swap(origin, target) == -1)
         fm_abort("coev_switch(): swapcontext() failed.");
     
     cstk_dump("after switch\n");
@@ -794,12 +1542,11 @@ coev_stop_watchers(coev_t *subject) {
     ev_io_stop(ts_scheduler.loop, &subject->watcher);
     
     /* stop timers */
-    ev_timer_stop(ts_scheduler.loop, &subject->io_timer);
+    _timeout_disarm(subject);
     ev_timer_stop(ts_scheduler.loop, &subject->sleep_timer);
     
 }
 
-static void cls_keychain_fini(cokeychain_t *);
 
 /* goes and releases all dead up the ancestor chain.
    returns first unreleasable ancestor. NULL on total fail. */
@@ -819,7 +1566,7 @@ _coev_sweep(coev_t *suspect) {
         
         parent = suspect->parent;
         _return_a_stack(suspect->stack);
-        cls_keychain_fini(suspect->kc.next);
+        cls_fini(suspect);
         _return_a_coev(suspect);
         parent->child_count --;
         suspect = parent;
@@ -828,13 +1575,43 @@ _coev_sweep(coev_t *suspect) {
     return NULL;
 }
 
+static void _coev_die(coev_t *self);
+
+/* who gets control from a dying or parking coroutine:
+   first switchable one up from the given ancestor */
+static coev_t *
+_coev_heir(coev_t *parent) {
+    /* find switchable target by ignoring dead and busy coroutines */
+    while (    (parent != NULL)
+            && (parent->state != CSTATE_RUNNABLE) )
+        parent = parent->parent;
+
+    if (!parent) {
+        if (ts_scheduler.scheduler && (ts_scheduler.scheduler->state == CSTATE_RUNNABLE) )
+            /* here if scheduler is in another branch AND root is not RUNNABLE/SCHEDULED. */
+            parent = ts_scheduler.scheduler;
+        else
+            fm_abort("_coev_die(): absolutely no one to cede control to.");
+    }
+    return parent;
+}
+
 /** the first and last function that runs in the coroutine */
 static void 
 coev_initialstub(void) {
     coev_t *self = ts_current;
-    coev_t *parent;
 
     self->run(self);
+    _coev_die(self);
+}
+
+/* the coroutine might have been migrated while in run() */
+static COEV_NOINLINE void
+_coev_die(coev_t *self) {
+    coev_t *parent;
+    
+    if (self->sprof)
+        _stackprof_account(self);
     
     coev_dprintf("[%s] dead: parent [%s] origin [%s] A=%p X=%p Y=%p S=%p\n",
         coev_treepos(self), coev_treepos(self->parent), coev_treepos(self->origin),
@@ -842,36 +1619,104 @@ coev_initialstub(void) {
     
     /* clean up any scheduler stuff */
     coev_stop_watchers(self);
+    coev_runq_remove(self);
     
     /* die */
     self->state = CSTATE_DEAD;
     
     /* release resources */
-    parent = _coev_sweep(self);
+    parent = _coev_heir(_coev_sweep(self));
+    
+    parent->state  = CSTATE_CURRENT;
+    parent->status = CSW_SIGCHLD;
+    parent->origin = self;
+    ts_current = parent;
 
-    /* find switchable target by ignoring dead and busy coroutines */
-    while (    (parent != NULL)
-            && (parent->state != CSTATE_RUNNABLE) )
-        parent = parent->parent;
+    coev_dprintf("_coev_die(): switching to [%s]\n", coev_treepos(parent));
+    _account_switch(self, parent, _ticks());
+    COEV_TRACE(TR_DEATH, self, parent, -1, 0);
+    COEV_TRACE(TR_SWITCH, self, parent, -1, CSW_SIGCHLD);
 
-    if (!parent) {
-        if (ts_scheduler.scheduler && (ts_scheduler.scheduler->state == CSTATE_RUNNABLE) )
-            /* here if scheduler is in another branch AND root is not RUNNABLE/SCHEDULED. */
-            parent = ts_scheduler.scheduler;
-        else
-            fm_abort("coev_initialstub(): absolutely no one to cede control to.");
-    }
+    _ctx_set(parent);
+    
+    fm_abort("_coev_die(): setcontext() returned. This cannot be.");
+}
+
+/* coroutine reuse.
+
+   A parked coroutine is dead to everyone else: its parent gets the 
+   usual CSW_SIGCHLD with it as the origin, and switches to it or 
+   scheduling it fail as for a dead one. It's unlinked from the tree,
+   so it does not keep its ancestors from being released, but keeps its
+   coev_t, stack and whatever its runner has on that stack. 
+   coev_unpark() gives it a new parent and a fresh identity, and the 
+   first switch into it returns from coev_park(). */
+int
+coev_park(void) {
+    coev_t *self = ts_current;
+    coev_t *parent;
+    
+    /* children would release us when they die */
+    if ((self == ts_root) || (self == ts_scheduler.scheduler) || self->child_count)
+        return -1;
+    
+    if (self->sprof)
+        _stackprof_account(self);
+    
+    coev_dprintf("[%s] parked: parent [%s] A=%p X=%p Y=%p S=%p\n",
+        coev_treepos(self), coev_treepos(self->parent),
+        self->A, self->X, self->Y, self->S );
+    
+    coev_stop_watchers(self);
+    coev_runq_remove(self);
+    cls_fini(self);
+    self->state = CSTATE_DEAD;
+    
+    parent = self->parent;
+    self->parent = NULL;
+    self->treepos_is_stale = 1;
+    parent->child_count --;
+    parent = _coev_heir(_coev_sweep(parent));
     
     parent->state  = CSTATE_CURRENT;
     parent->status = CSW_SIGCHLD;
     parent->origin = self;
     ts_current = parent;
+    
+    _fm.i.c_parks ++;
+    _account_switch(self, parent, _ticks());
+    COEV_TRACE(TR_DEATH, self, parent, -1, 0);
+    COEV_TRACE(TR_SWITCH, self, parent, -1, CSW_SIGCHLD);
+    
+    if (_ctx_swap(self, parent) == -1)
+        fm_abort("coev_park(): swapcontext() failed.");
+    
+    /* unparked and switched into */
+    return 0;
+}
 
-    coev_dprintf("coev_initialstub(): switching to [%s]\n", coev_treepos(parent));
-
-    setcontext(&parent->ctx);
+int
+coev_unpark(coev_t *c, size_t stacksize, const void *key) {
+    if ((c->state != CSTATE_DEAD) || (c->parent != NULL))
+        fm_abort("coev_unpark(): coroutine is not parked");
+    
+    if (stacksize && (ts_stackprof.mode == COEV_STACKPROF_AUTO)) {
+        coevsp_t *sprof = _stackprof_find(key);
+        
+        if (   sprof 
+            && sprof->info.auto_size 
+            && (sprof->info.auto_size < stacksize))
+            stacksize = sprof->info.auto_size;
+    }
+    if (c->stack->size < stacksize)
+        return -1;
     
-    fm_abort("coev_initialstub(): setcontext() returned. This cannot be.");
+    _coev_reset(c);
+    c->sprof = NULL;
+    
+    _fm.i.c_unparks ++;
+    COEV_TRACE(TR_SPAWN, ts_current, c, -1, 0);
+    return 0;
 }
 
 /* ioscheduler functions */
@@ -884,58 +1729,114 @@ intsig_cb(struct ev_loop *loop, ev_signal *w, int signum) {
     _fm.inthdlr();
 }
 
+/* runqueues are doubly linked, so that switch into a scheduled 
+   coroutine is O(1). coev_t::rq_prio tells which one it is in. */
 static void
 coev_runq_remove(coev_t *subject) {
-    coev_t *t = ts_scheduler.runq_head;
+    struct _coev_runqueue *rq;
     
-    if ( ts_scheduler.runq_head == subject ) {
-	ts_scheduler.runq_head = subject->rq_next;
-	return;
-    }
+    if (subject->rq_prio < 0)
+        return;
+    rq = &ts_scheduler.runq[subject->rq_prio];
     
-    while (t) {
-        if (t->rq_next == subject) {
-            t->rq_next = subject->rq_next;
-            return;
-        }
-        t = t->rq_next;
-    }
+    /* keep current pass boundary */
+    if (rq->pass_last == subject)
+        rq->pass_last = subject->rq_prev;
+    
+    if (subject->rq_prev)
+        subject->rq_prev->rq_next = subject->rq_next;
+    else
+        rq->head = subject->rq_next;
+    
+    if (subject->rq_next)
+        subject->rq_next->rq_prev = subject->rq_prev;
+    else
+        rq->tail = subject->rq_prev;
+    
+    subject->rq_next = subject->rq_prev = NULL;
+    subject->rq_prio = -1;
+#ifdef THREADING_MADNESS
+    ts_scheduler.runq_len --;
+#endif
 }
 
 static int
-coev_runq_append(coev_t *waiter) {
+coev_runq_append(coev_t *waiter, int prio) {
+    struct _coev_runqueue *rq = &ts_scheduler.runq[prio];
+    
+    coev_runq_remove(waiter);
+    
     waiter->rq_next = NULL;
+    waiter->rq_prev = rq->tail;
+    waiter->rq_prio = prio;
+    waiter->rq_stamp = _ticks();
     
-    if (ts_scheduler.runq_tail != NULL)
-	ts_scheduler.runq_tail->rq_next = waiter;
+    if (rq->tail != NULL)
+	rq->tail->rq_next = waiter;
+    else
+	rq->head = waiter;
     
-    ts_scheduler.runq_tail = waiter;    
-	
-    if (ts_scheduler.runq_head == NULL)
-	ts_scheduler.runq_head = waiter;
+    rq->tail = waiter;
+#ifdef THREADING_MADNESS
+    ts_scheduler.runq_len ++;
+#endif
     
     return 0;
 }
 
+static int
+coev_runq_empty(void) {
+    int i;
+    
+    for (i = 0; i < COEV_PRIO_LEVELS; i++)
+        if (ts_scheduler.runq[i].head)
+            return 0;
+    return 1;
+}
+
 static void
 _runq_dump(const char *header) {
-    coev_t *next = ts_scheduler.runq_head;
+    coev_t *next;
+    int i;
+    
     coev_dprintf("%s\n", header);
     
-    if (!next)
+    if (coev_runq_empty())
         coev_dprintf("    RUNQUEUE EMPTY\n");
     
-    while (next) {
-        coev_dprintf("    <%p> [%s] %s %s\n", next, coev_treepos(next),
-            str_coev_state[next->state], str_coev_status[next->status] );
-        if (next == next->rq_next)
-            fm_abort("_runq_dump(): runqueue loop detected");
-        next = next->rq_next;
+    for (i = 0; i < COEV_PRIO_LEVELS; i++) {
+        next = ts_scheduler.runq[i].head;
+        if (next)
+            coev_dprintf("  PRIO %d (pass last %p):\n", i, ts_scheduler.runq[i].pass_last);
+        while (next) {
+            coev_dprintf("    <%p> [%s] %s %s\n", next, coev_treepos(next),
+                str_coev_state[next->state], str_coev_status[next->status] );
+            if (next == next->rq_next)
+                fm_abort("_runq_dump(): runqueue loop detected");
+            next = next->rq_next;
+        }
     }
 }
 
 int
-coev_schedule(coev_t *waiter) {    
+coev_setprio(coev_t *subject, int prio) {
+    if ((prio < 0) || (prio >= COEV_PRIO_LEVELS))
+        return -1;
+    subject->prio = prio;
+    return 0;
+}
+
+int
+coev_schedule(coev_t *waiter) {
+    return coev_schedule_prio(waiter, waiter->prio);
+}
+
+int
+coev_schedule_prio(coev_t *waiter, int prio) {
+    if ((prio < 0) || (prio >= COEV_PRIO_LEVELS))
+        return CSCHED_BADPRIO;
+    CROSSTHREAD_CHECK(waiter, CSCHED_NOTMOVABLE);
+    
     switch(waiter->state) {
 	case CSTATE_ZERO:
         case CSTATE_DEAD:
@@ -944,6 +1845,10 @@ coev_schedule(coev_t *waiter) {
         case CSTATE_IOWAIT:
         case CSTATE_SLEEP:
         case CSTATE_SCHEDULED:
+        case CSTATE_CHANWAIT:
+        case CSTATE_SYNCWAIT:
+        case CSTATE_OFFLOAD:
+        case CSTATE_CHILDWAIT:
             return CSCHED_ALREADY;
         
         case CSTATE_CURRENT:
@@ -955,7 +1860,8 @@ coev_schedule(coev_t *waiter) {
     
     waiter->state = CSTATE_SCHEDULED;
     waiter->status = CSW_YOURTURN;
-    coev_runq_append(waiter);
+    coev_runq_append(waiter, prio);
+    COEV_TRACE(TR_WAKEUP, waiter, ts_current, -1, CSW_YOURTURN);
     coev_dprintf("coev_schedule: [%s] %s scheduled.\n",
         coev_treepos(waiter), str_coev_state[waiter->state]);
     ts_scheduler.slackers++;
@@ -993,19 +1899,198 @@ coev_is_scheduling(void) {
     return (ts_scheduler.scheduler != NULL) ? 1 : 0;
 }
 
+/*  I/O timeouts.
+    
+    almost all of them are one of a few constants (iop_timeout and such),
+    so waiters with the same timeout value are kept in a FIFO list, which
+    thus is ordered by deadline, with a single ev_timer per list set for
+    its head. arming and disarming is O(1) list work, the ev_timer gets 
+    touched only when it fires: it either expires the heads that are due,
+    or, if the head was removed meanwhile, gets reset for the new one.
+    
+    a list's slot in ts_scheduler.tol[] is taken by the first wait with
+    its value and given back when the list's timer fires and finds it
+    empty, so one-off values only hold a slot while they are waited on.
+    values that don't fit get their own coev_t::io_timer as before. so
+    do waits cut down to a deadline's remainder, and the waits that are
+    not for I/O -- locks, queues, child processes, which have whatever
+    timeout the user asked for: _timer_arm(). coev_sleep() always does. */
+
+static void
+_tol_unlink(coev_t *c) {
+    struct _coev_tolist *l = &ts_scheduler.tol[c->tol];
+    
+    if (c->to_prev)
+        c->to_prev->to_next = c->to_next;
+    else
+        l->head = c->to_next;
+    if (c->to_next)
+        c->to_next->to_prev = c->to_prev;
+    else
+        l->tail = c->to_prev;
+    c->to_next = c->to_prev = NULL;
+    c->tol = -1;
+}
+
+static struct _coev_tolist *
+_tol_find(ev_tstamp timeout) {
+    struct _coev_tolist *free = NULL;
+    int i;
+    
+    for (i = 0; i < ts_scheduler.tol_count; i++) {
+        if (ts_scheduler.tol[i].timeout == timeout)
+            return &ts_scheduler.tol[i];
+        if ((ts_scheduler.tol[i].timeout == 0.0) && !free)
+            free = &ts_scheduler.tol[i];
+    }
+    if (free)
+        free->timeout = timeout;
+    return free;
+}
+
+static void _iowait_timed_out(coev_t *);
+static void _lockwait_timed_out(coev_t *);
+static void _waitq_timed_out(coev_t *);
+
+static void
+tol_callback(struct ev_loop *loop, ev_timer *w, int revents) {
+    struct _coev_tolist *l = (struct _coev_tolist *) ( ((char *)w) - offsetof(struct _coev_tolist, timer) );
+    ev_tstamp now = ev_now(loop);
+    coev_t *c;
+    
+    while (l->head && (l->head->deadline <= now)) {
+        c = l->head;
+        _tol_unlink(c);
+        _iowait_timed_out(c);
+    }
+    
+    if (l->head) {
+        ev_timer_set(w, l->head->deadline - now, 0.);
+        ev_timer_start(loop, w);
+        _fm.i.c_iotimer_ops ++;
+    } else
+        l->timeout = 0.0; /* slot's free */
+}
+
+static void
+_timer_arm(coev_t *self, ev_tstamp timeout) {
+    if (timeout <= 0.0)
+        return;
+    self->io_timer.repeat = timeout;
+    ev_timer_again(ts_scheduler.loop, &self->io_timer);
+    _fm.i.c_iotimer_ops ++;
+}
+
+/* an I/O wait's timeout */
+static void
+_timeout_arm(coev_t *self, ev_tstamp timeout) {
+    struct _coev_tolist *l;
+    
+    if (timeout <= 0.0)
+        return;
+    
+    l = self->dl_clamped ? NULL : _tol_find(timeout);
+    if (l == NULL) {
+        _timer_arm(self, timeout);
+        return;
+    }
+    
+    self->deadline = ev_now(ts_scheduler.loop) + timeout;
+    self->tol = l - ts_scheduler.tol;
+    self->to_next = NULL;
+    self->to_prev = l->tail;
+    if (l->tail)
+        l->tail->to_next = self;
+    else
+        l->head = self;
+    l->tail = self;
+    
+    if (!ev_is_active(&l->timer)) {
+        ev_timer_set(&l->timer, timeout, 0.);
+        ev_timer_start(ts_scheduler.loop, &l->timer);
+        _fm.i.c_iotimer_ops ++;
+    }
+}
+
+static void
+_timeout_disarm(coev_t *self) {
+    if (self->tol >= 0)
+        _tol_unlink(self);
+    else if (ev_is_active(&self->io_timer)) {
+        ev_timer_stop(ts_scheduler.loop, &self->io_timer);
+        _fm.i.c_iotimer_ops ++;
+    }
+}
+
+void
+coev_settimeoutlists(int n) {
+    if (n < 0)
+        n = 0;
+    if (n > COEV_TIMEOUT_LISTS)
+        n = COEV_TIMEOUT_LISTS;
+    ts_scheduler.tol_count = n;
+}
+
+/* status of a wait that did not get what it waited for */
+static int
+_timeout_status(coev_t *c) {
+    if (c->cancel_pending) {
+        c->cancel_pending = 0;
+        _fm.i.c_cancels ++;
+        return CSW_CANCELLED;
+    }
+    if (c->dl_clamped) {
+        _fm.i.c_deadlines ++;
+        return CSW_DEADLINE;
+    }
+    return CSW_TIMEOUT;
+}
+
+/* errno for the above */
+static int
+_wait_errno(coev_t *c) {
+    return c->status == CSW_CANCELLED ? ECANCELED : ETIMEDOUT;
+}
+
+/* clamps the timeout (<= 0 is none) of a wait about to start to the 
+   deadline. -1 with status set if the wait is not to start at all. */
+static int
+_wait_bound(coev_t *self, ev_tstamp *timeout) {
+    ev_tstamp left;
+    
+    self->dl_clamped = 0;
+    if (!self->dl_depth && !self->cancel_pending)
+        return 0;
+    if (!self->cancel_pending) {
+        ev_now_update(ts_scheduler.loop);
+        left = self->dl_stack[self->dl_depth - 1] - ev_now(ts_scheduler.loop);
+        if ((left > 0.0) && (*timeout > 0.0) && (*timeout <= left))
+            return 0;
+        self->dl_clamped = 1;
+        if (left > 0.0) {
+            *timeout = left;
+            return 0;
+        }
+    }
+    self->status = _timeout_status(self);
+    self->origin = self;
+    return -1;
+}
+
 /* in your io_scheduler, stopping your watcher, switching to your waiter */
 static void 
 io_callback(struct ev_loop *loop, ev_io *w, int revents) {
     coev_t *waiter = (coev_t *) ( ((char *)w) - offsetof(coev_t, watcher) );
     ev_io_stop(loop, w);
-    ev_timer_stop(ts_scheduler.loop, &waiter->io_timer);
+    _timeout_disarm(waiter);
     
     assert(waiter->state == CSTATE_IOWAIT);
     
     waiter->state = CSTATE_SCHEDULED;
     waiter->status = CSW_EVENT;
-    coev_runq_append(waiter);
+    coev_runq_append(waiter, waiter->prio);
     ts_scheduler.waiters -= 1;
+    COEV_TRACE(TR_WAKEUP, waiter, NULL, waiter->watcher.fd, CSW_EVENT);
     
     coev_dprintf("io_callback(): [%s] revents=%d\n", coev_treepos(waiter), revents);
 }
@@ -1014,17 +2099,32 @@ static void
 iotimeout_callback(struct ev_loop *loop, ev_timer *w, int revents) {
     coev_t *waiter = (coev_t *) ( ((char *)w) - offsetof(coev_t, io_timer) );
 
-    ev_io_stop(ts_scheduler.loop, &waiter->watcher);
     ev_timer_stop(ts_scheduler.loop, w);
+    _iowait_timed_out(waiter);
+}
+
+static void
+_iowait_timed_out(coev_t *waiter) {
+    if (waiter->state == CSTATE_LOCKWAIT) {
+        _lockwait_timed_out(waiter);
+        return;
+    }
+    if (   (waiter->state == CSTATE_CHANWAIT) || (waiter->state == CSTATE_SYNCWAIT)
+        || (waiter->state == CSTATE_CHILDWAIT)) {
+        _waitq_timed_out(waiter);
+        return;
+    }
+    ev_io_stop(ts_scheduler.loop, &waiter->watcher);
     
     assert(waiter->state == CSTATE_IOWAIT);
 
     waiter->state = CSTATE_SCHEDULED;
-    waiter->status = CSW_TIMEOUT; /* this is timeout */    
-    coev_runq_append(waiter);
+    waiter->status = _timeout_status(waiter);
+    coev_runq_append(waiter, waiter->prio);
     ts_scheduler.waiters--;
+    COEV_TRACE(TR_TIMEOUT, waiter, NULL, waiter->watcher.fd, waiter->status);
     
-    coev_dprintf("iotimeout_callback(): [%s].\n", coev_treepos(waiter));
+    coev_dprintf("_iowait_timed_out(): [%s].\n", coev_treepos(waiter));
 }
 
 static void
@@ -1036,18 +2136,372 @@ sleep_callback(struct ev_loop *loop, ev_timer *w, int revents) {
     assert(waiter->state == CSTATE_SLEEP);
     
     waiter->state = CSTATE_SCHEDULED;
-    waiter->status = CSW_WAKEUP; /* this is scheduled */
-    coev_runq_append(waiter);
+    waiter->status = waiter->dl_clamped ? _timeout_status(waiter) : CSW_WAKEUP;
+    coev_runq_append(waiter, waiter->prio);
     ts_scheduler.waiters--;
+    COEV_TRACE(TR_WAKEUP, waiter, NULL, -1, waiter->status);
     
     coev_dprintf("sleep_callback(): [%s]\n", coev_treepos(waiter));
 }
 
-/* sets current coro to wait for revents on fd, switches to scheduler */
-void 
-coev_wait(int fd, int revents, ev_tstamp timeout) {
+#ifdef COEV_URING
+/*  io_uring backend.
+
+    libev stays the thing coev_loop() blocks in (timers, signals, sleeps),
+    the ring fd being just another ev_io watcher that fires when there 
+    are completions. coev_wait() iowaits and cnrbuf/coev_send() transfers 
+    that would block are queued as SQEs -- a poll-add or the recv/send 
+    itself, each with a linked timeout if there is one -- and submitted 
+    all at once with one io_uring_enter() before coev_loop() blocks or 
+    polls. Completions are reaped from the shared CQ ring without syscalls.
+    
+    No liburing: raw syscalls and the kernel's ABI header. Falls back to 
+    the plain libev path if the ring can't be set up. */
+
+#define URING_IGNORE 1   /* user_data of linked timeouts: coev_t-s are aligned */
+#define URING_INFLIGHT INT_MIN /* io_result while the op is queued */
+
+static void _uring_reap(void);
+
+static int
+_uring_enter(unsigned to_submit, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ts_scheduler.ring.fd, to_submit, 0, flags, NULL, 0);
+}
+
+static void _uring_cb(struct ev_loop *, ev_io *, int);
+
+static void
+_uring_init(void) {
+    struct _coev_uring *r = &ts_scheduler.ring;
+    struct io_uring_params p;
+    char *sq;
+    
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * COEV_URING_ENTRIES;
+    
+    r->fd = syscall(__NR_io_uring_setup, COEV_URING_ENTRIES, &p);
+    if (r->fd == -1) {
+        coev_dprintf("_uring_init(): io_uring_setup() failed: %s, using libev.\n", strerror(errno));
+        return;
+    }
+    if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        coev_dprintf("_uring_init(): kernel too old, using libev.\n");
+        close(r->fd);
+        r->fd = -1;
+        return;
+    }
+    
+    r->ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (r->ring_sz < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        r->ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    
+    sq = mmap(NULL, r->ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, 
+                r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        fm_eabort("_uring_init(): mmap(SQ_RING) failed", errno);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, 
+                r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        fm_eabort("_uring_init(): mmap(SQES) failed", errno);
+    
+    r->ring = sq;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(sq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(sq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    r->local_tail = *r->sq_tail;
+    
+    r->ts = _fm.malloc(r->entries * sizeof(struct __kernel_timespec));
+    if (!r->ts)
+        fm_abort("_uring_init(): timespec array allocation failed.");
+    
+    ev_io_init(&r->w, _uring_cb, r->fd, EV_READ);
+    ev_io_start(ts_scheduler.loop, &r->w);
+}
+
+static void
+_uring_fini(void) {
+    struct _coev_uring *r = &ts_scheduler.ring;
+    
+    if (r->fd == -1)
+        return;
+    ev_io_stop(ts_scheduler.loop, &r->w);
+    munmap(r->sqes, r->sqes_sz);
+    munmap(r->ring, r->ring_sz);
+    close(r->fd);
+    _fm.free(r->ts);
+    r->fd = -1;
+}
+
+/* readable from after a switch, see COEV_NOINLINE */
+static COEV_NOINLINE int
+_uring_active(void) {
+    return ts_scheduler.ring.fd != -1;
+}
+
+/* hand everything prepared so far to the kernel */
+static void
+_uring_submit(void) {
+    struct _coev_uring *r = &ts_scheduler.ring;
+    unsigned pending;
+    int rv;
+    
+    __atomic_store_n(r->sq_tail, r->local_tail, __ATOMIC_RELEASE);
+    
+    while ((pending = r->local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) > 0) {
+        rv = _uring_enter(pending, 0);
+        _fm.i.c_uring_enters ++;
+        if (rv >= 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        if ((errno == EBUSY) || (errno == EAGAIN)) {
+            /* completion backlog: make room */
+            _uring_reap();
+            continue;
+        }
+        fm_eabort("_uring_submit(): io_uring_enter() failed", errno);
+    }
+}
+
+/* next free SQE, with room for n in total so linked ones 
+   don't get split between two submissions. */
+static struct io_uring_sqe *
+_uring_sqe(unsigned n) {
+    struct _coev_uring *r = &ts_scheduler.ring;
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+    
+    if (r->local_tail + n - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->entries)
+        _uring_submit();
+    
+    idx = r->local_tail & r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    r->local_tail ++;
+    _fm.i.c_uring_sqes ++;
+    return sqe;
+}
+
+/* queue the op, plus a linked timeout if there is one */
+static void
+_uring_queue(struct io_uring_sqe *sqe, ev_tstamp timeout) {
+    struct _coev_uring *r = &ts_scheduler.ring;
+    struct io_uring_sqe *tsqe;
+    struct __kernel_timespec *ts;
+    coev_t *self = (coev_t *)(uintptr_t) sqe->user_data;
+    
+    self->io_deadline = 0.0;
+    if (timeout <= 0.0)
+        return;
+    self->io_deadline = ev_now(ts_scheduler.loop) + timeout;
+    
+    sqe->flags |= IOSQE_IO_LINK;
+    tsqe = _uring_sqe(1);
+    /* timespec is read at submission, slot is reused only after that */
+    ts = &r->ts[tsqe - r->sqes];
+    ts->tv_sec = (long long) timeout;
+    ts->tv_nsec = (long long) ((timeout - ts->tv_sec) * 1e9);
+    tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+    tsqe->addr = (uintptr_t) ts;
+    tsqe->len = 1;
+    tsqe->user_data = URING_IGNORE;
+}
+
+static void
+_uring_poll(coev_t *self, int fd, int revents, ev_tstamp timeout) {
+    struct io_uring_sqe *sqe = _uring_sqe(2);
+    unsigned mask = 0;
+    
+    if (revents & COEV_READ)
+        mask |= POLLIN;
+    if (revents & COEV_WRITE)
+        mask |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = (uintptr_t) self;
+    self->io_result = URING_INFLIGHT;
+    self->io_fd = fd;
+    self->io_events = revents;
+    _uring_queue(sqe, timeout);
+}
+
+/* for coev_cancel(): the op completes with -ECANCELED */
+static void
+_uring_cancel(coev_t *waiter) {
+    struct io_uring_sqe *sqe = _uring_sqe(1);
+    
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) waiter;
+    sqe->user_data = URING_IGNORE;
+}
+
+/* a completion: same as io_callback()/iotimeout_callback() */
+static void
+_uring_complete(coev_t *waiter, int res) {
+    assert(waiter->state == CSTATE_IOWAIT);
+    
+    waiter->io_result = res;
+    waiter->state = CSTATE_SCHEDULED;
+    /* op canceled by its linked timeout or coev_cancel() */
+    waiter->status = (res == -ECANCELED) ? _timeout_status(waiter) : CSW_EVENT;
+    coev_runq_append(waiter, waiter->prio);
+    ts_scheduler.waiters -= 1;
+    COEV_TRACE(waiter->status != CSW_EVENT ? TR_TIMEOUT : TR_WAKEUP, 
+        waiter, NULL, -1, waiter->status);
+    
+    coev_dprintf("_uring_complete(): [%s] res=%d\n", coev_treepos(waiter), res);
+}
+
+static void
+_uring_reap(void) {
+    struct _coev_uring *r = &ts_scheduler.ring;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    
+    do {
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &r->cqes[head & r->cq_mask];
+            if (cqe->user_data != URING_IGNORE)
+                _uring_complete((coev_t *)(uintptr_t) cqe->user_data, cqe->res);
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        
+        /* kernel kept what did not fit, have it flushed */
+        if (!(__atomic_load_n(r->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+            break;
+        _uring_enter(0, IORING_ENTER_GETEVENTS);
+        _fm.i.c_uring_enters ++;
+    } while (1);
+}
+
+static void
+_uring_cb(struct ev_loop *loop, ev_io *w, int revents) {
+    _uring_reap();
+}
+
+/* called by coev_loop() once per pass, before it gets into ev_loop() */
+static void
+_uring_flush(void) {
+    struct _coev_uring *r = &ts_scheduler.ring;
+    
+    if (r->fd == -1)
+        return;
+    if (r->local_tail != *r->sq_tail)
+        _uring_submit();
+    /* whatever completed right away saves a trip through epoll */
+    if (*r->cq_head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        _uring_reap();
+}
+
+/*  after fork(): the ring, and the ops in flight on it, are the parent's, 
+    so none of ours would ever complete. get our own ring and queue the 
+    polls again, with what is left of their timeouts, or on libev if the
+    ring can't be had. recv/send complete with -EAGAIN, which makes 
+    _uring_xfer() fall back to a readiness poll: they never ran here. */
+static void
+_uring_forked(void) {
+    coev_t *c;
+    ev_tstamp left;
+    
+    if (ts_scheduler.ring.fd == -1)
+        return;
+    _uring_fini();
+    _uring_init();
+    ev_now_update(ts_scheduler.loop);
+    for (c = ts_coev_bunch.busy; c != NULL; c = c->cb_next) {
+        if ((c->state != CSTATE_IOWAIT) || (c->io_result != URING_INFLIGHT))
+            continue;
+        left = 0.0;
+        if (c->io_deadline > 0.0)
+            left = c->io_deadline - ev_now(ts_scheduler.loop);
+        if (c->cancel_pending || ((c->io_deadline > 0.0) && (left <= 0.0))) {
+            /* as if its linked timeout or _uring_cancel() got it */
+            _uring_complete(c, -ECANCELED);
+            continue;
+        }
+        if (c->io_fd == -1)
+            _uring_complete(c, -EAGAIN);
+        else if (ts_scheduler.ring.fd != -1)
+            _uring_poll(c, c->io_fd, c->io_events, left);
+        else {
+            c->io_result = 0;
+            _timer_arm(c, left);
+            ev_io_init(&c->watcher, io_callback, c->io_fd, c->io_events);
+            ev_io_start(ts_scheduler.loop, &c->watcher);
+        }
+    }
+}
+
+static int _wait_check(coev_t *self);
+static void _wait_switch(coev_t *self);
+
+/* recv()/send() as a ring op.  returns 1 if the socket said EAGAIN 
+   anyway (older kernels do so for non-blocking ones), so that caller 
+   falls back to waiting for readiness. */
+static int
+_uring_xfer(int op, int fd, void *buf, size_t len, ev_tstamp timeout, ssize_t *rv) {
     coev_t *self = ts_current;
+    struct io_uring_sqe *sqe;
+    
+    if (_wait_check(self))
+        fm_abort("_uring_xfer(): can't wait here");
+    if (_wait_bound(self, &timeout)) {
+        errno = _wait_errno(self);
+        *rv = -1;
+        return 0;
+    }
     
+    sqe = _uring_sqe(2);
+    sqe->opcode = (op == COEV_READ) ? IORING_OP_RECV : IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->msg_flags = (op == COEV_READ) ? 0 : MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) self;
+    self->io_result = URING_INFLIGHT;
+    self->io_fd = -1;
+    _uring_queue(sqe, timeout);
+    
+    _fm.i.c_waits++;
+    self->state = CSTATE_IOWAIT;
+    COEV_TRACE(TR_WAIT, self, NULL, fd, op);
+    _wait_switch(self);
+    
+    if (self->status != CSW_EVENT) {
+        errno = _wait_errno(self);
+        *rv = -1;
+        return 0;
+    }
+    if (self->io_result == -EAGAIN)
+        return 1;
+    if (self->io_result < 0) {
+        errno = -self->io_result;
+        *rv = -1;
+    } else 
+        *rv = self->io_result;
+    return 0;
+}
+#endif /* COEV_URING */
+
+/* can the current coroutine wait at all. sets status and returns -1 if not. */
+static int
+_wait_check(coev_t *self) {
     coev_dprintf("coev_wait(): [%s] %s scheduler [%s], self->parent [%s]\n", 
         coev_treepos(self),  str_coev_state[self->state],
         coev_treepos(ts_scheduler.scheduler), 
@@ -1059,14 +2513,14 @@ coev_wait(int fd, int revents, ev_tstamp timeout) {
             ts_scheduler.scheduler ?  str_coev_state[ts_scheduler.scheduler->state] : "none");
         self->status = CSW_SCHEDULER_NEEDED;
         self->origin = self;
-        return;
+        return -1;
     }
     
     if (self == ts_scheduler.scheduler) {
         /* should be unpossible */
         self->status = CSW_TARGET_SELF;
         self->origin = self;
-        return;
+        return -1;
     }
 
     /* check that there's nothing on watchers */
@@ -1074,11 +2528,11 @@ coev_wait(int fd, int revents, ev_tstamp timeout) {
          || ev_is_pending(&self->watcher)
          || ev_is_active(&self->io_timer)
          || ev_is_pending(&self->io_timer)
+         || (self->tol >= 0)
          || ev_is_active(&self->sleep_timer)
          || ev_is_pending(&self->sleep_timer) ) {
-        coev_dprintf("coev_wait(%d, %d, %f): inconsistent event watchers' status:\n"
+        coev_dprintf("coev_wait(): inconsistent event watchers' status:\n"
             "    watcher: %c%c\n    io_timer: %c%c\n    sleep_timer: %c%c\n",
-             fd, revents, timeout,
              ev_is_active(&self->watcher) ? 'A' : 'a',
              ev_is_pending(&self->watcher) ? 'P' : 'p',
              ev_is_active(&self->io_timer) ? 'A' : 'a',
@@ -1087,22 +2541,13 @@ coev_wait(int fd, int revents, ev_tstamp timeout) {
              ev_is_pending(&self->sleep_timer) ? 'P' : 'p' );
         fm_abort("coev_wait(): inconsistent event watchers' status.");
     }
-    
-    if ((fd == -1) && (revents == 0)) {
-        /* this is sleep */
-        self->sleep_timer.repeat = timeout;
-        ev_timer_again(ts_scheduler.loop, &self->sleep_timer);
-        _fm.i.c_sleeps++;
-        self->state = CSTATE_SLEEP;
-    } else {
-        /* this is iowait */
-        self->io_timer.repeat = timeout;
-        ev_timer_again(ts_scheduler.loop, &self->io_timer);
-        ev_io_init(&self->watcher, io_callback, fd, revents);
-        ev_io_start(ts_scheduler.loop, &self->watcher);
-        _fm.i.c_waits++;
-        self->state = CSTATE_IOWAIT;
-    }
+    return 0;
+}
+
+/* wait is armed and self->state set: go to the scheduler and back */
+static void
+_wait_switch(coev_t *self) {
+    uint64_t parked = _ticks();
     
     ts_scheduler.waiters += 1;
     
@@ -1114,16 +2559,20 @@ coev_wait(int fd, int revents, ev_tstamp timeout) {
     
     _fm.i.c_ctxswaps++;
     cstk_dump("before swapcontext\n");
-    if (swapcontext(&self->ctx, &ts_scheduler.scheduler->ctx) == -1)
+    _account_switch(self, ts_scheduler.scheduler, _ticks());
+    COEV_TRACE(TR_SWITCH, self, ts_scheduler.scheduler, -1, CSW_VOLUNTARY);
+    if (_ctx_swap(self, ts_scheduler.scheduler) == -1)
         fm_abort("coev_scheduled_switch(): swapcontext() failed.");
     cstk_dump("after swapcontext\n");
     
     /* we're here either because scheduler switched back
        or someone is being rude. */
     
-    if (   (ts_current->status != CSW_EVENT)
-	&& (ts_current->status != CSW_WAKEUP)
-        && (ts_current->status != CSW_TIMEOUT)) {
+    if (   (self->status != CSW_EVENT)
+	&& (self->status != CSW_WAKEUP)
+        && (self->status != CSW_TIMEOUT)
+        && (self->status != CSW_DEADLINE)
+        && (self->status != CSW_CANCELLED)) {
 	/* someone's being rude. */
         coev_dprintf("coev_wait(): [%s]/%s is being rude to [%s] %s %s\n",
             coev_treepos(self->origin), str_coev_state[self->origin->state],
@@ -1131,36 +2580,811 @@ coev_wait(int fd, int revents, ev_tstamp timeout) {
             str_coev_status[self->status]);
         fm_abort("unscheduled switch into event-waiting coroutine");
     }
+    if ((self->status == CSW_EVENT) && (self->rq_stamp > parked))
+        _hist_add(&_fm.i.h_iowait, self->rq_stamp - parked);
     coev_dprintf("coev_wait(): [%s] switch back from [%s] %s CSW: %s\n", 
         coev_treepos(self), coev_treepos(self->origin),
         str_coev_state[self->origin->state],  str_coev_status[self->status]);
 }
 
+/* sets current coro to wait for revents on fd, switches to scheduler */
+void 
+coev_wait(int fd, int revents, ev_tstamp timeout) {
+    coev_t *self = ts_current;
+    
+    if (_wait_check(self) || _wait_bound(self, &timeout))
+        return;
+    
+    if ((fd == -1) && (revents == 0)) {
+        /* this is sleep */
+        self->sleep_timer.repeat = timeout;
+        ev_timer_again(ts_scheduler.loop, &self->sleep_timer);
+        _fm.i.c_sleeps++;
+        self->state = CSTATE_SLEEP;
+        COEV_TRACE(TR_SLEEP, self, NULL, -1, 0);
+    } else {
+        /* this is iowait */
+#ifdef COEV_URING
+        if (ts_scheduler.ring.fd != -1)
+            _uring_poll(self, fd, revents, timeout);
+        else 
+#endif
+        {
+            _timeout_arm(self, timeout);
+            ev_io_init(&self->watcher, io_callback, fd, revents);
+            ev_io_start(ts_scheduler.loop, &self->watcher);
+        }
+        _fm.i.c_waits++;
+        self->state = CSTATE_IOWAIT;
+        COEV_TRACE(TR_WAIT, self, NULL, fd, revents);
+    }
+    
+    _wait_switch(self);
+}
+
 void
 coev_sleep(ev_tstamp amount) {
     coev_wait(-1, 0, amount);
 }
 
+/*  coev_wait_many(): a watcher per fd, the coroutine's io_timer or 
+    timeout list entry for the timeout, as for coev_wait(). The first 
+    watcher to fire wakes the waiter, the rest that are pending in the 
+    same ev_loop() pass add their revents, and all are stopped by the 
+    waiter once it runs. The timeout path is coev_wait()'s, as nothing 
+    is on coev_t::watcher. 
+    
+    Always on libev, even with the io_uring backend. */
+struct _coev_mwatcher {
+    ev_io w;
+    coev_t *waiter;
+    coev_pollfd_t *pfd;
+};
+
+struct _coev_mwpool {
+    int size;
+    struct _coev_mwatcher ws[1];
+};
+
+static void
+mwait_callback(struct ev_loop *loop, ev_io *w, int revents) {
+    struct _coev_mwatcher *mw = (struct _coev_mwatcher *) w;
+    coev_t *waiter = mw->waiter;
+    
+    mw->pfd->revents |= revents & (EV_READ | EV_WRITE);
+    if (waiter->state != CSTATE_IOWAIT)
+        return; /* another one of its fds got it scheduled already */
+    _timeout_disarm(waiter);
+    waiter->state = CSTATE_SCHEDULED;
+    waiter->status = CSW_EVENT;
+    coev_runq_append(waiter, waiter->prio);
+    ts_scheduler.waiters -= 1;
+    COEV_TRACE(TR_WAKEUP, waiter, NULL, w->fd, CSW_EVENT);
+}
+
+static struct _coev_mwpool *
+_mwpool_get(coev_t *self, int n) {
+    struct _coev_mwpool *pool = self->mwpool;
+    
+    if (pool && (pool->size >= n))
+        return pool;
+    if (pool)
+        _fm.free(pool);
+    pool = _fm.malloc(sizeof(struct _coev_mwpool) + (n - 1) * sizeof(struct _coev_mwatcher));
+    if (!pool)
+        fm_abort("coev_wait_many(): malloc failed.");
+    pool->size = n;
+    self->mwpool = pool;
+    return pool;
+}
+
+int
+coev_wait_many(coev_pollfd_t *fds, int n, ev_tstamp timeout) {
+    coev_t *self = ts_current;
+    struct _coev_mwpool *pool;
+    int i, fired = 0;
+    
+    if (_wait_check(self)) {
+        errno = EDEADLK;
+        return -1;
+    }
+    if (_wait_bound(self, &timeout))
+        return 0;
+    pool = _mwpool_get(self, n > 0 ? n : 1);
+    for (i = 0; i < n; i++) {
+        struct _coev_mwatcher *mw = &pool->ws[i];
+        
+        fds[i].revents = 0;
+        mw->waiter = self;
+        mw->pfd = &fds[i];
+        ev_io_init(&mw->w, mwait_callback, fds[i].fd, fds[i].events);
+        ev_io_start(ts_scheduler.loop, &mw->w);
+        COEV_TRACE(TR_WAIT, self, NULL, fds[i].fd, fds[i].events);
+    }
+    _timer_arm(self, timeout);
+    _fm.i.c_waits++;
+    self->state = CSTATE_IOWAIT;
+    
+    _wait_switch(self);
+    
+    for (i = 0; i < n; i++) {
+        ev_io_stop(ts_scheduler.loop, &pool->ws[i].w);
+        if (fds[i].revents)
+            fired ++;
+    }
+    return fired;
+}
+
+/*  deadlines: a per-coroutine stack of absolute times, the innermost 
+    (soonest) is checked by _wait_bound() at the start of every wait. 
+    cancellation: a flag the next _timeout_status() turns into 
+    CSW_CANCELLED, plus an early timeout for the wait in progress. */
+
+int
+coev_deadline_push(ev_tstamp timeout) {
+    coev_t *self = ts_current;
+    ev_tstamp deadline;
+    
+    if (self->dl_depth == COEV_DEADLINE_DEPTH)
+        return -1;
+    if (!ts_ev_initialized)
+        coev_evinit();
+    ev_now_update(ts_scheduler.loop);
+    deadline = ev_now(ts_scheduler.loop) + timeout;
+    if (self->dl_depth && (self->dl_stack[self->dl_depth - 1] < deadline))
+        deadline = self->dl_stack[self->dl_depth - 1];
+    self->dl_stack[self->dl_depth++] = deadline;
+    return 0;
+}
+
+void
+coev_deadline_pop(void) {
+    if (ts_current->dl_depth)
+        ts_current->dl_depth --;
+}
+
+ev_tstamp
+coev_deadline_left(void) {
+    coev_t *self = ts_current;
+    ev_tstamp left;
+    
+    if (!self->dl_depth)
+        return -1.0;
+    ev_now_update(ts_scheduler.loop);
+    left = self->dl_stack[self->dl_depth - 1] - ev_now(ts_scheduler.loop);
+    return left > 0.0 ? left : 0.0;
+}
+
+static int
+_timeout_armed(coev_t *c) {
+    return (c->tol >= 0) || ev_is_active(&c->io_timer);
+}
+
+int
+coev_cancel(coev_t *target) {
+    CROSSTHREAD_CHECK(target, CSCHED_NOTMOVABLE);
+    
+    switch(target->state) {
+        case CSTATE_ZERO:
+        case CSTATE_DEAD:
+            return CSCHED_DEADMEAT;
+        
+        case CSTATE_SLEEP:
+            ev_timer_stop(ts_scheduler.loop, &target->sleep_timer);
+            target->state = CSTATE_SCHEDULED;
+            target->status = CSW_CANCELLED;
+            _fm.i.c_cancels ++;
+            coev_runq_append(target, target->prio);
+            ts_scheduler.waiters--;
+            COEV_TRACE(TR_TIMEOUT, target, ts_current, -1, CSW_CANCELLED);
+            break;
+        
+        case CSTATE_IOWAIT:
+            target->cancel_pending = 1;
+#ifdef COEV_URING
+            if ((ts_scheduler.ring.fd != -1) && (target->io_result == URING_INFLIGHT)) {
+                /* the completion does the rest */
+                _uring_cancel(target);
+                break;
+            }
+#endif
+            _timeout_disarm(target);
+            _iowait_timed_out(target);
+            break;
+        
+        case CSTATE_LOCKWAIT:
+            /* untimed ones aren't waits here, see ucoev.h */
+            target->cancel_pending = 1;
+            if (_timeout_armed(target)) {
+                _timeout_disarm(target);
+                _iowait_timed_out(target);
+            }
+            break;
+        
+        case CSTATE_CHANWAIT:
+        case CSTATE_SYNCWAIT:
+            target->cancel_pending = 1;
+            if (_timeout_armed(target))
+                _timeout_disarm(target);
+            else
+                ts_scheduler.waiters++; /* _waitq_timed_out() takes one off */
+            _iowait_timed_out(target);
+            break;
+        
+        case CSTATE_CHILDWAIT:
+            /* always a waiter, timed or not */
+            target->cancel_pending = 1;
+            _timeout_disarm(target);
+            _iowait_timed_out(target);
+            break;
+        
+        default:
+            target->cancel_pending = 1;
+            break;
+    }
+    coev_dprintf("coev_cancel(): [%s] cancels [%s] %s\n", coev_treepos(ts_current),
+        coev_treepos(target), str_coev_state[target->state]);
+    return 0;
+}
+
+/*  offload pool.
+    
+    one process-wide FIFO of jobs under a mutex, served by detached 
+    pthreads started on first use. a job lives on the submitter's stack: 
+    the worker runs it, pushes it onto the submitter's scheduler done 
+    LIFO and kicks that scheduler's eventfd; offload_callback() takes the 
+    LIFO whole and schedules the waiters. workers have all signals 
+    blocked, so that they're delivered to the loop thread. */
+
+struct _coev_offload_job {
+    coev_offload_fn fn;
+    void *arg;
+    coev_t *waiter;
+    struct _coev_scheduler_stuff *sched;
+    uint64_t stamp;
+    struct _coev_offload_job *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct _coev_offload_job *head, *tail;
+    int nthreads;             /* how many to have */
+    int started;              /* how many there are */
+} offload_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, NULL, COEV_OFFLOAD_THREADS, 0
+};
+
+static void *
+_offload_worker(void *unused) {
+    struct _coev_offload_job *job;
+    struct _coev_scheduler_stuff *sched;
+    uint64_t one = 1;
+    int fd;
+    
+    for (;;) {
+        pthread_mutex_lock(&offload_pool.lock);
+        while (!offload_pool.head)
+            pthread_cond_wait(&offload_pool.cond, &offload_pool.lock);
+        job = offload_pool.head;
+        offload_pool.head = job->next;
+        if (!offload_pool.head)
+            offload_pool.tail = NULL;
+        pthread_mutex_unlock(&offload_pool.lock);
+        
+        job->fn(job->arg);
+        
+        /* the job is gone as soon as it's pushed */
+        sched = job->sched;
+        fd = sched->offload_fd;
+        do 
+            job->next = sched->offload_done;
+        while (!__sync_bool_compare_and_swap(&sched->offload_done, job->next, job));
+        while ((write(fd, &one, sizeof(one)) == -1) && (errno == EINTR))
+            ;
+        __sync_fetch_and_sub(&sched->offload_busy, 1);
+    }
+    return NULL;
+}
+
+/* offload_pool.lock held */
+static int
+_offload_spawn(void) {
+    sigset_t all, old;
+    pthread_t t;
+    int rv = 0;
+    
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    while (offload_pool.started < offload_pool.nthreads) {
+        rv = pthread_create(&t, NULL, _offload_worker, NULL);
+        if (rv)
+            break;
+        pthread_detach(t);
+        offload_pool.started ++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rv && !offload_pool.started) {
+        errno = rv;
+        return -1;
+    }
+    return 0;
+}
+
+/* CSW_WAKEUP if fn is done, CSW_CANCELLED if it won't be */
+static void
+_offload_wake(coev_t *waiter, int status) {
+    assert(waiter->state == CSTATE_OFFLOAD);
+    waiter->state = CSTATE_SCHEDULED;
+    waiter->status = status;
+    coev_runq_append(waiter, waiter->prio);
+    ts_scheduler.waiters--;
+    COEV_TRACE(TR_WAKEUP, waiter, NULL, -1, status);
+}
+
+static void
+offload_callback(struct ev_loop *loop, ev_io *w, int revents) {
+    struct _coev_offload_job *job, *next;
+    uint64_t n, now = _ticks();
+    
+    if ((read(w->fd, &n, sizeof(n)) == -1) && (errno != EAGAIN))
+        fm_eabort("offload_callback(): read() from eventfd failed", errno);
+    
+    job = __sync_lock_test_and_set(&ts_scheduler.offload_done, NULL);
+    for (; job; job = next) {
+        next = job->next;
+        _hist_add(&_fm.i.h_offload, now - job->stamp);
+        _fm.i.c_offloads ++;
+        _offload_wake(job->waiter, CSW_WAKEUP);
+    }
+}
+
+/* the scheduler's eventfd, once */
+static int
+_offload_evinit(void) {
+    int fd;
+    
+    if (ts_scheduler.offload_fd != -1)
+        return 0;
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ts_scheduler.offload_fd = fd;
+    ev_io_init(&ts_scheduler.offload_w, offload_callback, fd, EV_READ);
+    ev_io_start(ts_scheduler.loop, &ts_scheduler.offload_w);
+    return 0;
+}
+
+/* workers write() to the eventfd as long as they have our jobs: 
+   those not started are dropped, the running ones waited out. */
+static void
+_offload_evfini(void) {
+    struct _coev_offload_job **pp, *job;
+    struct timespec nap = { 0, 1000000 };
+    
+    if (ts_scheduler.offload_fd == -1)
+        return;
+    pthread_mutex_lock(&offload_pool.lock);
+    offload_pool.tail = NULL;
+    for (pp = &offload_pool.head; (job = *pp); ) {
+        if (job->sched == &ts_scheduler) {
+            *pp = job->next;
+            __sync_fetch_and_sub(&ts_scheduler.offload_busy, 1);
+        } else {
+            offload_pool.tail = job;
+            pp = &job->next;
+        }
+    }
+    pthread_mutex_unlock(&offload_pool.lock);
+    while (ts_scheduler.offload_busy > 0)
+        nanosleep(&nap, NULL);
+    
+    ev_io_stop(ts_scheduler.loop, &ts_scheduler.offload_w);
+    close(ts_scheduler.offload_fd);
+    ts_scheduler.offload_fd = -1;
+    ts_scheduler.offload_done = NULL;
+}
+
+int
+coev_offload(coev_offload_fn fn, void *arg) {
+    coev_t *self = ts_current;
+    struct _coev_offload_job job;
+    
+    if (_wait_check(self)) {
+        _fm.i.c_offload_inline ++;
+        fn(arg);
+        return 0;
+    }
+    if (_offload_evinit())
+        return -1;
+    
+    job.fn = fn;
+    job.arg = arg;
+    job.waiter = self;
+    job.sched = &ts_scheduler;
+    job.stamp = _ticks();
+    job.next = NULL;
+    
+    pthread_mutex_lock(&offload_pool.lock);
+    if (_offload_spawn()) {
+        pthread_mutex_unlock(&offload_pool.lock);
+        return -1;
+    }
+    if (offload_pool.tail)
+        offload_pool.tail->next = &job;
+    else
+        offload_pool.head = &job;
+    offload_pool.tail = &job;
+    __sync_fetch_and_add(&ts_scheduler.offload_busy, 1);
+    pthread_cond_signal(&offload_pool.cond);
+    pthread_mutex_unlock(&offload_pool.lock);
+    
+    self->state = CSTATE_OFFLOAD;
+    COEV_TRACE(TR_OFFLOAD, self, NULL, -1, 0);
+    _wait_switch(self);
+    if (self->status == CSW_CANCELLED) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+int
+coev_setoffload(int nthreads) {
+    int rv = 0;
+    
+    pthread_mutex_lock(&offload_pool.lock);
+    if ((nthreads < 1) || (nthreads < offload_pool.started))
+        rv = -1;
+    else
+        offload_pool.nthreads = nthreads;
+    pthread_mutex_unlock(&offload_pool.lock);
+    return rv;
+}
+
+/* only the forking thread survives: no workers, and the jobs queued
+   or running stay so. theirs are for the parent to finish; ours 
+   that are done are done, the rest fail. */
+static void
+_offload_forked(void) {
+    struct _coev_offload_job *job, *next;
+    coev_t *c;
+    
+    pthread_mutex_init(&offload_pool.lock, NULL);
+    pthread_cond_init(&offload_pool.cond, NULL);
+    offload_pool.head = offload_pool.tail = NULL;
+    offload_pool.started = 0;
+    
+    job = ts_scheduler.offload_done;
+    ts_scheduler.offload_done = NULL;
+    for (; job; job = next) {
+        next = job->next;
+        _fm.i.c_offloads ++;
+        _offload_wake(job->waiter, CSW_WAKEUP);
+    }
+    for (c = ts_coev_bunch.busy; c != NULL; c = c->cb_next)
+        if (c->state == CSTATE_OFFLOAD)
+            _offload_wake(c, CSW_CANCELLED);
+    ts_scheduler.offload_busy = 0;
+}
+
+/*  multiple threads.
+    
+    every thread has its own scheduler, libev loop and allocators;
+    coroutines cross threads only through coev_migrate(), which pushes
+    them into the target scheduler's inbox: a lock-free LIFO linked 
+    through rq_next (the migrant is in no runqueue meanwhile), taken 
+    whole with an atomic exchange at the start of each coev_loop() pass
+    there. ev_async wakes the target up if it's blocked in ev_loop().
+    
+    work stealing is asked for, not done: an idle scheduler puts itself 
+    into the thief slot of the busiest registered one, which then hands 
+    over half of its runqueue (stealable ones only, lowest priority 
+    first) by coev_migrate()-ing them at the start of its next pass. 
+    runqueues thus are touched only by their own thread. */
+
+#ifdef THREADING_MADNESS
+#define COEV_MAX_SCHEDULERS 64
+
+static pthread_mutex_t sched_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static coevsched_t *sched_registry[COEV_MAX_SCHEDULERS];
+
+static void
+_sched_register(void) {
+    int i;
+    
+    if (ts_scheduler.registered)
+        return;
+    pthread_mutex_lock(&sched_registry_lock);
+    for (i = 0; i < COEV_MAX_SCHEDULERS; i++)
+        if (sched_registry[i] == NULL) {
+            sched_registry[i] = &ts_scheduler;
+            ts_scheduler.registered = 1;
+            break;
+        }
+    pthread_mutex_unlock(&sched_registry_lock);
+    if (!ts_scheduler.registered)
+        coev_dprintf("_sched_register(): registry full, won't steal.\n");
+}
+
+static void
+_sched_unregister(void) {
+    int i;
+    
+    if (!ts_scheduler.registered)
+        return;
+    pthread_mutex_lock(&sched_registry_lock);
+    for (i = 0; i < COEV_MAX_SCHEDULERS; i++)
+        if (sched_registry[i] == &ts_scheduler)
+            sched_registry[i] = NULL;
+    ts_scheduler.registered = 0;
+    pthread_mutex_unlock(&sched_registry_lock);
+    ev_timer_stop(ts_scheduler.loop, &ts_scheduler.steal_timer);
+}
+
+/* call with sched_registry_lock held */
+static int
+_sched_is_registered(coevsched_t *s) {
+    int i;
+    
+    for (i = 0; i < COEV_MAX_SCHEDULERS; i++)
+        if (sched_registry[i] == s)
+            return 1;
+    return 0;
+}
+
+/* detach from this thread and push into target's inbox */
+static void
+_migrate_out(coev_t *subject, coevsched_t *target) {
+    coev_t *head;
+    
+    coev_dprintf("_migrate_out(): [%s] %s to %p\n", coev_treepos(subject),
+        str_coev_state[subject->state], target);
+    
+    coev_runq_remove(subject);
+    if (subject->state == CSTATE_RUNNABLE)
+        subject->status = CSW_YOURTURN;
+    /* neither switchable nor schedulable from here on */
+    subject->state = CSTATE_SCHEDULED;
+    subject->thread = target->thread;
+    
+    _coev_busy_unlink(subject);
+    _stack_busy_unlink(subject->stack);
+    subject->sprof = NULL; /* the table is per-thread */
+    
+    subject->parent->child_count --;
+    _coev_sweep(subject->parent);
+    subject->parent = NULL;
+    
+    do {
+        head = target->inbox;
+        subject->rq_next = head;
+    } while (!__sync_bool_compare_and_swap(&target->inbox, head, subject));
+    
+    ev_async_send(target->loop, &target->inbox_w);
+    _fm.i.c_migrations ++;
+}
+
+/* adopt everything from the inbox, in the order it was pushed */
+static void
+_inbox_drain(void) {
+    coev_t *list, *next, *rev = NULL;
+    
+    if (ts_scheduler.inbox == NULL)
+        return;
+    
+    list = __sync_lock_test_and_set(&ts_scheduler.inbox, NULL);
+    while (list) {
+        next = list->rq_next;
+        list->rq_next = rev;
+        rev = list;
+        list = next;
+    }
+    
+    while (rev) {
+        next = rev->rq_next;
+        rev->rq_next = NULL;
+        
+        _coev_busy_link(rev);
+        _stack_busy_link(rev->stack);
+        rev->parent = ts_current;
+        ts_current->child_count ++;
+        rev->treepos_is_stale = 1;
+        
+        coev_runq_append(rev, rev->prio);
+        ts_scheduler.slackers ++;
+        coev_dprintf("_inbox_drain(): [%s] adopted, %s\n", coev_treepos(rev),
+            str_coev_status[rev->status]);
+        rev = next;
+    }
+}
+
+/* somebody asked for work: give away up to half of the runqueue */
+static void
+_steal_serve(void) {
+    coevsched_t *thief;
+    coev_t *c, *prev;
+    int n, prio;
+    
+    if (ts_scheduler.thief == NULL)
+        return;
+    
+    pthread_mutex_lock(&sched_registry_lock);
+    thief = __sync_lock_test_and_set(&ts_scheduler.thief, NULL);
+    n = _sched_is_registered(thief) ? ts_scheduler.runq_len / 2 : 0;
+    
+    for (prio = COEV_PRIO_LEVELS - 1; (prio >= 0) && (n > 0); prio--)
+        for (c = ts_scheduler.runq[prio].tail; c && (n > 0); c = prev) {
+            prev = c->rq_prev;
+            if (   (!c->stealable)
+                || (c->state != CSTATE_SCHEDULED)
+                || (c->child_count > 0)
+                || (c == ts_root) )
+                continue;
+            _migrate_out(c, thief);
+            _fm.i.c_steals ++;
+            n --;
+        }
+    pthread_mutex_unlock(&sched_registry_lock);
+}
+
+/* ask the busiest registered scheduler for work, retry in a while */
+static void
+_steal_ask(void) {
+    coevsched_t *victim = NULL;
+    int i, best = 1;
+    
+    if (!ts_scheduler.registered)
+        return;
+    
+    pthread_mutex_lock(&sched_registry_lock);
+    for (i = 0; i < COEV_MAX_SCHEDULERS; i++) {
+        coevsched_t *s = sched_registry[i];
+        if (s && (s != &ts_scheduler) && (s->runq_len > best)) {
+            best = s->runq_len;
+            victim = s;
+        }
+    }
+    if (victim)
+        __sync_bool_compare_and_swap(&victim->thief, NULL, &ts_scheduler);
+    pthread_mutex_unlock(&sched_registry_lock);
+    
+    if (!ev_is_active(&ts_scheduler.steal_timer)) {
+        ev_timer_set(&ts_scheduler.steal_timer, COEV_STEAL_INTERVAL, 0.);
+        ev_timer_start(ts_scheduler.loop, &ts_scheduler.steal_timer);
+    }
+}
+
+static void
+inbox_cb(struct ev_loop *loop, ev_async *w, int revents) {
+    /* inbox is drained by coev_loop() itself, this only wakes it up */
+    if (ts_scheduler.stop_flag)
+        ev_unloop(loop, EVUNLOOP_ALL);
+}
+
+static void
+steal_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    /* nothing: coev_loop() will ask again if still idle */
+}
+
+coevsched_t *
+coev_thread_scheduler(void) {
+    if (!ts_ev_initialized)
+        coev_evinit();
+    return &ts_scheduler;
+}
+
+int
+coev_migrate(coev_t *subject, coevsched_t *target) {
+    if (!pthread_equal(pthread_self(), subject->thread))
+        return CSCHED_NOTMOVABLE;
+    
+    switch (subject->state) {
+        case CSTATE_ZERO:
+        case CSTATE_DEAD:
+            return CSCHED_DEADMEAT;
+        case CSTATE_RUNNABLE:
+        case CSTATE_SCHEDULED:
+            break;
+        default:
+            return CSCHED_NOTMOVABLE;
+    }
+    
+    if (   (subject == ts_root) 
+        || (subject == ts_scheduler.scheduler) 
+        || (subject->child_count > 0) )
+        return CSCHED_NOTMOVABLE;
+    
+    if (target == &ts_scheduler) 
+        return subject->state == CSTATE_SCHEDULED ? 0 : coev_schedule(subject);
+    
+    _migrate_out(subject, target);
+    return 0;
+}
+
+void
+coev_sched_stop(coevsched_t *target) {
+    target->stop_flag = 1;
+    ev_async_send(target->loop, &target->inbox_w);
+}
+
+void
+coev_setworker(int flags) {
+    int was_kept = ts_scheduler.worker & COEV_WORKER_KEEPALIVE;
+    
+    if (!ts_ev_initialized)
+        coev_evinit();
+    
+    ts_scheduler.worker = flags;
+    
+    /* a referenced ev_async keeps ev_loop() blocking with no other watchers */
+    if ((flags & COEV_WORKER_KEEPALIVE) && !was_kept)
+        ev_ref(ts_scheduler.loop);
+    if (!(flags & COEV_WORKER_KEEPALIVE) && was_kept)
+        ev_unref(ts_scheduler.loop);
+    
+    if (ts_scheduler.scheduler) {
+        if (flags & COEV_WORKER_STEAL)
+            _sched_register();
+        else
+            _sched_unregister();
+    }
+}
+
+void
+coev_setstealable(coev_t *subject, int yes) {
+    subject->stealable = yes ? 1 : 0;
+}
+#endif /* THREADING_MADNESS */
+
+/* buffers the kernel has yet to let go of keep the scheduler running */
+#ifdef MSG_ZEROCOPY
+#define _zc_busy() (ts_scheduler.zc_socks != NULL)
+#else
+#define _zc_busy() 0
+#endif
+
+/* runqueue is empty: whether to block in ev_loop() or return from coev_loop() */
+static int
+_sched_idle(void) {
+#ifdef THREADING_MADNESS
+    int wait = (ts_scheduler.worker & COEV_WORKER_KEEPALIVE) || (ts_scheduler.waiters > 0)
+                || _zc_busy();
+    
+    if (wait && (ts_scheduler.worker & COEV_WORKER_STEAL))
+        _steal_ask();
+    return wait;
+#else
+    return (ts_scheduler.waiters > 0) || _zc_busy();
+#endif
+}
+
 /*  the scheduler
     
-    this should switch to coroutines in order they received IO events 
+    this should switch to coroutines in order they received IO events,
+    higher priority runqueues first.
 
-    ts_scheduler.runq_head:
+    ts_scheduler.runq[prio].head:
 	NULL if no events, first to handle 
 	if at least one event was received.
 
-    ts_scheduler.runq_tail:
-	undefined if runq_head == NULL.
-	most recent coroutie to receieve an event otherwise.
+    ts_scheduler.runq[prio].tail:
+	NULL if head == NULL.
+	most recent coroutine to receive an event otherwise.
 	
-    coev_t::next: iff this coroutine was not last to receive an
-	event, points to next one.
+    ts_scheduler.runq[prio].pass_last:
+        last coroutine to run in the current pass, NULL if none left.
+        
+    coev_t::rq_next, rq_prev: neighbours in the runqueue.
 
     runqueue is managed thus:
     -- append always at tail
     -- scheduler walks always from head
+    -- removal from anywhere (coev_switch() into a scheduled one)
     -- if tail != NULL, tail->next == NULL, head != NULL
     -- if head == NULL, tail == NULL, queue is empty.
+    -- coroutines appended during a pass wait for the next one.
     
     returns:
         current scheduler if there is one, 
@@ -1172,6 +3396,8 @@ coev_sleep(ev_tstamp amount) {
 
 coev_t *
 coev_loop(void) {
+    uint64_t pass_start, now;
+    
     coev_dprintf("[%s] coev_loop(): scheduler entered.\n", coev_treepos(ts_current));
     
     if (ts_scheduler.scheduler)
@@ -1179,19 +3405,28 @@ coev_loop(void) {
     
     ts_scheduler.scheduler = ts_current;
     ts_scheduler.stop_flag = 0;
+#ifdef THREADING_MADNESS
+    if (ts_scheduler.worker & COEV_WORKER_STEAL)
+        _sched_register();
+#endif
     
+    pass_start = _ticks();
     do {
-	coev_t *target, *runq_head;
-        
+	coev_t *target;
+        int prio;
         
+#ifdef THREADING_MADNESS
+        _inbox_drain();
+        _steal_serve();
+#endif
 	runq_dump("coev_loop(): runqueue before running it");
         coev_dprintf("[%s] coev_loop(): %d waiters\n", 
             coev_treepos(ts_current), ts_scheduler.waiters);
 	
         /* guard against infinite loop in scheduler in case something 
            schedules itself over and over */
-	runq_head = ts_scheduler.runq_head;
-        ts_scheduler.runq_head = ts_scheduler.runq_tail = NULL;
+        for (prio = 0; prio < COEV_PRIO_LEVELS; prio++)
+            ts_scheduler.runq[prio].pass_last = ts_scheduler.runq[prio].tail;
         
         coev_dprintf("[%s] coev_loop(): running the queue.\n",
             coev_treepos(ts_current));
@@ -1200,13 +3435,22 @@ coev_loop(void) {
         _fm.i.slackers = ts_scheduler.slackers;
         ts_scheduler.slackers = 0;
         
-	while ((target = runq_head)) {
-            coev_dprintf("[%s] coev_loop(): runqueue run: target %p head %p next %p\n", 
-                coev_treepos(ts_current), target, runq_head, target->rq_next);
-	    runq_head = target->rq_next;
-            if (runq_head == target)
+	for (;;) {
+            /* highest priority first, rechecked after each switch */
+            target = NULL;
+            for (prio = 0; prio < COEV_PRIO_LEVELS; prio++)
+                if (ts_scheduler.runq[prio].pass_last) {
+                    target = ts_scheduler.runq[prio].head;
+                    break;
+                }
+            if (!target)
+                break;
+            
+            coev_dprintf("[%s] coev_loop(): runqueue run: target %p prio %d next %p\n", 
+                coev_treepos(ts_current), target, prio, target->rq_next);
+            if (target->rq_next == target)
                 fm_abort("coev_loop(): runqueue loop detected");
-	    target->rq_next = NULL;
+            coev_runq_remove(target);
             
             if ((target->state != CSTATE_RUNNABLE) && (target->state != CSTATE_SCHEDULED)) {
                 coev_dprintf("[%s] coev_loop(): [%s] is %s, skipping.\n",
@@ -1224,16 +3468,20 @@ coev_loop(void) {
             ts_current = target;
             
             cstk_dump("before swapcontext");
-            cstk_dprintf("target's sp %p origin's sp %p\n", target->ctx.uc_stack.ss_sp,
-                target->origin->ctx.uc_stack.ss_sp);
+            cstk_dprintf("target's stack %p origin's stack %p\n", target->stack,
+                target->origin->stack);
             
             _fm.i.c_ctxswaps ++;
-            if (swapcontext(&target->origin->ctx, &target->ctx) == -1)
+            now = _ticks();
+            _hist_add(&_fm.i.h_runq_delay, now - target->rq_stamp);
+            _account_switch(target->origin, target, now);
+            COEV_TRACE(TR_SWITCH, target->origin, target, -1, target->status);
+            if (_ctx_swap(target->origin, target) == -1)
                 fm_abort("coev_loop(): swapcontext() failed.");
             
             cstk_dump("after swapcontext\n");
-            cstk_dprintf("current sp %p origin's sp %p\n", ts_current->ctx.uc_stack.ss_sp,
-                ts_current->origin->ctx.uc_stack.ss_sp);
+            cstk_dprintf("current stack %p origin's stack %p\n", ts_current->stack,
+                ts_current->origin->stack);
             
             switch (ts_current->status) {
                 case CSW_VOLUNTARY:
@@ -1258,15 +3506,31 @@ coev_loop(void) {
         coev_dprintf("[%s] coev_loop(): %d waiters\n", 
             coev_treepos(ts_current), ts_scheduler.waiters);
         
-	if (ts_scheduler.runq_head != NULL) 
+#ifdef COEV_URING
+        _uring_flush();
+#endif
+        now = _ticks();
+        _hist_add(&_fm.i.h_loop_pass, now - pass_start);
+
+	if (!coev_runq_empty()) 
 	    ev_loop(ts_scheduler.loop, EVLOOP_NONBLOCK);
 	else
-            if (ts_scheduler.waiters > 0)
+            if (_sched_idle())
                 ev_loop(ts_scheduler.loop, EVLOOP_ONESHOT);
             else 
                 break;
+        /* this pass' end is the next one's start */
+        pass_start = _ticks();
+        _hist_add(&_fm.i.h_loop_block, pass_start - now);
+        /* and being blocked is not running */
+        ts_current->sw_stamp += pass_start - now;
     } while (!ts_scheduler.stop_flag);
     
+#ifdef THREADING_MADNESS
+    _sched_unregister();
+    /* whatever was stolen or migrated in meanwhile waits for the next coev_loop() */
+    _inbox_drain();
+#endif
     ts_scheduler.scheduler = NULL;
     coev_dprintf("[%s] coev_loop(): scheduler exited.\n", coev_treepos(ts_current));
     return NULL;
@@ -1274,7 +3538,6 @@ coev_loop(void) {
 
 void
 coev_unloop(void) {
-    /* ts_scheduler.runq_tail = NULL; if we're totally aborting the scheduler */
     ev_unloop(ts_scheduler.loop, EVUNLOOP_ALL);
     ts_scheduler.stop_flag = 1;
     coev_dprintf("coev_unloop(): ev_unloop called.\n");
@@ -1289,20 +3552,9 @@ _colbunch_dump(colbunch_t *subject) {
 	p = c;
 	c = c->next;
         colo_dprintf("bunch at <%p>, %zd locks, next is <%p>\n", p, p->allocated, c);
-        colo_dprintf("        avail  <%p>, used <%p>\n", p->avail, p->used);
-        colo_dprintf("        USED DUMP:\n");
-        lc = p->used;
-        i = 0;
-        while (lc != NULL) {
-            colo_dprintf("            <%p>: owner [%s] bunch %p\n", lc, 
-                coev_treepos(lc->owner), 
-                lc->bunch);
-            lc = lc->next;
-            i++;
-        }
-        colo_dprintf("            TOTAL %d\n", i);
-        colo_dprintf("        AVAIL DUMP:\n");
-        lc = p->avail;
+        colo_dprintf("        used <%p>\n", p->used);
+        colo_dprintf("        USED DUMP:\n");
+        lc = p->used;
         i = 0;
         while (lc != NULL) {
             colo_dprintf("            <%p>: owner [%s] bunch %p\n", lc, 
@@ -1313,6 +3565,13 @@ _colbunch_dump(colbunch_t *subject) {
         }
         colo_dprintf("            TOTAL %d\n", i);
     }    
+    lc = ts_colock_avail;
+    i = 0;
+    while (lc != NULL) {
+        lc = lc->next;
+        i++;
+    }
+    colo_dprintf("avail <%p>, TOTAL %d\n", ts_colock_avail, i);
 }
 
 static void
@@ -1354,13 +3613,13 @@ colock_bunch_init(colbunch_t **bunch_p) {
     {
         int i;
         
-        for(i=1; i < COLOCK_PREALLOCATE; i++) {
+        for(i=0; i < COLOCK_PREALLOCATE; i++)
+            bunch->area[i].bunch = bunch;
+        for(i=1; i < COLOCK_PREALLOCATE; i++)
             bunch->area[i-1].next = &(bunch->area[i]);
-            bunch->area[i-1].bunch = bunch;
-        }
-        bunch->area[COLOCK_PREALLOCATE-1].bunch = bunch;
+        bunch->area[COLOCK_PREALLOCATE-1].next = ts_colock_avail;
     }
-    bunch->avail = bunch->area;
+    ts_colock_avail = bunch->area;
     bunch->used = NULL;
     
     *bunch_p = bunch;
@@ -1379,221 +3638,904 @@ colock_bunch_fini(colbunch_t *b) {
     while (c) {
 	p = c;
 	c = c->next;
+        _fm.free(p->area);
 	_fm.free(p);
     }
+    ts_colock_avail = NULL;
 }
 
+/*  allocation and free are O(1): free locks of all bunches are in one 
+    list, used ones are doubly linked in their bunch's. new bunches
+    are put after the root one. */
 colock_t *
 colock_allocate(void) {
     colock_t *lock;
-    colbunch_t *bunch = ts_rootlockbunch;
-    
-    while (!bunch->avail) {
-	/* woo, we're out of locks in this bunch, get another */
-	colo_dprintf("colock_allocate(): bunch %p full\n", bunch);
-	if (!bunch->next) {
-	    /* WOO, that was last one. allocate another */
-	    colo_dprintf("colock_allocate(): all bunches full, allocating another\n", bunch);
-	    colock_bunch_init(&bunch->next);
-	    bunch = bunch->next;
-	    break;
-	}
-	bunch = bunch->next;
+    colbunch_t *bunch;
+    
+    if (!ts_colock_avail) {
+        /* WOO, all bunches full. allocate another */
+        colo_dprintf("colock_allocate(): all bunches full, allocating another\n");
+        bunch = NULL;
+        colock_bunch_init(&bunch);
+        bunch->next = ts_rootlockbunch->next;
+        ts_rootlockbunch->next = bunch;
     }
     
-    lock = bunch->avail;
+    lock = ts_colock_avail;
+    bunch = lock->bunch;
     
-    bunch->avail = lock->next;
+    ts_colock_avail = lock->next;
     lock->next = bunch->used;
+    lock->prev = NULL;
+    if (bunch->used)
+        bunch->used->prev = lock;
     bunch->used = lock;
     lock->owner = NULL;
     lock->queue_head = NULL;
     lock->queue_tail = NULL;
 
-    colo_dprintf("colock_allocate(): [%s] allocates %p\n", coev_treepos(ts_current), lock);
-    colbunch_dump(ts_rootlockbunch);
-    _fm.i.colocks_used ++;
-    return (void *) lock;
+    colo_dprintf("colock_allocate(): [%s] allocates %p\n", coev_treepos(ts_current), lock);
+    colbunch_dump(ts_rootlockbunch);
+    _fm.i.colocks_used ++;
+    return (void *) lock;
+}
+
+void 
+colock_free(colock_t *lock) {
+    colbunch_t *bunch = lock->bunch;
+    
+    colo_dprintf("colock_free(%p): [%s] deallocates [%s]'s %p (of bunch %p)\n", lock, coev_treepos(ts_current), 
+        coev_treepos(lock->owner), lock, bunch);
+    
+    lock->owner = NULL;
+    
+    if (lock->prev)
+        lock->prev->next = lock->next;
+    else
+        bunch->used = lock->next;
+    if (lock->next)
+        lock->next->prev = lock->prev;
+    
+    /* put it at the top of free list */
+    lock->prev = NULL;
+    lock->next = ts_colock_avail;
+    ts_colock_avail = lock;
+    colbunch_dump(ts_rootlockbunch);
+    _fm.i.colocks_used --;
+}
+
+/* takes the waiter off the lock's FIFO */
+static void
+_colock_unqueue(colock_t *p, coev_t *waiter) {
+    if (waiter->lq_prev)
+        waiter->lq_prev->lq_next = waiter->lq_next;
+    else
+        p->queue_head = waiter->lq_next;
+    if (waiter->lq_next)
+        waiter->lq_next->lq_prev = waiter->lq_prev;
+    else
+        p->queue_tail = waiter->lq_prev;
+    waiter->lq_next = waiter->lq_prev = NULL;
+    waiter->lq_lock = NULL;
+}
+
+/* timer went off for a colock_acquire_timed() waiter */
+static void
+_lockwait_timed_out(coev_t *waiter) {
+    _colock_unqueue(waiter->lq_lock, waiter);
+    
+    waiter->state = CSTATE_SCHEDULED;
+    waiter->status = _timeout_status(waiter);
+    coev_runq_append(waiter, waiter->prio);
+    ts_scheduler.waiters--;
+    if (waiter->status == CSW_TIMEOUT)
+        _fm.i.c_lock_timeouts ++;
+    COEV_TRACE(TR_TIMEOUT, waiter, NULL, -1, waiter->status);
+    
+    colo_dprintf("_lockwait_timed_out(): [%s].\n", coev_treepos(waiter));
+}
+
+/* timeout < 0 is forever. */
+static int
+_colock_acquire(colock_t *p, int wf, ev_tstamp timeout) {
+    colock_dump("colock_acquire():", p);
+    _fm.i.c_lock_acquires ++;
+    
+    if (p->owner != NULL) {
+        colo_dprintf("colock_acquire(%p, %d): [%s]: fail; lock owner [%s]\n", 
+            p, wf, coev_treepos(ts_current), coev_treepos(p->owner));
+
+        if (   (wf == 0) || (timeout == 0.0) 
+            || ((timeout > 0.0) && ts_scheduler.scheduler && _wait_bound(ts_current, &timeout))) {
+            _fm.i.c_lock_acfails ++;
+            return 0;
+        }
+
+        _fm.i.c_lock_waits ++;
+        _fm.i.coevs_on_lock ++;
+        
+        /* put curcoro into the FIFO from the head. */
+        ts_current->lq_prev = NULL;
+        ts_current->lq_next = p->queue_head;
+        ts_current->lq_lock = p;
+        
+        if (p->queue_head)
+            p->queue_head->lq_prev = ts_current;
+        p->queue_head = ts_current;
+        if (!p->queue_tail)
+            p->queue_tail = p->queue_head;
+        
+        /* switch somewhere */
+        ts_current->state = CSTATE_LOCKWAIT;
+        ts_current->status = CSW_NONE;
+        COEV_TRACE(TR_LOCKWAIT, ts_current, p->owner, -1, 0);
+        coev_dprintf("colock_acquire(): [%s] sleeping on %p owner [%s], switching out\n", 
+            coev_treepos(ts_current), p, p->owner);
+        if (ts_scheduler.scheduler) {
+            if (timeout > 0.0) {
+                /* same timer as for I/O; counts as a waiter so coev_loop() stays */
+                _timer_arm(ts_current, timeout);
+                ts_scheduler.waiters++;
+            }
+            coev_switch(ts_scheduler.scheduler);
+        } else
+            coev_switch(p->owner);
+
+        colo_dprintf("colock_acquire(%p, %d): [%s] (waiter); switchback from [%s]; p->owner [%s]\n",
+            p, wf, coev_treepos(ts_current), coev_treepos(ts_current->origin), 
+            coev_treepos(p->owner));
+        
+        _fm.i.coevs_on_lock --;
+        
+        if (   (ts_current->status == CSW_TIMEOUT) 
+            || (ts_current->status == CSW_DEADLINE) 
+            || (ts_current->status == CSW_CANCELLED))
+            return 0;
+        
+    } else
+        p->owner = ts_current;
+    
+    colo_dprintf("colock_acquire(%p, %d): [%s] successfully acquires lock.\n", p, wf, coev_treepos(ts_current));
+    
+    return 1;
+}
+
+int
+colock_acquire(colock_t *p, int wf) {
+    return _colock_acquire(p, wf, -1.0);
+}
+
+int
+colock_acquire_timed(colock_t *p, double timeout) {
+    return _colock_acquire(p, 1, timeout < 0.0 ? 0.0 : timeout);
+}
+
+void 
+colock_release(colock_t *p) {
+    colock_dump("colock_release():", p);
+    if (p->owner == NULL) {
+        colo_dprintf("colock_release(%p): [%s] releases a lock that has no owner\n", p, coev_treepos(ts_current));
+        return;
+    }
+    _fm.i.c_lock_releases ++;
+    
+    colo_dprintf("colock_release(%p): [%s] releases lock that was acquired by [%s]; next owner [%s]\n", 
+        p, coev_treepos(ts_current), 
+        coev_treepos(p->owner), 
+        coev_treepos(p->queue_tail));
+    
+    p->owner = p->queue_tail;
+    
+    /* hand it to a waiting coro from tail, if any: it's the owner already */
+    if (p->queue_tail) {
+        coev_t *lucky = p->queue_tail;
+        
+        _colock_unqueue(p, lucky);
+        colock_dump("colock_release(): lock after release", p);
+        if ((lucky->tol >= 0) || ev_is_active(&lucky->io_timer)) {
+            _timeout_disarm(lucky);
+            ts_scheduler.waiters--;
+        }
+        lucky->state = CSTATE_SCHEDULED;
+        lucky->status = CSW_WAKEUP;
+        coev_runq_append(lucky, lucky->prio);
+        COEV_TRACE(TR_LOCKHANDOFF, ts_current, lucky, -1, CSW_WAKEUP);
+    }
+}
+
+int
+colock_is_locked(colock_t *p) {
+    if (p->owner != NULL)
+        return 1;
+    return 0;
+}
+
+/* channels, see the header */
+struct _coev_waitq {
+    coev_t *head;
+    coev_t *tail;
+};
+
+struct _coev_chan {
+    void **ring;
+    size_t size;        /* slots allocated */
+    size_t capacity;    /* 0 is unbounded */
+    size_t first;       /* slot of the oldest item */
+    size_t count;
+    struct _coev_waitq recvq;
+    struct _coev_waitq sendq;
+};
+
+static void
+_waitq_append(struct _coev_waitq *q, coev_t *c) {
+    c->lq_next = NULL;
+    c->lq_prev = q->tail;
+    if (q->tail)
+        q->tail->lq_next = c;
+    else
+        q->head = c;
+    q->tail = c;
+    c->cq_queue = q;
+}
+
+static void
+_waitq_remove(struct _coev_waitq *q, coev_t *c) {
+    if (c->lq_prev)
+        c->lq_prev->lq_next = c->lq_next;
+    else
+        q->head = c->lq_next;
+    if (c->lq_next)
+        c->lq_next->lq_prev = c->lq_prev;
+    else
+        q->tail = c->lq_prev;
+    c->lq_next = c->lq_prev = NULL;
+    c->cq_queue = NULL;
+}
+
+coevchan_t *
+coev_chan_new(size_t capacity) {
+    coevchan_t *ch = _fm.malloc(sizeof(coevchan_t));
+    
+    if (!ch)
+        fm_abort("coev_chan_new(): malloc failed.");
+    memset(ch, 0, sizeof(coevchan_t));
+    ch->capacity = capacity;
+    return ch;
+}
+
+void
+coev_chan_free(coevchan_t *ch) {
+    if (ch->recvq.head || ch->sendq.head)
+        fm_abort("coev_chan_free(): coroutines are waiting on it.");
+    if (ch->ring)
+        _fm.free(ch->ring);
+    _fm.free(ch);
+}
+
+size_t
+coev_chan_len(coevchan_t *ch) {
+    return ch->count;
+}
+
+static void
+_chan_push(coevchan_t *ch, void *item) {
+    if (ch->count == ch->size) {
+        size_t size = ch->size ? ch->size * 2 : 16, i;
+        void **ring;
+        
+        if (ch->capacity && (size > ch->capacity))
+            size = ch->capacity;
+        ring = _fm.malloc(size * sizeof(void *));
+        if (!ring)
+            fm_abort("_chan_push(): malloc failed.");
+        for (i = 0; i < ch->count; i++)
+            ring[i] = ch->ring[(ch->first + i) % ch->size];
+        if (ch->ring)
+            _fm.free(ch->ring);
+        ch->ring = ring;
+        ch->size = size;
+        ch->first = 0;
+    }
+    ch->ring[(ch->first + ch->count) % ch->size] = item;
+    ch->count ++;
+}
+
+static void *
+_chan_pop(coevchan_t *ch) {
+    void *item = ch->ring[ch->first];
+    
+    ch->first = (ch->first + 1) % ch->size;
+    ch->count --;
+    return item;
+}
+
+/* its part is done by whoever took it off the queue */
+static void
+_waitq_wake(coev_t *c) {
+    if ((c->tol >= 0) || ev_is_active(&c->io_timer)) {
+        _timeout_disarm(c);
+        ts_scheduler.waiters--;
+    }
+    c->state = CSTATE_SCHEDULED;
+    c->status = CSW_WAKEUP;
+    coev_runq_append(c, c->prio);
+    COEV_TRACE(TR_WAKEUP, c, ts_current, -1, CSW_WAKEUP);
+}
+
+/* timer went off for a channel or sync waiter */
+static void
+_waitq_timed_out(coev_t *waiter) {
+    int status = _timeout_status(waiter);
+    
+    if (status != CSW_TIMEOUT)
+        ;
+    else if (waiter->state == CSTATE_CHANWAIT)
+        _fm.i.c_chan_timeouts ++;
+    else if (waiter->state == CSTATE_SYNCWAIT)
+        _fm.i.c_sync_timeouts ++;
+    _waitq_remove(waiter->cq_queue, waiter);
+    
+    waiter->state = CSTATE_SCHEDULED;
+    waiter->status = status;
+    coev_runq_append(waiter, waiter->prio);
+    ts_scheduler.waiters--;
+    COEV_TRACE(TR_TIMEOUT, waiter, NULL, -1, status);
+}
+
+static int
+_waitq_check(ev_tstamp *timeout) {
+    if (*timeout == 0.0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (_wait_check(ts_current)) {
+        errno = EDEADLK;
+        return -1;
+    }
+    if (_wait_bound(ts_current, timeout)) {
+        errno = _wait_errno(ts_current);
+        return -1;
+    }
+    return 0;
+}
+
+/* state is CSTATE_CHANWAIT or CSTATE_SYNCWAIT; _waitq_check() first. */
+static int
+_waitq_park(struct _coev_waitq *q, void *item, ev_tstamp timeout, int state) {
+    coev_t *self = ts_current;
+    
+    _waitq_append(q, self);
+    self->cq_item = item;
+    self->state = state;
+    self->status = CSW_NONE;
+    COEV_TRACE(state == CSTATE_CHANWAIT ? TR_CHANWAIT : TR_SYNCWAIT, self, NULL, -1, 0);
+    if (timeout > 0.0) {
+        _timer_arm(self, timeout);
+        ts_scheduler.waiters++;
+    }
+    coev_switch(ts_scheduler.scheduler);
+    
+    if (self->status != CSW_WAKEUP) {
+        errno = _wait_errno(self);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+_chan_park(struct _coev_waitq *q, void *item, ev_tstamp timeout) {
+    if (_waitq_check(&timeout))
+        return -1;
+    _fm.i.c_chan_waits ++;
+    return _waitq_park(q, item, timeout, CSTATE_CHANWAIT);
+}
+
+int
+coev_chan_send(coevchan_t *ch, void *item, double timeout) {
+    coev_t *c;
+    
+    _fm.i.c_chan_sends ++;
+    if ((c = ch->recvq.head) != NULL) {
+        /* then it's empty: hand it over */
+        _waitq_remove(&ch->recvq, c);
+        c->cq_item = item;
+        _waitq_wake(c);
+        _fm.i.c_chan_handoffs ++;
+        return 0;
+    }
+    if (!ch->capacity || (ch->count < ch->capacity)) {
+        _chan_push(ch, item);
+        return 0;
+    }
+    /* full: the receiver that makes room takes the item */
+    return _chan_park(&ch->sendq, item, timeout);
+}
+
+int
+coev_chan_recv(coevchan_t *ch, void **item, double timeout) {
+    coev_t *c;
+    
+    if (ch->count) {
+        *item = _chan_pop(ch);
+        if ((c = ch->sendq.head) != NULL) {
+            _waitq_remove(&ch->sendq, c);
+            _chan_push(ch, c->cq_item);
+            _waitq_wake(c);
+        }
+        return 0;
+    }
+    if (_chan_park(&ch->recvq, NULL, timeout))
+        return -1;
+    *item = ts_current->cq_item;
+    return 0;
+}
+
+/* semaphores, events and conditions, see the header */
+struct _coev_sem {
+    long value;
+    struct _coev_waitq q;
+};
+
+struct _coev_event {
+    int flags;
+    int is_set;
+    struct _coev_waitq q;
+};
+
+struct _coev_cond {
+    struct _coev_waitq q;
+};
+
+static int
+_sync_park(struct _coev_waitq *q, ev_tstamp timeout) {
+    if (_waitq_check(&timeout))
+        return -1;
+    _fm.i.c_sync_waits ++;
+    return _waitq_park(q, NULL, timeout, CSTATE_SYNCWAIT);
+}
+
+/* wakes the first waiter, if any */
+static int
+_sync_wake_one(struct _coev_waitq *q) {
+    coev_t *c = q->head;
+    
+    if (!c)
+        return 0;
+    _waitq_remove(q, c);
+    _waitq_wake(c);
+    _fm.i.c_sync_wakeups ++;
+    return 1;
+}
+
+static void *
+_sync_alloc(size_t size, const char *what) {
+    void *p = _fm.malloc(size);
+    
+    if (!p)
+        fm_abort(what);
+    memset(p, 0, size);
+    return p;
+}
+
+cosem_t *
+cosem_new(long value) {
+    cosem_t *sem = _sync_alloc(sizeof(cosem_t), "cosem_new(): malloc failed.");
+    
+    sem->value = value;
+    return sem;
+}
+
+void
+cosem_free(cosem_t *sem) {
+    if (sem->q.head)
+        fm_abort("cosem_free(): coroutines are waiting on it.");
+    _fm.free(sem);
+}
+
+int
+cosem_acquire(cosem_t *sem, double timeout) {
+    /* no waiters if there's value: release hands it to them */
+    if (sem->value > 0) {
+        sem->value --;
+        return 0;
+    }
+    return _sync_park(&sem->q, timeout);
+}
+
+void
+cosem_release(cosem_t *sem, long n) {
+    while ((n > 0) && _sync_wake_one(&sem->q))
+        n--;
+    sem->value += n;
+}
+
+long
+cosem_value(cosem_t *sem) {
+    return sem->value;
+}
+
+coevent_t *
+coevent_new(int flags) {
+    coevent_t *ev = _sync_alloc(sizeof(coevent_t), "coevent_new(): malloc failed.");
+    
+    ev->flags = flags;
+    return ev;
+}
+
+void
+coevent_free(coevent_t *ev) {
+    if (ev->q.head)
+        fm_abort("coevent_free(): coroutines are waiting on it.");
+    _fm.free(ev);
+}
+
+int
+coevent_wait(coevent_t *ev, double timeout) {
+    if (ev->is_set) {
+        if (ev->flags & COEVENT_ONESHOT)
+            ev->is_set = 0;
+        return 0;
+    }
+    return _sync_park(&ev->q, timeout);
+}
+
+void
+coevent_set(coevent_t *ev) {
+    if (ev->flags & COEVENT_ONESHOT) {
+        if (!_sync_wake_one(&ev->q))
+            ev->is_set = 1;
+        return;
+    }
+    ev->is_set = 1;
+    while (_sync_wake_one(&ev->q))
+        ;
 }
 
-void 
-colock_free(colock_t *lock) {
-    colock_t *prev;
-    colbunch_t *bunch = lock->bunch;
-    
-    lock->owner = NULL;
-        
-    colo_dprintf("colock_free(%p): [%s] deallocates [%s]'s %p (of bunch %p)\n", lock, coev_treepos(ts_current), 
-        coev_treepos(lock->owner), lock, bunch);
-    
-    prev = bunch->used;
-    
-    if ( lock != prev ) {
-	/* find previous lock in the used list */
-	while (prev->next != lock) {
-	    if (prev->next == NULL) {
-                colbunch_dump(ts_rootlockbunch);
-		fm_abort("Whoa, colbunch_t at %p is corrupted!");
-            }
-	    prev = prev->next;
-	}
-        prev->next = lock->next;
-    } else
-        bunch->used = lock->next;
-    
-    /* put it at the top of free list */
-    lock->next = bunch->avail;
-    bunch->avail = lock;
-    colbunch_dump(ts_rootlockbunch);
-    _fm.i.colocks_used --;
+void
+coevent_clear(coevent_t *ev) {
+    ev->is_set = 0;
 }
 
 int
-colock_acquire(colock_t *p, int wf) {
-    colock_dump("colock_acquire():", p);
-    _fm.i.c_lock_acquires ++;
-    
-    if (p->owner != NULL) {
-        colo_dprintf("colock_acquire(%p, %d): [%s]: fail; lock owner [%s]\n", 
-            p, wf, coev_treepos(ts_current), coev_treepos(p->owner));
+coevent_is_set(coevent_t *ev) {
+    return ev->is_set;
+}
 
-        if (wf == 0) {
-            _fm.i.c_lock_acfails ++;
-            return 0;
-        }
+cocond_t *
+cocond_new(void) {
+    return _sync_alloc(sizeof(cocond_t), "cocond_new(): malloc failed.");
+}
 
-        _fm.i.c_lock_waits ++;
-        _fm.i.coevs_on_lock ++;
-        
-        /* put curcoro into the FIFO from the head. */
-        ts_current->lq_prev = NULL;
-        ts_current->lq_next = p->queue_head;
-        
-        if (p->queue_head)
-            p->queue_head->lq_prev = ts_current;
-        p->queue_head = ts_current;
-        if (!p->queue_tail)
-            p->queue_tail = p->queue_head;
-        
-        /* switch somewhere */
-        ts_current->state = CSTATE_LOCKWAIT;
-        coev_dprintf("colock_acquire(): [%s] sleeping on %p owner [%s], switching out\n", 
-            coev_treepos(ts_current), p, p->owner);
-        if (ts_scheduler.scheduler)
-            coev_switch(ts_scheduler.scheduler);
-        else
-            coev_switch(p->owner);
+void
+cocond_free(cocond_t *cv) {
+    if (cv->q.head)
+        fm_abort("cocond_free(): coroutines are waiting on it.");
+    _fm.free(cv);
+}
 
-        colo_dprintf("colock_acquire(%p, %d): [%s] (waiter); switchback from [%s]; p->owner [%s]\n",
-            p, wf, coev_treepos(ts_current), coev_treepos(ts_current->origin), 
-            coev_treepos(p->owner));
-        
-        _fm.i.coevs_on_lock --;
-        
-    } else
-        p->owner = ts_current;
+int
+cocond_wait(cocond_t *cv, colock_t *lock, double timeout) {
+    int rv;
     
-    colo_dprintf("colock_acquire(%p, %d): [%s] successfully acquires lock.\n", p, wf, coev_treepos(ts_current));
+    if (lock && (lock->owner != ts_current)) {
+        errno = EPERM;
+        return -1;
+    }
+    if (_waitq_check(&timeout))
+        return -1;
+    /* colock_release() does not switch, so no notify can slip in between */
+    if (lock)
+        colock_release(lock);
+    _fm.i.c_sync_waits ++;
+    rv = _waitq_park(&cv->q, NULL, timeout, CSTATE_SYNCWAIT);
+    if (lock)
+        colock_acquire(lock, 1);
+    return rv;
+}
+
+void
+cocond_notify(cocond_t *cv, long n) {
+    while (n-- && _sync_wake_one(&cv->q))
+        ;
+}
+
+size_t
+cocond_waiters(cocond_t *cv) {
+    coev_t *c;
+    size_t n = 0;
     
-    return 1;
+    for (c = cv->q.head; c; c = c->lq_next)
+        n++;
+    return n;
 }
 
-void 
-colock_release(colock_t *p) {
-    colock_dump("colock_release():", p);
-    if (p->owner == NULL) {
-        colo_dprintf("colock_release(%p): [%s] releases a lock that has no owner\n", p, coev_treepos(ts_current));
+/*  child processes.
+    
+    libev's default loop reaps every child on SIGCHLD by itself, 
+    waitpid(-1, ...), and hands the status to ev_child watchers. so
+    there's one watcher for any pid, started with the default loop: it 
+    gives the status to the coroutine waiting for that pid, or for any,
+    and if there's none keeps it in child_reaped, where coev_waitpid() 
+    looks first. otherwise a status reaped that way would be lost to 
+    a plain waitpid() as ECHILD. child_reaped is a FIFO of at most
+    CHILD_KEPT_MAX: a child nobody ever waits for must not cost memory
+    forever, so past that the oldest status is dropped.
+    
+    child_waitq is the default loop thread's only. child_reaped is 
+    under child_lock, as other threads' coev_waitpid() look there too:
+    they aren't on the default loop and poll with WNOHANG. */
+
+struct _coev_childwait {
+    pid_t pid;              /* asked for, -1 is any */
+    pid_t rpid;             /* got */
+    int rstatus;
+};
+
+struct _coev_reaped {
+    pid_t pid;
+    int status;
+    struct _coev_reaped *next;
+};
+
+#define CHILD_KEPT_MAX 1024
+
+static ev_child child_w;
+static struct _coev_waitq child_waitq;
+static struct _coev_reaped *child_reaped, **child_reaped_tail = &child_reaped;
+static int child_reaped_count;
+static pthread_mutex_t child_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+child_callback(struct ev_loop *loop, ev_child *w, int revents) {
+    struct _coev_childwait *cw;
+    struct _coev_reaped *r;
+    coev_t *c;
+    
+    for (c = child_waitq.head; c; c = c->lq_next) {
+        cw = (struct _coev_childwait *) c->cq_item;
+        if ((cw->pid == -1) || (cw->pid == w->rpid))
+            break;
+    }
+    if (c) {
+        cw->rpid = w->rpid;
+        cw->rstatus = w->rstatus;
+        _waitq_remove(&child_waitq, c);
+        _timeout_disarm(c);
+        c->state = CSTATE_SCHEDULED;
+        c->status = CSW_WAKEUP;
+        coev_runq_append(c, c->prio);
+        ts_scheduler.waiters--;
+        COEV_TRACE(TR_WAKEUP, c, NULL, -1, CSW_WAKEUP);
         return;
     }
-    _fm.i.c_lock_releases ++;
     
-    colo_dprintf("colock_release(%p): [%s] releases lock that was acquired by [%s]; next owner [%s]\n", 
-        p, coev_treepos(ts_current), 
-        coev_treepos(p->owner), 
-        coev_treepos(p->queue_tail));
+    r = _fm.malloc(sizeof(struct _coev_reaped));
+    if (!r)
+        fm_abort("child_callback(): malloc failed.");
+    r->pid = w->rpid;
+    r->status = w->rstatus;
+    r->next = NULL;
+    pthread_mutex_lock(&child_lock);
+    *child_reaped_tail = r;
+    child_reaped_tail = &r->next;
+    if (++child_reaped_count > CHILD_KEPT_MAX) {
+        r = child_reaped;
+        child_reaped = r->next;
+        child_reaped_count--;
+    } else
+        r = NULL;
+    pthread_mutex_unlock(&child_lock);
+    _fm.i.c_child_kept ++;
+    if (r) {
+        _fm.free(r);
+        _fm.i.c_child_dropped ++;
+    }
+}
+
+/* called by coev_evinit() */
+static void
+_child_evinit(void) {
+    if (!ev_is_default_loop(ts_scheduler.loop))
+        return;
+    ev_child_init(&child_w, child_callback, 0, 0);
+    ev_child_start(ts_scheduler.loop, &child_w);
+    ev_unref(ts_scheduler.loop);
+}
+
+/* the parent's children aren't ours */
+static void
+_child_forked(void) {
+    struct _coev_reaped *r;
     
-    p->owner = p->queue_tail;
+    pthread_mutex_init(&child_lock, NULL);
+    while ((r = child_reaped) != NULL) {
+        child_reaped = r->next;
+        _fm.free(r);
+    }
+    child_reaped_tail = &child_reaped;
+    child_reaped_count = 0;
+    child_waitq.head = child_waitq.tail = NULL;
+}
+
+/* takes a kept status, if there's one */
+static pid_t
+_child_kept(pid_t pid, int *status) {
+    struct _coev_reaped **rp, *r;
+    pid_t rv = 0;
     
-    /* take a waiting coro from tail, if any */
-    if (p->queue_tail) {
-        coev_t *lucky = p->queue_tail;
-        p->queue_tail = p->queue_tail->lq_prev;
-        if (p->queue_tail)
-            p->queue_tail->lq_next = NULL;
-        if (lucky == p->queue_head)
-            p->queue_head = NULL;
-        colock_dump("colock_release(): lock after release", p);
-        lucky->state = CSTATE_RUNNABLE;
-        coev_schedule(lucky);
+    pthread_mutex_lock(&child_lock);
+    for (rp = &child_reaped; (r = *rp) != NULL; rp = &r->next)
+        if ((pid == -1) || (r->pid == pid))
+            break;
+    if (r) {
+        if ((*rp = r->next) == NULL)
+            child_reaped_tail = rp;
+        child_reaped_count--;
+        rv = r->pid;
+        if (status)
+            *status = r->status;
     }
+    pthread_mutex_unlock(&child_lock);
+    if (r)
+        _fm.free(r);
+    return rv;
 }
 
-int
-colock_is_locked(colock_t *p) {
-    if (p->owner != NULL)
-        return 1;
-    return 0;
+/* waitpid(WNOHANG) that knows about the kept ones */
+static pid_t
+_child_poll(pid_t pid, int *status) {
+    pid_t rv;
+    
+    if ((rv = _child_kept(pid, status)) != 0)
+        return rv;
+    while (((rv = waitpid(pid, status, WNOHANG)) == -1) && (errno == EINTR))
+        ;
+    if ((rv == -1) && (errno == ECHILD)) {
+        /* the default loop's thread might have got it just now */
+        pid_t kept = _child_kept(pid, status);
+        
+        if (kept)
+            return kept;
+        errno = ECHILD;
+    }
+    return rv;
+}
+
+/* not on the default loop: poll, backing off up to 50ms */
+static pid_t
+_child_sleepwait(pid_t pid, int *status, ev_tstamp timeout) {
+    coev_t *self = ts_current;
+    ev_tstamp step = 0.001, left = timeout;
+    pid_t rv;
+    
+    for (;;) {
+        if ((timeout > 0.0) && (step > left))
+            step = left;
+        coev_sleep(step);
+        if (self->status != CSW_WAKEUP) {
+            errno = _wait_errno(self);
+            return -1;
+        }
+        if ((rv = _child_poll(pid, status)) != 0)
+            return rv;
+        if (timeout > 0.0) {
+            left -= step;
+            if (left <= 0.0)
+                return 0;
+        }
+        if (step < 0.05)
+            step *= 2;
+    }
+}
+
+pid_t
+coev_waitpid(pid_t pid, int *status, ev_tstamp timeout) {
+    coev_t *self = ts_current;
+    struct _coev_childwait cw;
+    pid_t rv;
+    
+    if ((pid <= 0) && (pid != -1)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((rv = _child_poll(pid, status)) != 0)
+        return rv;
+    if (timeout == 0.0)
+        return 0;
+    if (timeout < 0.0)
+        timeout = 0.0;
+    if (_wait_check(self)) {
+        errno = EDEADLK;
+        return -1;
+    }
+    if (_wait_bound(self, &timeout)) {
+        errno = _wait_errno(self);
+        return -1;
+    }
+    _fm.i.c_child_waits ++;
+    if (!ev_is_default_loop(ts_scheduler.loop))
+        return _child_sleepwait(pid, status, timeout);
+    
+    cw.pid = pid;
+    cw.rpid = 0;
+    cw.rstatus = 0;
+    _waitq_append(&child_waitq, self);
+    self->cq_item = &cw;
+    self->state = CSTATE_CHILDWAIT;
+    COEV_TRACE(TR_CHILDWAIT, self, NULL, -1, 0);
+    _timer_arm(self, timeout);
+    _wait_switch(self);
+    
+    switch (self->status) {
+        case CSW_WAKEUP:
+            if (status)
+                *status = cw.rstatus;
+            return cw.rpid;
+        case CSW_TIMEOUT:
+            return 0;
+        default:
+            errno = _wait_errno(self);
+            return -1;
+    }
 }
 
 /*  Coroutine-local storage is designed to satisfy perverse semantics 
     that Python/thread.c expects. Go figure.
     
-    key value of 0 means this slot is not used. 0 is never returned 
-    by cls_allocate().
+    a key is generation << CLS_INDEX_BITS | index. index 0 is not used.
+    each coroutine has an array of { key, value }, indexed by the index,
+    which starts inline in coev_t and grows when a bigger index is set. 
+    the slot is valid only if its key matches the whole key and the key 
+    is still there, so stale values of a dropped key are never seen, and 
+    are overwritten when the index is reused. thus other threads' 
+    coroutines are never touched.
 */
-#define CLS_FREE_SLOT 0L
+#define CLS_INDEX(k) ((k) & (CLS_MAX_KEYS - 1))
+/* generations stay in 31 bits with the index: PyThread keys are int */
+#define CLS_MAX_GEN ((1L << (31 - CLS_INDEX_BITS)) - 1)
 
 long 
 cls_new(void) {
-    ts_cls_last_key++;
-    return ts_cls_last_key;
+    long k = 0;
+    int i;
+    
+#ifdef THREADING_MADNESS
+    pthread_mutex_lock(&cls_key_lock);
+#endif
+    /* the lowest free index keeps the arrays short */
+    for (i = 1; i < CLS_MAX_KEYS; i++)
+        if (cls_keygen[i] == 0) {
+            if (++cls_last_gen > CLS_MAX_GEN)
+                cls_last_gen = 1;
+            cls_keygen[i] = cls_last_gen;
+            k = (cls_last_gen << CLS_INDEX_BITS) | i;
+            break;
+        }
+#ifdef THREADING_MADNESS
+    pthread_mutex_unlock(&cls_key_lock);
+#endif
+    if (k == 0)
+        fm_abort("cls_new(): out of keys");
+    coev_dprintf("cls_new(): %ld (index %ld)\n", k, CLS_INDEX(k));
+    return k;
 }
 
 static void
-cls_keychain_init(cokeychain_t **kc) {
-    if (*kc == NULL) {
-	*kc = _fm.malloc(sizeof(cokeychain_t));
-	if (*kc == NULL) 
-	    fm_abort("ENOMEM allocating new keychain");
-    }
-    memset(*kc, 0, sizeof(cokeychain_t));
-}
-
-static void 
-cls_keychain_fini(cokeychain_t *kc) {
-    cokeychain_t *c = kc, *p;
-    
-    while (c) {
-	p = c;
-	c = c->next;
-	_fm.free(p);
-    }
+cls_fini(coev_t *c) {
+    if (c->cls_slots != c->cls_inline)
+        _fm.free(c->cls_slots);
+    memset(c->cls_inline, 0, sizeof(c->cls_inline));
+    c->cls_slots = c->cls_inline;
+    c->cls_size = CLS_INLINE_SLOTS;
 }
 
 static cokey_t *
 cls_find(long k) {
-    cokeychain_t *kc = &(ts_current->kc);
-    int i;
-    
-    while (kc) {
-	for (i = 0; i<CLS_KEYCHAIN_SIZE; i++)
-	    if (kc->keys[i].key == k)
-		return &(kc->keys[i]);
-	kc = kc->next;
-    }
-
-    if (k == 0) {
-	/* this was an attempt to find a free slot */
-	kc = NULL;
-	
-	cls_keychain_init(&kc);
-	if (ts_current->kc_tail)
-	    ts_current->kc_tail->next = kc;
-	else
-	    ts_current->kc_tail = kc;
-	return &(kc->keys[0]);
-    }
+    long i = CLS_INDEX(k);
     
+    if ((i < ts_current->cls_size) && (ts_current->cls_slots[i].key == k)
+        && (cls_keygen[i] == (k >> CLS_INDEX_BITS)))
+        return &ts_current->cls_slots[i];
     return NULL;
 }
 
@@ -1608,19 +4550,36 @@ cls_get(long k) {
 
 int
 cls_set(long k, void *v) {
-    cokeychain_t *kc = &(ts_current->kc);
-    int i;
-
-    while (kc) {
-	for (i = 0; i<CLS_KEYCHAIN_SIZE; i++)
-	    if (kc->keys[i].key == 0) {
-		kc->keys[i].key = k;
-		kc->keys[i].value = v;
-		return 0;
-	    }
-	kc = kc->next;
+    coev_t *self = ts_current;
+    long i = CLS_INDEX(k);
+    
+    if ((k <= 0) || (i == 0) || (cls_keygen[i] != (k >> CLS_INDEX_BITS)))
+        return -1;
+    
+    if (i >= self->cls_size) {
+        long size = self->cls_size;
+        cokey_t *slots;
+        
+        while (size <= i)
+            size *= 2;
+        if (self->cls_slots == self->cls_inline) {
+            slots = _fm.malloc(size * sizeof(cokey_t));
+            if (slots)
+                memcpy(slots, self->cls_inline, sizeof(self->cls_inline));
+        } else
+            slots = _fm.realloc(self->cls_slots, size * sizeof(cokey_t));
+        if (slots == NULL)
+            return -1;
+        memset(slots + self->cls_size, 0, (size - self->cls_size) * sizeof(cokey_t));
+        self->cls_slots = slots;
+        self->cls_size = size;
     }
-    return -1;
+    
+    if (self->cls_slots[i].key == k)
+        return 0; /* there already */
+    self->cls_slots[i].key = k;
+    self->cls_slots[i].value = v;
+    return 0;
 }
     
 void
@@ -1628,23 +4587,108 @@ cls_del(long k) {
     cokey_t *t;
     
     t = cls_find(k);
-    if (t)
+    if (t) {
 	t->key = CLS_FREE_SLOT;
+        t->value = NULL;
+    }
 }
 
 void
-cls_drop_across(long key) {
-    coev_dprintf("cls_drop_across(%ld): NOT IMPLEMENTED.\n", key);
+cls_drop_across(long k) {
+    long i = CLS_INDEX(k);
+    
+    coev_dprintf("cls_drop_across(%ld)\n", k);
+#ifdef THREADING_MADNESS
+    pthread_mutex_lock(&cls_key_lock);
+#endif
+    /* values are left where they are: they're stale by generation */
+    if (cls_keygen[i] == (k >> CLS_INDEX_BITS))
+        cls_keygen[i] = 0;
+#ifdef THREADING_MADNESS
+    pthread_mutex_unlock(&cls_key_lock);
+#endif
 }
 
 void
 cls_drop_others(void) {
-    coev_dprintf("cls_drop_others(): NOT IMPLEMENTED.\n");
+    coev_t *c;
+    
+    coev_dprintf("cls_drop_others(): [%s]\n", coev_treepos(ts_current));
+    for (c = ts_coev_bunch.busy; c != NULL; c = c->cb_next)
+        if (c != ts_current)
+            cls_fini(c);
+    if (ts_root != ts_current)
+        cls_fini(ts_root);
 }
 
 /* used in buf growth calculations */
 static const ssize_t CNRBUF_MAGIC = 1<<12;
 
+/*  persistent watcher mode.
+    
+    the buffer's own ev_io stays started between reads, so that waiting
+    again doesn't cost an epoll_ctl(). libev is level-triggered, edges are
+    made up here: a readiness report is latched into cnrbuf_t::ready, and 
+    if nobody is reading and it's reported again, the watcher is stopped 
+    until the next wait, so unread data doesn't make the loop spin.
+    
+    cnrbuf_t::owner is whoever is inside _coev_xfer() on it, waiting 
+    or spin-yielding. */
+
+static void
+cnrbuf_io_callback(struct ev_loop *loop, ev_io *w, int revents) {
+    cnrbuf_t *nb = (cnrbuf_t *) ( ((char *)w) - offsetof(cnrbuf_t, watcher) );
+    coev_t *waiter = nb->owner;
+    
+    if (waiter == NULL) {
+        if (nb->ready)
+            ev_io_stop(loop, w);
+        nb->ready = 1;
+        return;
+    }
+    nb->ready = 1;
+    if (waiter->state != CSTATE_IOWAIT)
+        return; /* spin-yielding, will look at ready */
+    
+    _timeout_disarm(waiter);
+    waiter->state = CSTATE_SCHEDULED;
+    waiter->status = CSW_EVENT;
+    coev_runq_append(waiter, waiter->prio);
+    ts_scheduler.waiters -= 1;
+    COEV_TRACE(TR_WAKEUP, waiter, NULL, nb->fd, CSW_EVENT);
+    
+    coev_dprintf("cnrbuf_io_callback(): [%s] fd=%d revents=%d\n", 
+        coev_treepos(waiter), nb->fd, revents);
+}
+
+/* coev_wait() on the buffer's persistent watcher */
+static void
+_cnrbuf_wait(cnrbuf_t *nb, ev_tstamp timeout) {
+    coev_t *self = ts_current;
+    
+    if (_wait_check(self) || _wait_bound(self, &timeout))
+        return;
+    
+    if (!ev_is_active(&nb->watcher)) {
+        ev_io_set(&nb->watcher, nb->fd, EV_READ);
+        ev_io_start(ts_scheduler.loop, &nb->watcher);
+    }
+    _timeout_arm(self, timeout);
+    _fm.i.c_waits++;
+    self->state = CSTATE_IOWAIT;
+    COEV_TRACE(TR_WAIT, self, NULL, nb->fd, COEV_READ);
+    
+    _wait_switch(self);
+}
+
+void
+cnrbuf_setmode(cnrbuf_t *buf, int flags, int spin) {
+    buf->flags = flags;
+    buf->spin = spin > 0 ? spin : 0;
+    if (!(flags & CNRBUF_PERSISTENT))
+        ev_io_stop(ts_scheduler.loop, &buf->watcher);
+}
+
 
 void 
 cnrbuf_init(cnrbuf_t *self, int fd, double timeout, size_t prealloc, size_t rlim) {
@@ -1654,6 +4698,11 @@ cnrbuf_init(cnrbuf_t *self, int fd, double timeout, size_t prealloc, size_t rlim
     self->in_buffer = _fm.malloc(self->in_allocated);
     self->fd = fd;
     self->err_no = 0;
+    self->owner = NULL;
+    self->flags = 0;
+    self->spin = 0;
+    self->ready = 0;
+    ev_init(&self->watcher, cnrbuf_io_callback);
     
     if (!self->in_buffer)
 	fm_abort("cnrbuf_init(): No memory for me!");
@@ -1664,6 +4713,7 @@ cnrbuf_init(cnrbuf_t *self, int fd, double timeout, size_t prealloc, size_t rlim
 
 void 
 cnrbuf_fini(cnrbuf_t *buf) {
+    ev_io_stop(ts_scheduler.loop, &buf->watcher);
     _fm.free(buf->in_buffer);
     _fm.i.cnrbufs_allocated --;
     _fm.i.cnrbufs_used --;
@@ -1720,26 +4770,144 @@ sf_reshuffle_buffer(cnrbuf_t *self, ssize_t needed) {
         posn_offset = self->in_position - self->in_buffer;
 	self->in_buffer = _fm.realloc(self->in_buffer, newsize);
         
-        if (!self->in_buffer) {
-            errno = ENOMEM;
-            return -1; /* no memory */
+        if (!self->in_buffer) {
+            errno = ENOMEM;
+            return -1; /* no memory */
+        }
+        self->in_allocated = newsize;
+        self->in_position = self->in_buffer + posn_offset;
+        cnrb_dprintf("sf_reshuffle_buffer(*,%zd): realloc successful: newsize=%zd\n", 
+            needed, self->in_allocated);
+    }
+    /* we're still have 2*CNRBUF_MAGIC bytes more than needed */
+    /* OR we just reallocated the buffer and let's move */
+    /* the used bytes to the top anyway */
+    
+    memmove(self->in_buffer, self->in_position, self->in_used);
+    self->in_position = self->in_buffer;
+
+    cnrb_dprintf("sf_reshuffle_buffer(*,%zd): after realloc and/or move\n", needed);
+    cnrb_dump(self);
+    
+    return 0;
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* is UIO_MAXIOV on linux */
+#endif
+
+/* how a _coev_xfer() got done, see coev_instrumentation_t::c_io_* */
+#define XFER_DIRECT     0
+#define XFER_SPUN       1
+#define XFER_PARKED     2
+#define XFER_PERSISTENT 3
+#define XFER_URING      4
+
+static void
+_xfer_account(int path) {
+    switch (path) {
+        case XFER_DIRECT:     _fm.i.c_io_direct ++; break;
+        case XFER_SPUN:       _fm.i.c_io_spun ++; break;
+        case XFER_PARKED:     _fm.i.c_io_parked ++; break;
+        case XFER_PERSISTENT: _fm.i.c_io_persistent ++; break;
+        case XFER_URING:      _fm.i.c_io_uring ++; break;
+    }
+}
+
+/* recv()/send()/sendmsg() on a non-blocking socket that waits for it 
+   if need be. returns what they would, -1 with errno ETIMEDOUT on timeout.
+   reads take iov[0] only. sflags go to sendmsg().
+   
+   nb is the cnrbuf_t for reads through one, NULL otherwise: then
+   up to nb->spin times coev_stall() is tried before parking, and 
+   with CNRBUF_PERSISTENT its watcher is used. between spins, the 
+   syscall is retried only if the watcher isn't there or said ready.
+   
+   with io_uring, once the socket says EAGAIN, the transfer 
+   itself is queued instead of waiting for readiness and retrying. */
+static ssize_t
+_coev_xferv(cnrbuf_t *nb, int op, int fd, struct iovec *iov, int iovcnt, 
+            int sflags, ev_tstamp timeout) {
+    int spins = nb ? nb->spin : 0;
+    int persistent = nb && (nb->flags & CNRBUF_PERSISTENT);
+    int path = XFER_DIRECT;
+    int tried = 0;
+    ssize_t rv;
+    
+    if (nb)
+        nb->owner = ts_current;
+    
+    for (;;) {
+        if (!tried || !persistent || nb->ready || !ev_is_active(&nb->watcher)) {
+            tried = 1;
+            if (nb)
+                nb->ready = 0;
+            if (op == COEV_READ)
+                rv = recv(fd, iov->iov_base, iov->iov_len, 0);
+            else if ((iovcnt == 1) && !sflags)
+                rv = send(fd, iov->iov_base, iov->iov_len, MSG_NOSIGNAL);
+            else {
+                struct msghdr msg;
+                
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovcnt;
+                rv = sendmsg(fd, &msg, MSG_NOSIGNAL | sflags);
+            }
+            if ((rv != -1) || (errno != EAGAIN))
+                break;
+#ifdef COEV_URING
+            if ((iovcnt == 1) && !sflags && _uring_active() 
+                && !_uring_xfer(op, fd, iov->iov_base, iov->iov_len, timeout, &rv)) {
+                path = XFER_URING;
+                break;
+            }
+#endif
+        }
+        
+        if ((spins > 0) && !coev_stall()) {
+            spins --;
+            path = XFER_SPUN;
+            continue;
+        }
+        
+        if (persistent) {
+            _cnrbuf_wait(nb, timeout);
+            path = XFER_PERSISTENT;
+        } else {
+            coev_wait(fd, op, timeout);
+            path = XFER_PARKED;
+        }
+        spins = nb ? nb->spin : 0;
+        
+        switch (coev_current()->status) {
+            case CSW_EVENT:
+                continue;
+            case CSW_TIMEOUT:
+            case CSW_DEADLINE:
+            case CSW_CANCELLED:
+                errno = _wait_errno(coev_current());
+                rv = -1;
+                break;
+            default:
+                fm_abort("_coev_xfer(): unpossible status after wait");
         }
-        self->in_allocated = newsize;
-        self->in_position = self->in_buffer + posn_offset;
-        cnrb_dprintf("sf_reshuffle_buffer(*,%zd): realloc successful: newsize=%zd\n", 
-            needed, self->in_allocated);
+        break;
     }
-    /* we're still have 2*CNRBUF_MAGIC bytes more than needed */
-    /* OR we just reallocated the buffer and let's move */
-    /* the used bytes to the top anyway */
     
-    memmove(self->in_buffer, self->in_position, self->in_used);
-    self->in_position = self->in_buffer;
+    if (nb)
+        nb->owner = NULL;
+    _xfer_account(path);
+    return rv;
+}
 
-    cnrb_dprintf("sf_reshuffle_buffer(*,%zd): after realloc and/or move\n", needed);
-    cnrb_dump(self);
+static ssize_t
+_coev_xfer(cnrbuf_t *nb, int op, int fd, void *buf, size_t len, ev_tstamp timeout) {
+    struct iovec iov;
     
-    return 0;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return _coev_xferv(nb, op, fd, &iov, 1, 0, timeout);
 }
 
 ssize_t 
@@ -1787,28 +4955,16 @@ cnrbuf_read(cnrbuf_t *self, void **p, ssize_t sizehint) {
             self->err_no = ENOMEM;
             return 0;
         }
-rerecv:
-	readen = recv(self->fd, self->in_position + self->in_used, to_read, 0);
+	readen = _coev_xfer(self, COEV_READ, self->fd, self->in_position + self->in_used, 
+                    to_read, self->iop_timeout);
         cnrb_dprintf("cnrbuf_read(): %zd bytes read into %p, reqd len %zd\n", 
             readen, self->in_position + self->in_used, to_read);
         cnrb_dump(self);
         
-	if (readen == -1) {
-	    if (errno == EAGAIN) {
-		coev_wait(self->fd, COEV_READ, self->iop_timeout);
-                if (ts_current->status == CSW_EVENT)
-                    goto rerecv;
-                
-		if (ts_current->status == CSW_TIMEOUT)
-                    self->err_no = ETIMEDOUT;
-                else
-                    fm_abort("cnrbuf_read(): unpossible status after wait");
-            } else {
-                self->err_no = errno;
-            }
-	} else {
+	if (readen == -1)
+            self->err_no = errno;
+        else
             self->in_used += readen;
-        }
         
     } while (readen > 0);
     
@@ -1893,6 +5049,11 @@ cnrbuf_readline(cnrbuf_t *self, void **p, ssize_t sizehint) {
     cnrb_dprintf("cnrbuf_readline(): fd=%d sizehint %zd bytes buflimit %zd bytes errno=%d\n", 
         self->fd, sizehint, self->in_limit, self->err_no);
     
+    if (self->owner && (self->owner != ts_current)) {
+        errno = EBUSY;
+        return -1;
+    }
+    
     if ((self->err_no != 0) && (self->in_used == 0)) {
         /* we had error, but returned buffer 
            contents up to it. Return error now */
@@ -1923,8 +5084,8 @@ cnrbuf_readline(cnrbuf_t *self, void **p, ssize_t sizehint) {
             self->err_no = ENOMEM;
             return 0;
         }
-rerecv:
-	readen = recv(self->fd, self->in_position + self->in_used, to_read, 0);
+	readen = _coev_xfer(self, COEV_READ, self->fd, self->in_position + self->in_used, 
+                    to_read, self->iop_timeout);
         cnrb_dprintf("cnrbuf_readline: %zd bytes read into %p, reqd len %zd errno %s\n", 
                 readen, self->in_position + self->in_used, to_read, 
                 readen==-1? strerror(errno): "none");
@@ -1938,22 +5099,8 @@ rerecv:
                 return rv;
         }
         
-	if (readen == -1) {
-	    if (errno == EAGAIN) {
-		coev_wait(self->fd, COEV_READ, self->iop_timeout);
-                if (ts_current->status == CSW_EVENT) {
-                    cnrb_dprintf("cnrbuf_readline(): CSW_EVENT after wait, continuing\n");
-                    goto rerecv;
-                }
-                
-		if (ts_current->status == CSW_TIMEOUT)
-                    self->err_no = ETIMEDOUT;
-                else
-                    fm_abort("cnrbuf_readline(): unpossible status after wait");
-            } else {
-                self->err_no = errno;
-            }
-	}
+	if (readen == -1)
+            self->err_no = errno;
 
     } while(readen > 0);
     cnrb_dprintf("cnrbuf_readline: readen==%d, errno=%d\n", readen, self->err_no);
@@ -1980,22 +5127,10 @@ coev_send(int fd, const void *data, ssize_t len, ssize_t *rv, double timeout) {
     
     cnrb_dprintf("coev_send(): fd=%d len=%zd bytes\n", fd, to_write);
     while (to_write){ 
-	wrote = send(fd, (char *)data + written, to_write, MSG_NOSIGNAL);
+	wrote = _coev_xfer(NULL, COEV_WRITE, fd, (char *)data + written, to_write, timeout);
 	cnrb_dprintf("coev_send(): fd=%d wrote=%zd bytes\n", fd, wrote);
-	if (wrote == -1) {
-	    if (errno == EAGAIN) {
-		coev_wait(fd, COEV_WRITE, timeout);
-		if (ts_current->status == CSW_EVENT)
-		    continue;
-                if (ts_current->status == CSW_TIMEOUT) {
-                    errno = ETIMEDOUT;
-                    *rv = written;
-                    return -1;
-                }
-                fm_abort("coev_send() unpossible status after wait()");
-	    }
+	if (wrote == -1)
 	    break;
-	}
 	written += wrote;
 	to_write -= wrote;
     }
@@ -2003,9 +5138,546 @@ coev_send(int fd, const void *data, ssize_t len, ssize_t *rv, double timeout) {
     return to_write == 0 ? 0 : -1;
 }
 
+#ifdef MSG_ZEROCOPY
+/*  MSG_ZEROCOPY completions.
+    
+    each zerocopy sendmsg() that succeeds gets the next number, the 
+    kernel says which ranges of those are done via the socket's error 
+    queue. coev_sendv() returns as soon as it has sent everything and 
+    leaves the buffers with the scheduler, which looks into the error 
+    queues of the sockets it has some for every COEV_ZEROCOPY_BACKOFF
+    and calls done() for those the kernel is through with. 
+    
+    a watcher won't do: error queue makes the socket POLLERR, which 
+    libev reports as readable, and so would be any data nobody reads.
+    
+    only range lengths are counted, so a _coev_zcsock must not outlive
+    its sends; it goes away when it has no calls and no senders left. */
+static struct _coev_zcsock *
+_zc_sock(int fd) {
+    struct _coev_zcsock *zs;
+    
+    for (zs = ts_scheduler.zc_socks; zs; zs = zs->next)
+        if (zs->fd == fd)
+            return zs;
+    zs = _fm.malloc(sizeof(struct _coev_zcsock));
+    if (!zs)
+        return NULL;
+    memset(zs, 0, sizeof(struct _coev_zcsock));
+    zs->fd = fd;
+    zs->next = ts_scheduler.zc_socks;
+    ts_scheduler.zc_socks = zs;
+    if (!ev_is_active(&ts_scheduler.zc_timer)) {
+        ts_scheduler.zc_timer.repeat = COEV_ZEROCOPY_BACKOFF;
+        ev_timer_again(ts_scheduler.loop, &ts_scheduler.zc_timer);
+    }
+    return zs;
+}
+
+/* giveup: nothing more is coming for these */
+static void
+_zc_release(struct _coev_zcsock *zs, int giveup) {
+    struct _coev_zccall **pp, *call;
+    ev_tstamp now = ev_now(ts_scheduler.loop);
+    
+    pp = &zs->calls;
+    while ((call = *pp)) {
+        if (   giveup 
+            || ((int32_t)(zs->reaped - call->upto) >= 0)
+            || (call->deadline && (now >= call->deadline))) {
+            if ((int32_t)(zs->reaped - call->upto) < 0)
+                _fm.i.c_zc_abandoned ++;
+            *pp = call->next;
+            call->done(call->arg);
+            _fm.free(call);
+        } else
+            pp = &call->next;
+    }
+}
+
+static void
+_zc_reap(struct _coev_zcsock *zs) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zs->fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                /* closed or something: nothing more is coming */
+                _zc_release(zs, 1);
+                return;
+            }
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(   ((cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR))
+                  || ((cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR))))
+                continue;
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            zs->reaped += serr->ee_data - serr->ee_info + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                _fm.i.c_zc_copied ++;
+        }
+    }
+    _zc_release(zs, 0);
+}
+
+/* frees the ones nobody needs anymore, stops the timer with the last */
+static void
+_zc_sweep(void) {
+    struct _coev_zcsock **pp, *zs;
+    
+    pp = &ts_scheduler.zc_socks;
+    while ((zs = *pp)) {
+        if (!zs->calls && !zs->senders) {
+            *pp = zs->next;
+            _fm.free(zs);
+        } else
+            pp = &zs->next;
+    }
+    if (!ts_scheduler.zc_socks)
+        ev_timer_stop(ts_scheduler.loop, &ts_scheduler.zc_timer);
+}
+
+static void
+zc_callback(struct ev_loop *loop, ev_timer *w, int revents) {
+    struct _coev_zcsock *zs;
+    
+    for (zs = ts_scheduler.zc_socks; zs; zs = zs->next)
+        _zc_reap(zs);
+    _zc_sweep();
+}
+
+/* finished sending: the buffers go to the scheduler if they have to */
+static void
+_zc_handoff(struct _coev_zcsock *zs, uint32_t upto, double timeout, 
+            coev_zcdone_fn done, void *arg) {
+    struct _coev_zccall *call = NULL;
+    
+    zs->senders --;
+    if ((int32_t)(zs->reaped - upto) < 0)
+        _zc_reap(zs);
+    if ((int32_t)(zs->reaped - upto) < 0)
+        call = _fm.malloc(sizeof(struct _coev_zccall));
+    if (call) {
+        call->upto = upto;
+        call->deadline = timeout > 0.0 ? ev_now(ts_scheduler.loop) + timeout : 0.0;
+        call->done = done;
+        call->arg = arg;
+        call->next = zs->calls;
+        zs->calls = call;
+    } else {
+        if ((int32_t)(zs->reaped - upto) < 0)
+            _fm.i.c_zc_abandoned ++;
+        done(arg);
+    }
+    _zc_sweep();
+}
+
+/* done() for all: after fork() the sockets and their error queues are 
+   shared, the parent reaps and the buffers here are copies; at thread
+   fini nobody would. */
+static void
+_zc_letgo(void) {
+    struct _coev_zcsock *zs;
+    
+    for (zs = ts_scheduler.zc_socks; zs; zs = zs->next) {
+        zs->reaped = zs->sent;
+        _zc_release(zs, 0);
+    }
+    _zc_sweep();
+}
+#endif
+
+int
+coev_sendv(int fd, struct iovec *iov, int iovcnt, ssize_t *rv, double timeout, int flags,
+           coev_zcdone_fn done, void *arg) {
+    ssize_t wrote, written = 0;
+    size_t total;
+    int n, i, sflags;
+#ifdef MSG_ZEROCOPY
+    struct _coev_zcsock *zs = NULL;
+    uint32_t upto = 0;
+    
+    if (!done)
+        flags &= ~COEV_SEND_ZEROCOPY;
+#endif
+    
+    cnrb_dprintf("coev_sendv(): fd=%d %d iovecs\n", fd, iovcnt);
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        n = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+        
+        sflags = 0;
+#ifdef MSG_ZEROCOPY
+        if (flags & COEV_SEND_ZEROCOPY) {
+            for (i = 0, total = 0; i < n; i++)
+                total += iov[i].iov_len;
+            if (total >= COEV_ZEROCOPY_MIN) {
+                if (!zs && (zs = _zc_sock(fd))) {
+                    zs->senders ++;
+                    upto = zs->reaped;
+                }
+                if (zs)
+                    sflags = MSG_ZEROCOPY;
+            }
+        }
+#endif
+        wrote = _coev_xferv(NULL, COEV_WRITE, fd, iov, n, sflags, timeout);
+        cnrb_dprintf("coev_sendv(): fd=%d wrote=%zd bytes\n", fd, wrote);
+        if (wrote == -1) {
+            if (sflags && (errno == ENOBUFS)) {
+                /* out of optmem for pinned pages: copy this time */
+                flags &= ~COEV_SEND_ZEROCOPY;
+                continue;
+            }
+            break;
+        }
+#ifdef MSG_ZEROCOPY
+        if (sflags) {
+            /* the socket's count, other coev_sendv()-s on it included */
+            upto = ++ zs->sent;
+            _fm.i.c_zc_sends ++;
+        }
+#endif
+        written += wrote;
+        
+        /* resume from where it stopped */
+        while (wrote > 0) {
+            if ((size_t) wrote >= iov->iov_len) {
+                wrote -= iov->iov_len;
+                iov->iov_len = 0;
+                iov++;
+                iovcnt--;
+            } else {
+                iov->iov_base = (char *)iov->iov_base + wrote;
+                iov->iov_len -= wrote;
+                wrote = 0;
+            }
+        }
+    }
+    *rv = written;
+    
+#ifdef MSG_ZEROCOPY
+    if (zs) {
+        int e = errno;
+        
+        _zc_handoff(zs, upto, timeout, done, arg);
+        errno = e;
+    } else 
+#endif
+    if (done)
+        done(arg);
+    return iovcnt == 0 ? 0 : -1;
+}
+
+int
+coev_sendfile(int out_fd, int in_fd, off_t offset, size_t count, ssize_t *rv, double timeout) {
+    ssize_t wrote = 0;
+    size_t written = 0;
+    int path = XFER_DIRECT;
+    
+    cnrb_dprintf("coev_sendfile(): fd=%d from fd=%d offset %jd count %zu\n", 
+        out_fd, in_fd, (intmax_t) offset, count);
+    while (written < count) {
+        wrote = sendfile(out_fd, in_fd, &offset, count - written);
+        cnrb_dprintf("coev_sendfile(): fd=%d wrote=%zd bytes\n", out_fd, wrote);
+        if (wrote > 0) {
+            written += wrote;
+            continue;
+        }
+        if (wrote == 0) 
+            break; /* file got shorter */
+        if (errno != EAGAIN)
+            break;
+        
+        coev_wait(out_fd, COEV_WRITE, timeout);
+        path = XFER_PARKED;
+        if (   (coev_current()->status == CSW_TIMEOUT)
+            || (coev_current()->status == CSW_DEADLINE)
+            || (coev_current()->status == CSW_CANCELLED)) {
+            errno = _wait_errno(coev_current());
+            break;
+        }
+        if (coev_current()->status != CSW_EVENT)
+            fm_abort("coev_sendfile(): unpossible status after wait");
+    }
+    _xfer_account(path);
+    *rv = written;
+    return ((written == count) || (wrote == 0)) ? 0 : -1;
+}
+
+int
+coev_setzerocopy(int fd) {
+#ifdef SO_ZEROCOPY
+    int one = 1;
+    
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
+
+int
+coev_trace_enable(size_t nevents) {
+    struct _coev_trace_event *ring = NULL;
+    size_t size = 1;
+    
+    if (nevents) {
+        while (size < nevents)
+            size <<= 1;
+        if (size > ((size_t) -1) / sizeof(struct _coev_trace_event)) {
+            errno = EINVAL;
+            return -1;
+        }
+        ring = _fm.malloc(size * sizeof(struct _coev_trace_event));
+        if (!ring) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    if (ts_trace.ring)
+        _fm.free(ts_trace.ring);
+    ts_trace.ring = ring;
+    ts_trace.mask = size - 1;
+    ts_trace.head = 0;
+    ts_trace.tsc0 = _ticks();
+    return 0;
+}
+
+static const char *
+str_trace_type[] = {
+    "none", "switch", "wait", "sleep", "wakeup", "timeout", 
+    "spawn", "death", "lockwait", "lockhandoff", "chanwait", "syncwait",
+    "offload", "childwait",
+};
+
+struct _trace_out {
+    int fd;
+    size_t len;
+    char buf[8192];
+};
+
+static int
+_trace_flush(struct _trace_out *o) {
+    size_t done = 0;
+    ssize_t rv;
+    
+    while (done < o->len) {
+        rv = write(o->fd, o->buf + done, o->len - done);
+        if (rv == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += rv;
+    }
+    o->len = 0;
+    return 0;
+}
+
+static int
+_trace_printf(struct _trace_out *o, const char *fmt, ...) {
+    va_list ap;
+    
+    /* no record comes anywhere near 512 bytes */
+    if ((sizeof(o->buf) - o->len < 512) && _trace_flush(o))
+        return -1;
+    va_start(ap, fmt);
+    o->len += vsnprintf(o->buf + o->len, sizeof(o->buf) - o->len, fmt, ap);
+    va_end(ap);
+    return 0;
+}
+
+/* "run" slices are built from switches: each ends the one of whoever 
+   was running and begins the target's. everything else is an instant
+   event on the coroutine's track. */
+int
+coev_trace_dump(int fd) {
+    struct _trace_out *o;
+    struct _coev_trace_event *e;
+    uint64_t i, first;
+    uint32_t running = TR_NOPEER;
+    double us_per_tick, ts = 0.0;
+    const char *reason;
+    int pid = getpid(), rv = -1;
+    
+    if (!ts_trace.ring) {
+        errno = EINVAL;
+        return -1;
+    }
+    o = _fm.malloc(sizeof(struct _trace_out));
+    if (!o) {
+        errno = ENOMEM;
+        return -1;
+    }
+    o->fd = fd;
+    o->len = 0;
+    
+    us_per_tick = _ns_per_tick() / 1e3;
+    
+    first = (ts_trace.head > ts_trace.mask) ? ts_trace.head - ts_trace.mask - 1 : 0;
+    
+    if (_trace_printf(o, "{\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"coev\"}}", 
+            pid))
+        goto out;
+    if (ts_root && _trace_printf(o, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%u,\"args\":{\"name\":\"root\"}}", pid, ts_root->id))
+        goto out;
+    if (ts_scheduler.scheduler && _trace_printf(o, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+            "\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"scheduler\"}}", 
+            pid, ts_scheduler.scheduler->id))
+        goto out;
+    
+    for (i = first; i < ts_trace.head; i++) {
+        e = &ts_trace.ring[i & ts_trace.mask];
+        ts = (double)(int64_t)(e->tsc - ts_trace.tsc0) * us_per_tick;
+        
+        switch (e->type) {
+            case TR_WAIT:
+                reason = (e->reason == COEV_READ) ? "read" 
+                       : (e->reason == COEV_WRITE) ? "write" : "readwrite";
+                break;
+            case TR_SWITCH:
+            case TR_WAKEUP:
+            case TR_TIMEOUT:
+            case TR_LOCKHANDOFF:
+                reason = (e->reason <= CSW_TARGET_BUSY) ? str_coev_status[e->reason] : "?";
+                break;
+            default:
+                reason = "";
+        }
+        
+        if (e->type == TR_SWITCH) {
+            if ((running != TR_NOPEER) && _trace_printf(o, ",\n{\"name\":\"run\",\"ph\":\"E\","
+                    "\"ts\":%.3f,\"pid\":%d,\"tid\":%u}", ts, pid, running))
+                goto out;
+            if (_trace_printf(o, ",\n{\"name\":\"run\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,"
+                    "\"tid\":%u,\"args\":{\"from\":%u,\"status\":\"%.*s\"}}", 
+                    ts, pid, e->peer, e->co, (int) strcspn(reason, " "), reason))
+                goto out;
+            running = e->peer;
+            continue;
+        }
+        if (_trace_printf(o, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%u,\"args\":{\"fd\":%d,\"reason\":\"%.*s\"",
+                e->type < TR_TYPES ? str_trace_type[e->type] : "?",
+                ts, pid, e->co, e->fd, (int) strcspn(reason, " "), reason))
+            goto out;
+        if ((e->peer != TR_NOPEER) && _trace_printf(o, ",\"peer\":%u", e->peer))
+            goto out;
+        if (_trace_printf(o, "}}"))
+            goto out;
+    }
+    if ((running != TR_NOPEER) && _trace_printf(o, ",\n{\"name\":\"run\",\"ph\":\"E\","
+            "\"ts\":%.3f,\"pid\":%d,\"tid\":%u}", ts, pid, running))
+        goto out;
+    if (_trace_printf(o, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":"
+            "{\"events\":%llu,\"dropped\":%llu}}\n", 
+            (unsigned long long) ts_trace.head, (unsigned long long) first))
+        goto out;
+    rv = _trace_flush(o);
+  out:
+    _fm.free(o);
+    return rv;
+}
+
+/* keeps buf sorted by cpu_ns, the hottest n of what was offered */
+static void
+_top_offer(coev_top_t *buf, int n, int *have, coev_t *c, uint64_t now, double ns_per_tick) {
+    uint64_t cpu = c->cpu_ticks;
+    int i;
+    
+    if (c == ts_current)
+        cpu += now - c->sw_stamp;
+    cpu *= ns_per_tick;
+    
+    if (*have < n)
+        i = (*have)++;
+    else if ((n > 0) && (cpu > buf[n - 1].cpu_ns))
+        i = n - 1;
+    else
+        return;
+    for (; (i > 0) && (buf[i - 1].cpu_ns < cpu); i--)
+        buf[i] = buf[i - 1];
+    buf[i].coev = c;
+    buf[i].id = c->id;
+    buf[i].state = c->state;
+    buf[i].cpu_ns = cpu;
+    buf[i].switches = c->sw_count;
+    buf[i].idle_ns = (now - c->sw_stamp) * ns_per_tick;
+}
+
+int
+coev_top(coev_top_t *buf, int n) {
+    double ns_per_tick = _ns_per_tick();
+    uint64_t now = _ticks();
+    int have = 0, count = 0;
+    coev_t *c;
+    
+    if (ts_root) {
+        _top_offer(buf, n, &have, ts_root, now, ns_per_tick);
+        count ++;
+    }
+    for (c = ts_coev_bunch.busy; c != NULL; c = c->cb_next) {
+        if (c->state == CSTATE_DEAD)
+            continue;
+        _top_offer(buf, n, &have, c, now, ns_per_tick);
+        count ++;
+    }
+    return count;
+}
+
 void
 coev_getstats(coev_instrumentation_t *ptr) {
     memmove(ptr, &_fm.i, sizeof(coev_instrumentation_t));
+    ptr->ns_per_tick = _ns_per_tick();
+}
+
+uint64_t
+coev_hist_lower(int bucket) {
+    int group = bucket >> COEV_HIST_SUB_BITS;
+    uint64_t sub = bucket & ((1 << COEV_HIST_SUB_BITS) - 1);
+    
+    if (group == 0)
+        return sub;
+    return ((1 << COEV_HIST_SUB_BITS) + sub) << (group - 1);
+}
+
+uint64_t
+coev_hist_quantile(const coev_hist_t *h, double q) {
+    uint64_t seen = 0, want;
+    int b;
+    
+    if (h->count == 0)
+        return 0;
+    want = q * h->count;
+    if (want >= h->count)
+        return h->max;
+    for (b = 0; b < COEV_HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > want)
+            break;
+    }
+    if (b + 1 >= COEV_HIST_BUCKETS)
+        return h->max;
+    /* top of the bucket, but never above what was seen */
+    return coev_hist_lower(b + 1) < h->max ? coev_hist_lower(b + 1) : h->max;
 }
 
 void
@@ -2040,26 +5712,76 @@ coev_setparent(coev_t *target, coev_t *newparent) {
     return 0;
 }
 
-void 
-coev_libinit(const coev_frameth_t *fm, coev_t *root) {
-    /* multiple calls will result in havoc */
-    if (ts_count != 0)
-        fm_abort("coev_libinit(): second initialization refused.");
-    
+/* everything per-thread: allocators, scheduler, CLS, the root */
+static void
+_thread_init(coev_t *root) {
     ts_count = 1;
     
-    memcpy(&_fm, (void *)fm, sizeof(coev_frameth_t));
-    memset(&_fm.i, 0, sizeof(coev_instrumentation_t));
     memset(&ts_scheduler, 0, sizeof(ts_scheduler));
-    
-    ts_cls_last_key = 1L;
+#ifdef THREADING_MADNESS
+    ts_scheduler.thread = pthread_self();
+#endif
+#ifdef COEV_URING
+    ts_scheduler.ring.fd = -1;
+#endif
+    ts_scheduler.tol_count = COEV_TIMEOUT_LISTS;
     
     ts_rootlockbunch = NULL;
     colock_bunch_init(&ts_rootlockbunch);
     
     memset(&ts_stack_bunch, 0, sizeof(struct _coev_stack_bunch));
+    ts_stack_bunch.pagesize = sysconf(_SC_PAGESIZE);
+    ts_stack_bunch.hiwat = COEV_STACK_HIWAT;
+    memset(&ts_stackprof, 0, sizeof(ts_stackprof));
     memset(&ts_coev_bunch, 0, sizeof(struct _coev_t_bunch));
     
+    coev_init_root(root);
+}
+
+static void
+_thread_fini(void) {
+    if (ts_current != ts_root)
+	fm_abort("coev_libfini() must be called only in root coro.");
+    if (ts_ev_initialized) {
+        _offload_evfini();
+#ifdef MSG_ZEROCOPY
+        _zc_letgo();
+#endif
+#ifdef COEV_URING
+        _uring_fini();
+#endif
+#ifdef THREADING_MADNESS
+        if (ts_scheduler.inbox)
+            coev_dprintf("_thread_fini(): migrated coroutines left in the inbox.\n");
+        if (ts_scheduler.own_loop)
+            ev_loop_destroy(ts_scheduler.loop);
+        else
+#endif
+        ev_default_destroy();
+        ts_ev_initialized = 0;
+    }
+    colock_bunch_fini(ts_rootlockbunch);
+    cls_fini(ts_current);
+    if (ts_root->mwpool)
+        _fm.free(ts_root->mwpool);
+    coev_trace_enable(0);
+    _free_stacks(); /* this effectively kills all coroutines, unbeknowst to them. */
+    _free_coevs(); /* yep. worse than the above. */
+    ts_current = ts_root = NULL;
+}
+
+void 
+coev_libinit(const coev_frameth_t *fm, coev_t *root) {
+    /* multiple calls will result in havoc */
+    if (dmesg != NULL)
+        fm_abort("coev_libinit(): second initialization refused.");
+    
+    memcpy(&_fm, (void *)fm, sizeof(coev_frameth_t));
+    memset(&_fm.i, 0, sizeof(coev_instrumentation_t));
+    
+    memset(cls_keygen, 0, sizeof(cls_keygen));
+    cls_last_gen = 0;
+    
     if (_fm.dm_size < 4096)
         _fm.dm_size = 4096;
     
@@ -2068,44 +5790,92 @@ coev_libinit(const coev_frameth_t *fm, coev_t *root) {
         fm_abort("coev_libinit(): dmesg allocation failed.");
     memset(dmesg, 0, _fm.dm_size);
     
-    coev_init_root(root);
+    _thread_init(root);
     gettimeofday(&started_at, NULL);
+    _ticks_init();
+}
+
+#ifdef THREADING_MADNESS
+/* gets a thread its own root, scheduler and libev loop. 
+   coev_libinit() must have been called in some other thread. */
+void
+coev_thread_init(coev_t *root) {
+    if (dmesg == NULL)
+        fm_abort("coev_thread_init(): coev_libinit() wasn't called.");
+    if (ts_current != NULL)
+        fm_abort("coev_thread_init(): second initialization refused.");
+    _thread_init(root);
+    ts_scheduler.own_loop = 1;
+    coev_evinit();
+}
+
+void
+coev_thread_fini(void) {
+    coev_dprintf("coev_thread_fini(): bye bye");
+    _thread_fini();
 }
+#endif
 
 /* libev is initialized separately and lazily.
    see comment on coev_fork_notify() */
 static void
 coev_evinit(void) {
-    if (_ev_initialized)
+    int i;
+    
+    if (ts_ev_initialized)
         return;
     
+#ifdef THREADING_MADNESS
+    if (ts_scheduler.own_loop)
+        ts_scheduler.loop = ev_loop_new(EVFLAG_AUTO);
+    else
+#endif
     ts_scheduler.loop = ev_default_loop(0);
+    if (!ts_scheduler.loop)
+        fm_abort("coev_evinit(): could not initialize libev loop.");
     
-    if (_fm.inthdlr) {
+    /* signals are delivered to the default loop only */
+    if (_fm.inthdlr && ev_is_default_loop(ts_scheduler.loop)) {
         ev_signal_init(&ts_scheduler.intsig, intsig_cb, SIGINT);
         ev_signal_start(ts_scheduler.loop, &ts_scheduler.intsig);
         ev_unref(ts_scheduler.loop);
     }
     
+#ifdef THREADING_MADNESS
+    ev_async_init(&ts_scheduler.inbox_w, inbox_cb);
+    ev_async_start(ts_scheduler.loop, &ts_scheduler.inbox_w);
+    ev_unref(ts_scheduler.loop);
+    ev_init(&ts_scheduler.steal_timer, steal_timer_cb);
+#endif
+#ifdef COEV_URING
+    _uring_init();
+#endif
+    
+    for (i = 0; i < COEV_TIMEOUT_LISTS; i++) {
+        ev_init(&ts_scheduler.tol[i].timer, tol_callback);
+        /* same as coev_t::io_timer: I/O events first */
+        ev_set_priority(&ts_scheduler.tol[i].timer, -1);
+    }
+    
+    ts_scheduler.offload_fd = -1;
+    ts_scheduler.offload_done = NULL;
+#ifdef MSG_ZEROCOPY
+    ev_init(&ts_scheduler.zc_timer, zc_callback);
+#endif
+    _child_evinit();
+    
     ev_init(&ts_root->watcher, io_callback);
     ev_timer_init(&ts_root->io_timer, iotimeout_callback, 23., 42.);
     ev_timer_init(&ts_root->sleep_timer, sleep_callback, 23., 42.);
     
-    _ev_initialized = 0x82342;
+    ts_ev_initialized = 0x82342;
 }
 
 void
 coev_libfini(void) {
     /* should do something good here. */
-    if (ts_current != ts_root)
-	fm_abort("coev_libfini() must be called only in root coro.");
     coev_dprintf("coev_libfini(): bye bye");
-    if (_ev_initialized)
-        ev_default_destroy();
-    colock_bunch_fini(ts_rootlockbunch);
-    cls_keychain_fini(ts_current->kc.next);
-    _free_stacks(); /* this effectively kills all coroutines, unbeknowst to them. */
-    _free_coevs(); /* yep. worse than the above. */
+    _thread_fini();
     _fm.dm_flush(dmesg, dm_cp - dmesg); /* dump whatever's left in the dmesg buffer */
     _fm.free(dmesg);
     dmesg = NULL;
@@ -2116,8 +5886,31 @@ coev_libfini(void) {
    will close it's fd from before fork which is now used by something else.
    it will also most probably get it back on epoll_create() which will cause
    even more confusion.
+   
+   only the calling thread survives fork(), so only its loop is of interest.
  */
 void coev_fork_notify(void) {
-    if (_ev_initialized)
-        ev_default_fork();
+    _offload_forked();
+    _child_forked();
+    if (ts_ev_initialized) {
+        /* the eventfd is shared with the parent */
+        _offload_evfini();
+        ev_loop_fork(ts_scheduler.loop);
+#ifdef MSG_ZEROCOPY
+        _zc_letgo();
+#endif
+#ifdef COEV_URING
+        /* the ring is shared with the parent, get our own */
+        _uring_forked();
+#endif
+    }
+}
+
+const char *
+coev_iobackend(void) {
+#ifdef COEV_URING
+    if (ts_scheduler.ring.fd != -1)
+        return "io_uring";
+#endif
+    return "libev";
 }
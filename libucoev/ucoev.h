@@ -18,6 +18,7 @@ extern "C" {
 #endif
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <ucontext.h>
 
 #include <ev.h>
@@ -31,6 +32,10 @@ extern "C" {
 #define CSTATE_SLEEP         5 /* sleeping */
 #define CSTATE_LOCKWAIT      6 /* waiting on a lock */
 #define CSTATE_DEAD          7 /* dead */
+#define CSTATE_CHANWAIT      8 /* waiting on a channel */
+#define CSTATE_SYNCWAIT      9 /* waiting on a semaphore, event or condition */
+#define CSTATE_OFFLOAD      10 /* waiting for coev_offload() */
+#define CSTATE_CHILDWAIT    11 /* waiting for a child process, coev_waitpid() */
 
 /* coev_t::status */
 #define CSW_NONE             0 /* there was no switch */
@@ -40,6 +45,8 @@ extern "C" {
 #define CSW_TIMEOUT          4 /* io-event timed out */
 #define CSW_YOURTURN         5 /* explicity scheduled switch */
 #define CSW_SIGCHLD          6 /* child died */
+#define CSW_DEADLINE         7 /* wait hit the innermost coev_deadline_push() */
+#define CSW_CANCELLED        8 /* wait aborted by coev_cancel() */
 
 /* below are immediate (no actual switch) error return values */
 #define CSW_LESS_THAN_AN_ERROR   9 /* used to distinguish errors, never actually returned. */
@@ -54,8 +61,18 @@ extern "C" {
 /* This is preallocated size for (T)CLS storage.
    that much pointers can be stored per coroutine
    without separate memory allocation. 
-   Takes up 512 bytes on x86, 1k on x86-64. */
-#define CLS_KEYCHAIN_SIZE 63
+   Takes up 64 bytes on x86, 128 on x86-64. */
+#define CLS_INLINE_SLOTS 8
+
+/* Default coev_offload() pool size */
+#ifndef COEV_OFFLOAD_THREADS
+#define COEV_OFFLOAD_THREADS 4
+#endif
+
+/* How deep coev_deadline_push() can nest */
+#ifndef COEV_DEADLINE_DEPTH
+#define COEV_DEADLINE_DEPTH 8
+#endif
 
 /* This is preallocated size for lock storage:
    number of locks. */
@@ -67,23 +84,25 @@ extern "C" {
 typedef struct _coev coev_t;
 typedef void (*coev_runner_t)(coev_t *);
 typedef struct _coev_lock colock_t;
+typedef struct _coev_chan coevchan_t;
+typedef struct _coev_sem cosem_t;
+typedef struct _coev_event coevent_t;
+typedef struct _coev_cond cocond_t;
 
 typedef struct _key_tuple {
     long key;
     void *value;
 } cokey_t;
 
-typedef struct _key_chain cokeychain_t;
-struct _key_chain {
-    cokeychain_t *next;   
-    cokey_t keys[CLS_KEYCHAIN_SIZE]; 
-};
 
 typedef struct _coev_stack coevst_t;
+typedef struct _coev_stackprof_slot coevsp_t;
 
 struct _coev {
     ucontext_t ctx;         /* the context */
+    void *ctx_sp;           /* saved stack pointer (COEV_FASTCTX backend only) */
     coevst_t *stack;        /* to free it fast*/
+    coevsp_t *sprof;        /* stack usage profile to report to at death, if sampled */
     unsigned int id;        /* serial, to build debug representations / show tree position */
     
     coev_t *parent;         /* report death here */
@@ -98,23 +117,49 @@ struct _coev {
     coev_runner_t run;      /* entry point into the coroutine, NULL if the coro has already started. */
     
     struct ev_io watcher;        /* IO watcher */
-    struct ev_timer io_timer;    /* IO timeout timer. */
+    struct ev_timer io_timer;    /* IO timeout timer, if not in a timeout list */
     struct ev_timer sleep_timer; /* sleep timer */
-    
-    coev_t *rq_next;        /* runqueue list pointer */
+    int io_result;               /* io_uring completion result */
+    int io_fd, io_events;        /* io_uring poll in flight, io_fd -1 for recv/send */
+    ev_tstamp io_deadline;       /* of the io_uring op in flight, absolute, 0 if none */
+    
+    coev_t *to_next;        /* timeout list pointers */
+    coev_t *to_prev;
+    ev_tstamp deadline;     /* I/O timeout, if in a timeout list */
+    int tol;                /* timeout list it's in, -1 if none */
+    
+    coev_t *rq_next;        /* runqueue list pointers */
+    coev_t *rq_prev;
+    int rq_prio;            /* runqueue this one is in, -1 if none */
+    int prio;               /* COEV_PRIO_* -- runqueue to get into when scheduled */
+    uint64_t rq_stamp;      /* when it got into the runqueue, for coev_instrumentation_t::h_runq_delay */
+    uint64_t cpu_ticks;     /* time run, as of the last switch out, see coev_top() */
+    uint64_t sw_stamp;      /* when last switched in or out */
+    uint64_t sw_count;      /* times switched into */
     coev_t *cb_next;        /* allocator internals */
     coev_t *cb_prev;        /* allocator internals */
     
     coev_t *lq_next;        /* lock waiting queue */
     coev_t *lq_prev;        /* lock waiting queue */
-    
-    cokeychain_t kc;        /* CLS keychain */
-    cokeychain_t *kc_tail;  /* CLS meta-keychain tail (if it was ever extended) */
+    colock_t *lq_lock;      /* lock waited on, if any */
+    struct _coev_waitq *cq_queue; /* channel or sync queue waited in (via lq_next/lq_prev), if any */
+    void *cq_item;          /* being handed over through a channel */
+    struct _coev_mwpool *mwpool; /* coev_wait_many() watchers, NULL until used */
+    
+    ev_tstamp dl_stack[COEV_DEADLINE_DEPTH]; /* absolute, each no later than the one below */
+    int dl_depth;
+    int dl_clamped;         /* timeout of the wait in progress is the deadline's */
+    int cancel_pending;     /* coev_cancel()-ed, the next or current wait gets CSW_CANCELLED */
+    
+    cokey_t *cls_slots;     /* CLS values, indexed by key, see cls_new() */
+    long cls_size;          /* how many slots there are */
+    cokey_t cls_inline[CLS_INLINE_SLOTS]; /* cls_slots unless grown */
        
     void *A, *X, *Y, *S;    /* user-used stuff so that they don't need to fiddle with offsetof (6502 ftw) */
     
 #ifdef THREADING_MADNESS
-    pthread_t thread;
+    pthread_t thread;       /* the one it runs on */
+    int stealable;          /* can be given away to an idle scheduler */
 #endif    
 };
 
@@ -166,13 +211,65 @@ struct _coev {
     In the absence of designated scheduler coroutine, switches are perfomed to 'root'
     coroutine (created at the time of coev_initialize())
     
+    CONTEXT SWITCH BACKENDS
+    
+    By default contexts are swapped with getcontext()/swapcontext(). These 
+    save and restore the signal mask, which costs a rt_sigprocmask syscall 
+    per switch. Building the library with -DCOEV_FASTCTX (see Makefile) 
+    replaces that with a hand-written switch that saves only callee-saved 
+    registers and the stack pointer. x86-64 and aarch64 only.
+    
+    Signal mask is thus not per-coroutine with COEV_FASTCTX. 
+    coev_t layout does not depend on the backend.
+    
+    I/O BACKENDS
+    
+    By default coev_wait() arms an ev_io watcher and an ev_timer, each 
+    change to which costs an epoll_ctl() syscall. Built with -DCOEV_URING 
+    (see Makefile; Linux 5.5+), iowaits are queued to an io_uring instead,
+    as poll-add ops with linked timeouts, and submitted in one batch per
+    coev_loop() pass. cnrbuf_read(), cnrbuf_readline() and coev_send() 
+    first try the syscall; if the socket says EAGAIN they queue the 
+    recv/send itself rather than a readiness wait plus another try. 
+    Sleeps, signals and blocking still go through libev: the ring fd is 
+    just another watcher there. If io_uring can't be set up at runtime,
+    libev is used. coev_iobackend() tells which one it is.
+    
     THREAD SAFETY
     
-    In order to be safe, do not use threads.
-    Switches are possible only in context of a single thread. 
-    Failure to observe that will be reported with crossthread_fail callback.
+    Without THREADING_MADNESS (see Makefile), do not use threads.
+    
+    With it, all state is per-thread: each thread that calls coev_libinit()
+    or coev_thread_init() has its own root, scheduler, runqueues, libev 
+    loop and stack and coev_t pools. Switches and scheduling are possible 
+    only within a single thread, crossing that aborts. Coroutines move 
+    between threads only via coev_migrate() or work stealing, see below. 
+    CLS keys are process-wide. Instrumentation counters are shared and 
+    thus approximate. colocks are thread-confined.
     
 */
+
+/* Log-linear latency histogram: values below 2^COEV_HIST_SUB_BITS get 
+   a bucket each, every power of two above that is split into 
+   2^COEV_HIST_SUB_BITS linear buckets, so a bucket is at most 12.5% wide.
+   Values are in clock ticks, multiply by coev_instrumentation_t::ns_per_tick.
+   Anything past the last bucket is counted in it. */
+#define COEV_HIST_SUB_BITS 3
+#define COEV_HIST_BUCKETS  352  /* up to 2^45 ticks, hours at GHz rates */
+
+typedef struct _coev_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[COEV_HIST_BUCKETS];
+} coev_hist_t;
+
+/* lowest value that goes into the bucket */
+uint64_t coev_hist_lower(int bucket);
+
+/* value below which q (0.0 .. 1.0) of the samples are, to bucket precision */
+uint64_t coev_hist_quantile(const coev_hist_t *h, double q);
+
 typedef struct _coev_instrumentation {
     /* counters */
     volatile uint64_t c_ctxswaps;
@@ -184,15 +281,61 @@ typedef struct _coev_instrumentation {
     
     volatile uint64_t c_runqruns;
     volatile uint64_t c_news;
+    volatile uint64_t c_parks;         /* coev_park()-s */
+    volatile uint64_t c_unparks;       /* coev_unpark()-s, spawns without coev_new() */
     
     volatile uint64_t c_lock_acquires;
     volatile uint64_t c_lock_acfails;
+    volatile uint64_t c_lock_timeouts;
     volatile uint64_t c_lock_waits;
     volatile uint64_t c_lock_releases;
     
+    volatile uint64_t c_stack_releases;  /* idle stacks madvise()d away */
+    
+    volatile uint64_t c_migrations;  /* coroutines sent to another thread */
+    volatile uint64_t c_steals;      /* of those, given away to idle schedulers */
+    
+    volatile uint64_t c_uring_enters;  /* io_uring_enter() calls */
+    volatile uint64_t c_uring_sqes;    /* SQEs queued, linked timeouts included */
+    
+    volatile uint64_t c_iotimer_ops;   /* ev_timer heap operations for I/O timeouts */
+    
+    /* how cnrbuf_read(), cnrbuf_readline(), coev_send() and such got done */
+    volatile uint64_t c_io_direct;     /* right away */
+    volatile uint64_t c_io_spun;       /* after coev_stall()-ing, see cnrbuf_setmode() */
+    volatile uint64_t c_io_parked;     /* after coev_wait() */
+    volatile uint64_t c_io_persistent; /* after a wait on a persistent watcher */
+    volatile uint64_t c_io_uring;      /* by io_uring */
+    
+    volatile uint64_t c_zc_sends;      /* MSG_ZEROCOPY sendmsg()-s */
+    volatile uint64_t c_zc_copied;     /* completions that say the kernel copied anyway */
+    volatile uint64_t c_zc_abandoned;  /* buffers let go of before completion: timeout or socket gone */
+    
+    volatile uint64_t c_chan_sends;
+    volatile uint64_t c_chan_handoffs; /* sends straight to a waiting receiver */
+    volatile uint64_t c_chan_waits;    /* senders and receivers that had to wait */
+    volatile uint64_t c_chan_timeouts;
+    
+    /* semaphores, events and conditions */
+    volatile uint64_t c_sync_waits;
+    volatile uint64_t c_sync_wakeups;  /* waiters woken by a release, set or notify */
+    volatile uint64_t c_sync_timeouts;
+    
+    volatile uint64_t c_deadlines;     /* waits ended by a deadline */
+    volatile uint64_t c_cancels;       /* waits ended by coev_cancel() */
+    
+    volatile uint64_t c_offloads;      /* jobs run by the offload pool */
+    volatile uint64_t c_offload_inline; /* coev_offload()-s run in place, no scheduler */
+    
+    volatile uint64_t c_child_waits;   /* coev_waitpid()-s that had to wait */
+    volatile uint64_t c_child_kept;    /* reaped with nobody waiting, kept for a later one */
+    volatile uint64_t c_child_dropped; /* kept ones dropped, oldest first, past 1024 kept */
+    
     /* gauges */
     volatile uint64_t stacks_allocated;
     volatile uint64_t stacks_used;
+    volatile uint64_t stack_bytes_reserved; /* mapped, including guard pages */
+    volatile uint64_t stack_bytes_resident; /* busy + idle not yet released (upper bound) */
     volatile uint64_t cnrbufs_allocated;
     volatile uint64_t cnrbufs_used;
     volatile uint64_t coevs_allocated;
@@ -204,6 +347,14 @@ typedef struct _coev_instrumentation {
     
     volatile uint64_t waiters;
     volatile uint64_t slackers;
+    
+    /* latency */
+    coev_hist_t h_runq_delay;   /* made runnable to switched into by coev_loop() */
+    coev_hist_t h_iowait;       /* parked in an I/O wait to the event firing */
+    coev_hist_t h_loop_pass;    /* coev_loop() running its runqueue, one pass */
+    coev_hist_t h_loop_block;   /* coev_loop() inside ev_loop(), one pass */
+    coev_hist_t h_offload;      /* coev_offload() submitted to its completion seen */
+    double ns_per_tick;         /* filled in by coev_getstats() */
 } coev_instrumentation_t;
 
 /* memory management + error reporting to use */
@@ -242,7 +393,94 @@ void coev_fork_notify(void);
 
 coev_t *coev_new(coev_runner_t runner, size_t stacksize);
 
+/* Idle stacks above this many bytes get their memory released 
+   back to the OS with madvise(); address space stays reserved. */
+#ifndef COEV_STACK_HIWAT
+#define COEV_STACK_HIWAT (64 * 1024 * 1024)
+#endif
+void coev_setstackhiwat(size_t bytes);
+
+/* Stack usage profiling and sizing. 
+
+   Coroutines are grouped by a key identifying the entry point: 
+   coev_new() uses the runner, coev_new_keyed() takes an explicit one 
+   (Python uses the code object of the thread function).
+
+   Sampled coroutines get a zeroed stack; at death, lowest touched 
+   address is found with mincore() and a scan of the lowest resident 
+   page. Results are collected per key into a histogram by 
+   stack size class (power of two pages).
+   
+   In COEV_STACKPROF_AUTO mode, once a key has COEV_STACKPROF_WARMUP 
+   samples, its new coroutines get twice the maximum seen usage rounded 
+   up to the size class, capped by the stacksize argument. 
+   Sampling continues, so the maximum keeps up. A coroutine that 
+   outgrows its stack hits the guard page and takes the process down, 
+   so don't use this with entry points that recurse on untrusted input.
+*/
+#define COEV_STACK_CLASSES     24
+
+#define COEV_STACKPROF_OFF     0  /* no sampling (default) */
+#define COEV_STACKPROF_SAMPLE  1  /* sample 1 in COEV_STACKPROF_EVERY coroutines per key */
+#define COEV_STACKPROF_AUTO    2  /* sample and size stacks by the results */
+
+#define COEV_STACKPROF_WARMUP  8  /* first this many are always sampled */
+#define COEV_STACKPROF_EVERY  16
+#define COEV_STACKPROF_SLOTS 256  /* keys tracked */
+
+typedef struct _coev_stackprof {
+    const void *key;
+    uint64_t spawns;        /* coroutines created */
+    uint64_t samples;       /* coroutines measured */
+    size_t max_used;        /* max bytes used seen */
+    size_t auto_size;       /* stack size for AUTO mode, 0 if not enough samples */
+    uint32_t hist[COEV_STACK_CLASSES]; /* samples by size class of bytes used */
+} coev_stackprof_t;
+
+coev_t *coev_new_keyed(coev_runner_t runner, size_t stacksize, const void *key);
+void coev_setstackprof(int mode);
+/* copies up to n profiles into buf, returns the number of keys tracked */
+int coev_getstackprof(coev_stackprof_t *buf, int n);
+
+/* Coroutine reuse.
+
+   coev_park() is the runner's alternative to returning when it wants
+   its coroutine kept for another job: to everyone else the coroutine 
+   dies, its parent gets CSW_SIGCHLD with it as the origin, A, X, Y and
+   S as left. Its coev_t and stack stay, and the call returns when the 
+   coroutine is switched into after coev_unpark(). Fails with -1 without
+   switching for the root, the scheduler and coroutines with living 
+   children.
+   
+   Keeping track of parked coroutines is up to the caller. coev_unpark()
+   makes one a runnable child of the current coroutine, with a new id, 
+   as if made by coev_new_keyed(). Fails with -1, leaving it parked, 
+   if its stack is smaller than coev_new_keyed() would have given for
+   that stacksize and key. stacksize 0 always fits. Its CLS is empty,
+   so a runner that keyed something to itself sets it again after 
+   coev_park() returns.
+   
+   Parked and unparked coroutines are not sampled by the stack profiler.
+*/
+int coev_park(void);
+int coev_unpark(coev_t *c, size_t stacksize, const void *key);
+
 coev_t *coev_current(void);
+
+/* "top": busy coroutines of this thread and its root, by time run. 
+   The scheduler's time blocked in ev_loop() is not counted. */
+typedef struct _coev_top {
+    coev_t *coev;           /* only good until the next switch */
+    unsigned int id;
+    int state;              /* CSTATE_* */
+    uint64_t cpu_ns;        /* time run, including the current stint for the current one */
+    uint64_t switches;      /* times switched into */
+    uint64_t idle_ns;       /* since last switched in or out */
+} coev_top_t;
+
+/* copies the n hottest into buf, hottest first. returns how many there are. */
+int coev_top(coev_top_t *buf, int n);
+
 /* returns 0 on success or -1 if a cycle would result */
 int coev_setparent(coev_t *target, coev_t *newparent);
 
@@ -267,14 +505,117 @@ void coev_wait(int fd, int revents, ev_tstamp timeout);
 /* wrapper around the above. */
 void coev_sleep(ev_tstamp timeout);
 
+/* coev_wait() on several fds at once, with one timeout.
+   
+   events is COEV_READ and/or COEV_WRITE. revents is filled with what 
+   fired, all of them that did by the time the coroutine is resumed.
+   Returns how many have revents set, 0 if timed out, or -1 with 
+   errno EDEADLK if there's no scheduler (see coev_t::status).
+   timeout <= 0 waits forever.
+   
+   The watchers are per coroutine, allocated on first use and 
+   kept for the next ones. */
+typedef struct _coev_pollfd {
+    int fd;
+    int events;
+    int revents;
+} coev_pollfd_t;
+
+int coev_wait_many(coev_pollfd_t *fds, int n, ev_tstamp timeout);
+
+/*  Deadlines and cancellation.
+    
+    coev_deadline_push() bounds every wait of the current coroutine 
+    until the matching coev_deadline_pop(): I/O, sleeps, channels, sync
+    objects, child processes and timed lock acquires get their timeout 
+    clamped to what's left, and if that's what runs out, the status is 
+    CSW_DEADLINE, not CSW_TIMEOUT or CSW_WAKEUP. Waits after the 
+    deadline has passed return CSW_DEADLINE right away. Nested deadlines
+    can only shorten.
+    Where a wait returns errno, it's ETIMEDOUT.
+    
+    coev_cancel() aborts the target's wait in progress with CSW_CANCELLED
+    (errno ECANCELED); if it isn't waiting, its next wait is. Untimed 
+    colock_acquire() isn't a wait in this sense: Python's GIL is one.
+    Returns 0 or CSCHED_DEADMEAT. 
+    
+    coev_deadline_push() returns -1 if nested too deep, see COEV_DEADLINE_DEPTH.
+    coev_deadline_left() is seconds left, negative if there's no deadline. */
+int coev_deadline_push(ev_tstamp timeout);
+void coev_deadline_pop(void);
+ev_tstamp coev_deadline_left(void);
+int coev_cancel(coev_t *target);
+
+/*  Offload pool.
+    
+    coev_offload() runs fn(arg) on one of a fixed set of worker pthreads 
+    and parks the calling coroutine until it's done, so that a blocking 
+    call (getaddrinfo(), a cold disk read, zlib on a big buffer) doesn't
+    stop the scheduler. Completions are signalled to each scheduler 
+    through its own eventfd. fn must not touch coev_* and whatever
+    coroutines share without locking it.
+    
+    The pool is process-wide, started on first use with 
+    COEV_OFFLOAD_THREADS threads, or what coev_setoffload() said before
+    that; threads are never stopped. Without a scheduler fn is run in 
+    place. The wait can't be cut short, as fn has arg meanwhile: 
+    deadlines don't bound it and coev_cancel() is left for the next wait.
+    Returns 0, or -1 with errno if there are no worker threads and none
+    could be started, or ECANCELED in a child after fork() if fn was 
+    queued or running when it forked: it won't finish there. At thread
+    fini jobs not started are dropped and the running ones waited for.
+    
+    coev_setoffload() returns -1 if asked for fewer threads than are 
+    running already. */
+typedef void (*coev_offload_fn)(void *arg);
+int coev_offload(coev_offload_fn fn, void *arg);
+int coev_setoffload(int nthreads);
+
+/*  Child processes.
+    
+    coev_waitpid() is waitpid(pid, status, 0) that parks the coroutine 
+    until the child exits, or for timeout seconds: 0 doesn't wait, that
+    is WNOHANG, < 0 waits forever. pid is a pid or -1 for any child.
+    On the default loop it's an ev_child watcher that wakes the waiter; 
+    other threads' schedulers poll with WNOHANG.
+    
+    The default loop reaps every child that exits, waited for or not: 
+    statuses nobody waits for are kept for the next coev_waitpid(), so 
+    that's what to call instead of waitpid() once libev is up. Up to 
+    1024 are kept, past that the oldest ones are dropped. Stopped and 
+    continued children are not reported, and what's kept has no rusage.
+    
+    Returns the pid, 0 if it timed out or still runs, or -1 with errno: 
+    ECHILD, EINVAL for process groups, ETIMEDOUT/ECANCELED on a deadline
+    or coev_cancel(), EDEADLK if there is no scheduler to wait in. A 
+    waiter always counts as a coev_loop() waiter. */
+pid_t coev_waitpid(pid_t pid, int *status, ev_tstamp timeout);
+
+/* Runqueue priorities. 
+   Each pass of coev_loop() runs coroutines that were scheduled before 
+   it began, higher priority (lower value) first. Coroutines are put 
+   into their coev_t::prio runqueue on I/O, timeout or sleep wakeup, 
+   and by coev_schedule(). New coroutines get COEV_PRIO_IO. */
+#define COEV_PRIO_ACCEPT        0  /* accept loops and such: latency-critical */
+#define COEV_PRIO_IO            1  /* regular I/O-bound coroutines */
+#define COEV_PRIO_BACKGROUND    2  /* can wait */
+#define COEV_PRIO_LEVELS        3
+
+/* sets coev_t::prio. returns -1 on invalid prio, 0 otherwise. */
+int coev_setprio(coev_t *, int prio);
+
 /* coev_schedule() return values */
 #define CSCHED_NOERROR          0  /* no error */
 #define CSCHED_DEADMEAT         1  /* attempt to schedule dead coroutine */
 #define CSCHED_ALREADY          2  /* attempt to schedule already scheduled coroutine */
 #define CSCHED_NOSCHEDULER      3  /* attempt to yield, but no scheduler to switch to (from coev_stall() only) */
+#define CSCHED_BADPRIO          4  /* priority out of range (from coev_schedule_prio() only) */
+#define CSCHED_NOTMOVABLE       5  /* busy, root, scheduler, has children or not ours (from coev_migrate() only) */
 
 /* schedule a switch to the waiter */
 int coev_schedule(coev_t *waiter);
+/* same, into the given runqueue instead of waiter's own */
+int coev_schedule_prio(coev_t *waiter, int prio);
 
 /* switch to scheduler until something happens.
    returns 0 on success, CSCHED_* on error */
@@ -298,6 +639,69 @@ coev_t *coev_loop(void);
 does not perform a switch to scheduler. */
 void coev_unloop(void);
 
+/* "libev" or "io_uring" */
+const char *coev_iobackend(void);
+
+/* I/O timeouts of coev_wait() (not sleeps) are kept in FIFO lists, one per 
+   distinct timeout value, with one ev_timer per list: that's O(1) per
+   wait instead of an ev_timer heap insert and delete. Up to this many 
+   values per thread at a time, a value's list being let go once its 
+   timer finds it empty; more, and timeouts cut short by a deadline, go
+   the ev_timer way, as do those of locks, queues and coev_wait_many(). */
+#define COEV_TIMEOUT_LISTS 8
+
+/* how many lists to use, 0 to have all I/O timeouts as ev_timer-s */
+void coev_settimeoutlists(int n);
+
+#ifdef THREADING_MADNESS
+/*  Multiple threads.
+
+    The thread that calls coev_libinit() gets libev's default loop. Other
+    threads call coev_thread_init() with their own root before using 
+    anything else, and get a loop of their own. coev_thread_fini() is 
+    their coev_libfini().
+    
+    coev_migrate() hands a RUNNABLE or SCHEDULED coroutine without children
+    over to another thread's scheduler (got with coev_thread_scheduler() 
+    in that thread). It is pushed into that scheduler's lock-free inbox 
+    and appended to its coev_t::prio runqueue at the start of the next 
+    coev_loop() pass there, with the scheduler as the new parent. 
+    
+    A migrated coroutine resumes on another thread: it must not hold 
+    colocks, be coev_join()-ed or otherwise referenced from the old 
+    thread, and must not keep pointers to thread-local data across 
+    switches. 
+    
+    coev_setworker() flags for coev_loop() of the calling thread:
+        COEV_WORKER_KEEPALIVE: do not return when out of work, wait for 
+            migrated coroutines, coev_unloop() or coev_sched_stop().
+        COEV_WORKER_STEAL: when the runqueue is empty, ask the busiest 
+            other stealing scheduler for work every COEV_STEAL_INTERVAL. 
+            It gives away up to half of its runqueue, lowest priority 
+            first, coev_setstealable() ones only.
+*/
+typedef struct _coev_scheduler_stuff coevsched_t;
+
+#define COEV_WORKER_KEEPALIVE   1
+#define COEV_WORKER_STEAL       2
+#define COEV_STEAL_INTERVAL     0.001
+
+void coev_thread_init(coev_t *root);
+void coev_thread_fini(void);
+
+/* this thread's scheduler, to be given to coev_migrate() elsewhere */
+coevsched_t *coev_thread_scheduler(void);
+
+/* returns 0 on success, CSCHED_* on error */
+int  coev_migrate(coev_t *, coevsched_t *target);
+
+/* makes target's coev_loop() return. callable from any thread. */
+void coev_sched_stop(coevsched_t *target);
+
+void coev_setworker(int flags);
+void coev_setstealable(coev_t *, int);
+#endif
+
 /*  Locking implemented only to satisfy Python's current 
     threading model. Design criticism is devnulled. 
 
@@ -315,22 +719,94 @@ void coev_unloop(void);
 colock_t *colock_allocate(void);
 void  colock_free(colock_t *p);
 int   colock_acquire(colock_t *p, int wf);
+/* 1 if acquired, 0 if not in timeout seconds. the waiter is parked in 
+   the scheduler with a timer; without a scheduler, timeout is ignored. 
+   on release, the lock is handed over to the longest waiter directly. */
+int   colock_acquire_timed(colock_t *p, double timeout);
 void  colock_release(colock_t *p); 
 int   colock_is_locked(colock_t *p);
 
+/*  Channels: FIFOs of pointers between coroutines of one thread.
+    
+    Receivers wait when it's empty, senders wait when it's full; both
+    in the order they came. An item sent to an empty channel somebody 
+    waits on goes to the first such receiver directly, and a receiver 
+    of a full one takes the first waiting sender's item into the 
+    channel, so a handoff is one runqueue insertion.
+    
+    capacity 0 is unbounded. 
+    
+    timeout < 0 waits forever, 0 doesn't wait. Waiting needs a scheduler,
+    as for coev_wait(). Timed waits count as coev_loop() waiters, the
+    rest don't, same as locks.
+    
+    Return 0, or -1 with errno: EAGAIN if it would wait and timeout is 0,
+    ETIMEDOUT, or EDEADLK if there is no scheduler to wait in. */
+coevchan_t *coev_chan_new(size_t capacity);
+/* aborts if anyone waits on it. items left are the caller's problem */
+void coev_chan_free(coevchan_t *ch);
+int coev_chan_send(coevchan_t *ch, void *item, double timeout);
+int coev_chan_recv(coevchan_t *ch, void **item, double timeout);
+size_t coev_chan_len(coevchan_t *ch);
+
+/*  Semaphores, events and condition variables. 
+    
+    Waiters are parked in the scheduler in the order they came, 
+    and woken by whatever satisfies them: no polling. Timeouts and 
+    return values are as for channels.
+    
+    cosem_release() hands units to waiters directly, so a waiter 
+    can't be overtaken by a later acquirer.
+    
+    An event stays set until coevent_clear() and wakes every waiter,
+    unless it is COEVENT_ONESHOT: then each set is taken by exactly
+    one waiter, the first one, or the next to wait if there is none.
+    
+    cocond_wait() releases the lock and parks atomically, and always 
+    reacquires the lock before returning. It's EPERM if the lock isn't
+    held by the caller. lock can be NULL if the caller takes care of 
+    its own locking and does not switch before calling.
+    cocond_notify() wakes n waiters, all if n < 0. 
+    
+    *_free() abort if anyone waits on it. */
+cosem_t *cosem_new(long value);
+void cosem_free(cosem_t *sem);
+int  cosem_acquire(cosem_t *sem, double timeout);
+void cosem_release(cosem_t *sem, long n);
+long cosem_value(cosem_t *sem);
+
+#define COEVENT_ONESHOT 1
+coevent_t *coevent_new(int flags);
+void coevent_free(coevent_t *ev);
+int  coevent_wait(coevent_t *ev, double timeout);
+void coevent_set(coevent_t *ev);
+void coevent_clear(coevent_t *ev);
+int  coevent_is_set(coevent_t *ev);
+
+cocond_t *cocond_new(void);
+void cocond_free(cocond_t *cv);
+int  cocond_wait(cocond_t *cv, colock_t *lock, double timeout);
+void cocond_notify(cocond_t *cv, long n);
+size_t cocond_waiters(cocond_t *cv);
+
 /*  Coroutine-local storage is designed to satisfy perverse semantics 
     that Python/thread.c expects. Go figure.
     
     key value of 0 means this slot is not used. 0 is never returned 
-    by cls_allocate().
+    by cls_new(). keys are small indices into a per-coroutine array, 
+    plus a generation, so that a key number reused after cls_drop_across() 
+    does not see the values set for the old one. Up to CLS_MAX_KEYS keys.
+    All of it is O(1), except cls_new() and cls_drop_others().
 */
 #define CLS_FREE_SLOT 0L
+#define CLS_INDEX_BITS 12
+#define CLS_MAX_KEYS (1 << CLS_INDEX_BITS)
 long  cls_new(void);   
 void *cls_get(long k);  /* NULL if not found in the current ctx */
-int   cls_set(long k, void *v); /* -1 if value already set. 0 otherwise */
+int   cls_set(long k, void *v); /* 0 if set or was already, v ignored then. -1 if no memory or bad key */
 void  cls_del(long k);  
-void  cls_drop_across(long k); /* drops key from all keychain */
-void  cls_drop_others(void); /* drops all keychains except current */
+void  cls_drop_across(long k); /* forgets key everywhere and frees it for reuse */
+void  cls_drop_others(void); /* drops values of all coroutines but current, in this thread */
 
 
 /* Buffered read/write on network sockets
@@ -346,6 +822,10 @@ struct _coev_nrbuf {
     double iop_timeout;
     coev_t *owner; /* if waiting on socket, who called the wait(). */
     int err_no; /* saved errno */
+    int flags;  /* CNRBUF_* */
+    int spin;   /* coev_stall()-s to try before waiting */
+    int ready;  /* persistent watcher said so since last recv() */
+    struct ev_io watcher; /* persistent watcher */
 };
 
 typedef struct _coev_nrbuf cnrbuf_t;
@@ -373,11 +853,72 @@ ssize_t cnrbuf_readline(cnrbuf_t *buf, void **p, ssize_t hint);
 /* call this to update internal pointer after you're done with data. */
 void cnrbuf_done(cnrbuf_t *buf, ssize_t eaten);
 
+/* CNRBUF_PERSISTENT: keep a watcher on the fd started between reads 
+   instead of one per wait, which saves the epoll_ctl()-s when the 
+   socket is read from over and over, as with keep-alive connections.
+   The buffer is then tied to the thread, do not coev_migrate() its 
+   reader. Not used with io_uring.
+   
+   spin: when recv() says EAGAIN, coev_stall() up to this many times,
+   looking again after each, before waiting for the socket. Helps when
+   the data is likely to be there after a coev_loop() pass, as with 
+   pipelined requests or a peer in the same process.
+   
+   Default is 0, 0. See c_io_* counters for what happens. */
+#define CNRBUF_PERSISTENT 1
+void cnrbuf_setmode(cnrbuf_t *buf, int flags, int spin);
+
 /* attempt to send given data. 
    returns 0 on success, or -1 on error, consult errno.
    bytecount of data sent is always stored in *sent. */
 int coev_send(int fd, const void *data, ssize_t dlen, ssize_t *sent, double timeout);
 
+/* same, gathering from iovcnt buffers into as few sendmsg()-s as it takes.
+   iov[] is used up: whatever was sent is zeroed or skipped over.
+   
+   COEV_SEND_ZEROCOPY: sendmsg()-s of at least COEV_ZEROCOPY_MIN bytes
+   are done with MSG_ZEROCOPY. The socket must have had SO_ZEROCOPY set,
+   see coev_setzerocopy(). Returns once it's all sent, but the kernel 
+   keeps the buffers for a round trip or so after that: done(arg) is 
+   called when it's through with them, from the scheduler, which polls
+   for that every COEV_ZEROCOPY_BACKOFF. So keep them until then, and 
+   don't switch in done(). If timeout > 0 and it's not through by then,
+   or the socket is closed, done() is called anyway; close the socket 
+   after a timeout. Without zerocopy sends done(arg) is called before 
+   this returns; without done, there are none. Worth it only for large
+   payloads, over TCP, on hardware that does scatter-gather. */
+#define COEV_SEND_ZEROCOPY 1
+#define COEV_ZEROCOPY_MIN 16384
+#define COEV_ZEROCOPY_BACKOFF 0.001
+typedef void (*coev_zcdone_fn)(void *arg);
+int coev_sendv(int fd, struct iovec *iov, int iovcnt, ssize_t *sent, double timeout, int flags,
+               coev_zcdone_fn done, void *arg);
+
+/* sets SO_ZEROCOPY on the socket. -1 and errno if it can't be had. */
+int coev_setzerocopy(int fd);
+
+/* sendfile() count bytes of in_fd starting at offset. The file offset 
+   of in_fd is not changed. Returns as coev_send() does; if the file
+   turns out shorter, that's 0 and *sent tells how much there was. */
+int coev_sendfile(int out_fd, int in_fd, off_t offset, size_t count, ssize_t *sent, double timeout);
+
+/* Event tracing.
+   
+   Switches, waits, wakeups, timeouts, spawns, deaths and lock waits and 
+   handoffs are recorded as binary events (a cycle counter timestamp, 
+   coroutine ids, fd and reason) into a per-thread ring of the last 
+   nevents (rounded up to a power of two). Costs a few ns per event.
+   
+   coev_trace_enable(0) turns it off and frees the ring; a new enable 
+   discards what was recorded. Returns -1 and errno on failure. */
+int coev_trace_enable(size_t nevents);
+
+/* writes what the calling thread's ring has as Chrome trace JSON 
+   (chrome://tracing, ui.perfetto.dev): a track per coroutine id, "run" 
+   slices between switches, instants for the rest. fd must be blocking.
+   0 on success, -1 and errno on failure or if tracing is off. */
+int coev_trace_dump(int fd);
+
 /* libwide stuff */
 void coev_getstats(coev_instrumentation_t *i);
 
@@ -23,6 +23,20 @@ addresses are supplied as:
 
 """
 
+class deadline(object):
+    """ with coev.deadline(seconds): bounds every wait inside,
+    see deadline_push(). Raises coev.Deadline where it passes. """
+    def __init__(self, seconds):
+        self.seconds = seconds
+        
+    def __enter__(self):
+        deadline_push(self.seconds)
+        return self
+        
+    def __exit__(self, typ, val, tb):
+        deadline_pop()
+        return False
+
 class TooManyConnections(Exception):
     pass
     
@@ -1,6 +1,7 @@
 #define PY_SSIZE_T_CLEAN
 #include "Python.h"
 #include "pythread.h"
+#include "structmember.h"
 
 #include <sys/types.h>
 #include <time.h>
@@ -56,6 +57,12 @@ static struct _const_def {
     { "CDF_STACK", CDF_STACK},
     { "CDF_STACK_DUMP", CDF_STACK_DUMP },
     { "CDF_CB_ON_NEW_DUMP", CDF_CB_ON_NEW_DUMP },
+    { "PRIO_ACCEPT", COEV_PRIO_ACCEPT },
+    { "PRIO_IO", COEV_PRIO_IO },
+    { "PRIO_BACKGROUND", COEV_PRIO_BACKGROUND },
+    { "STACKPROF_OFF", COEV_STACKPROF_OFF },
+    { "STACKPROF_SAMPLE", COEV_STACKPROF_SAMPLE },
+    { "STACKPROF_AUTO", COEV_STACKPROF_AUTO },
     { 0 }
 };
 
@@ -63,6 +70,8 @@ static struct _const_def {
 static PyObject* PyExc_CoroError;
 static PyObject* PyExc_CoroExit;
 static PyObject* PyExc_CoroTimeout;
+static PyObject* PyExc_CoroDeadline;
+static PyObject* PyExc_CoroCancelled;
 
 static PyObject* PyExc_CoroWaitAbort;
 
@@ -100,6 +109,16 @@ static struct _exc_def {
         "coev.Timeout", "Timeout",
         "timeout on wait"
     },
+    {
+        &PyExc_CoroDeadline, &PyExc_CoroError,
+        "coev.Deadline", "Deadline",
+        "deadline set with deadline_push() passed"
+    },
+    {
+        &PyExc_CoroCancelled, &PyExc_CoroError,
+        "coev.Cancelled", "Cancelled",
+        "wait aborted by cancel()"
+    },
     {
         &PyExc_CoroNoScheduler, &PyExc_CoroError,
         "coev.NoScheduler", "NoScheduler",
@@ -261,7 +280,13 @@ mod_switch_bottom_half(void) {
             PyErr_SetString(PyExc_CoroError,
 		    "switch(): attempt to switch to self");
             return NULL;
-        
+
+        case CSW_TARGET_DEAD:
+            /* finished, possibly parked for reuse */
+            Py_CLEAR(self->A);
+            PyErr_SetNone(PyExc_CoroTargetDead);
+            return NULL;
+
         case CSW_NONE:      /* should be unpossible */
         case CSW_EVENT:     /* should only be seen in coev_scheduled_switch(), not here. */
         case CSW_WAKEUP:    /* same. */
@@ -411,10 +436,11 @@ typedef struct {
     int busy;
     coev_t *owner;
     int eof;
+    int zerocopy;
 } CoroSocketFile;
 
 PyDoc_STRVAR(socketfile_doc,
-"socketfile(fd, timeout, rlim) -> socketfile object\n\n\
+"socketfile(fd, timeout, rlim[, persistent[, spin[, zerocopy]]]) -> socketfile object\n\n\
 Coroutine-aware file-like interface to network sockets.\n\n\
 fd -- integer fd to wrap around.\n\
 timeout -- float timeout per IO operation.\n\
@@ -422,13 +448,16 @@ rlim -- read buffer size soft limit. also limits readline.\n\
         is reset if read or readline explicitly request more space.\n\
         is here to prevent runaway buffer growth due to unfortunate\n\
         readline call without size hint (exception is raised in this case).\n\
+persistent -- keep the fd watched between reads (saves syscalls on keep-alive).\n\
+spin -- how many times to yield to the scheduler before waiting on read.\n\
+zerocopy -- send large writes with MSG_ZEROCOPY if the socket can do it.\n\
 ");
 
 static PyObject *
 socketfile_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
     CoroSocketFile *self;
-    static char *kwds[] = {  "fd", "timeout", "rlim", NULL };
-    int fd;
+    static char *kwds[] = {  "fd", "timeout", "rlim", "persistent", "spin", "zerocopy", NULL };
+    int fd, persistent = 0, spin = 0, zerocopy = 0;
     Py_ssize_t rlim;
     double iop_timeout;
 
@@ -436,8 +465,8 @@ socketfile_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
     if (self == NULL)
         return NULL;
     
-    if (!PyArg_ParseTupleAndKeywords(args, kw, "idn", kwds,
-	    &fd, &iop_timeout, &rlim)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "idn|iii", kwds,
+	    &fd, &iop_timeout, &rlim, &persistent, &spin, &zerocopy)) {
 	Py_DECREF(self);
 	return NULL;
     }
@@ -448,19 +477,68 @@ socketfile_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
     }
     
     cnrbuf_init(&self->dabuf, fd, iop_timeout, 4096, rlim);
+    cnrbuf_setmode(&self->dabuf, persistent ? CNRBUF_PERSISTENT : 0, spin);
     self->busy = 0;
+    self->zerocopy = zerocopy && (coev_setzerocopy(fd) == 0);
     return (PyObject *)self;
 }
 
+/* zerocopy writes: the kernel keeps the strings after coev_sendv() 
+   returns, until the scheduler says it's done with them, which it does
+   without the GIL. so they're put here and let go of by whoever gets
+   to hold it next. */
+typedef struct _sf_pin {
+    PyObject *obj;
+    struct _sf_pin *next;
+} sf_pin_t;
+
+static sf_pin_t * volatile sf_released = NULL;
+
+static void
+_sf_zcdone(void *arg) {
+    sf_pin_t *pin = (sf_pin_t *) arg;
+    
+    do
+        pin->next = sf_released;
+    while (!__sync_bool_compare_and_swap(&sf_released, pin->next, pin));
+}
+
+static void
+_sf_unpin(void) {
+    sf_pin_t *pin, *next;
+    
+    pin = __sync_lock_test_and_set(&sf_released, NULL);
+    for (; pin; pin = next) {
+        next = pin->next;
+        Py_DECREF(pin->obj);
+        PyMem_Del(pin);
+    }
+}
+
 static void
 socketfile_dealloc(CoroSocketFile *self) {
     cnrbuf_fini(&self->dabuf);
     Py_TYPE(self)->tp_free((PyObject*)self);
+    _sf_unpin();
 }
 
 static PyObject *mod_wait_bottom_half(void);
 static PyObject *sf_empty_string = NULL;
 
+/* errno from a wait: a deadline or a cancel is not an I/O error */
+static PyObject *
+_wait_error(PyObject *exc) {
+    if ((errno == ECANCELED) && (coev_current()->status == CSW_CANCELLED)) {
+        PyErr_SetNone(PyExc_CoroCancelled);
+        return NULL;
+    }
+    if ((errno == ETIMEDOUT) && (coev_current()->status == CSW_DEADLINE)) {
+        PyErr_SetNone(PyExc_CoroDeadline);
+        return NULL;
+    }
+    return PyErr_SetFromErrno(exc);
+}
+
 #define RETURN_EMPTYSTRING_IF(cond) do { if((cond)) { Py_INCREF(sf_empty_string); return sf_empty_string; } } while (0)
 
 PyDoc_STRVAR(socketfile_read_doc,
@@ -492,7 +570,7 @@ socketfile_read(CoroSocketFile *self, PyObject* args) {
     self->busy = 0;
     
     if (rv == -1)
-        return PyErr_SetFromErrno(PyExc_CoroSocketError);
+        return _wait_error(PyExc_CoroSocketError);
     
     if (rv == 0)
         RETURN_EMPTYSTRING_IF((self->eof = 1));
@@ -530,7 +608,7 @@ socketfile_readline(CoroSocketFile *self, PyObject* args) {
     
     if (rv == -1) {
         coro_dprintf("socketfile_readline(): setting exception errno=%s\n", strerror(errno));
-        return PyErr_SetFromErrno(PyExc_CoroSocketError);
+        return _wait_error(PyExc_CoroSocketError);
     }
     
     if (rv == 0) {
@@ -550,6 +628,7 @@ static PyObject *
 socketfile_write(CoroSocketFile *self, PyObject* args) {
     const char *str;
     Py_ssize_t rv, len, written;
+    sf_pin_t *pin = NULL;
 
     if (self->busy)
         return PyErr_Format(PyExc_CoroError, "socketfile is busy; owner=[%s] accessor=[%s]",
@@ -559,19 +638,148 @@ socketfile_write(CoroSocketFile *self, PyObject* args) {
     if (!PyArg_ParseTuple(args, "s#", &str, &len))
 	return NULL;
 
+    if (self->zerocopy) {
+        /* args has str */
+        pin = PyMem_New(sf_pin_t, 1);
+        if (pin == NULL)
+            return PyErr_NoMemory();
+        Py_INCREF(args);
+        pin->obj = args;
+    }
+    
     self->busy = 1;
     self->owner = coev_current();
     Py_BEGIN_ALLOW_THREADS
-    rv = coev_send(self->dabuf.fd, str, len, &written, self->dabuf.iop_timeout);
+    if (pin) {
+        struct iovec iov;
+        
+        iov.iov_base = (void *) str;
+        iov.iov_len = len;
+        rv = coev_sendv(self->dabuf.fd, &iov, 1, &written, self->dabuf.iop_timeout, 
+                COEV_SEND_ZEROCOPY, _sf_zcdone, pin);
+    } else
+        rv = coev_send(self->dabuf.fd, str, len, &written, self->dabuf.iop_timeout);
     Py_END_ALLOW_THREADS
     self->busy = 0;
+    _sf_unpin();
     
     if (rv == -1)
-        return PyErr_SetFromErrno(PyExc_CoroSocketError);
+        return _wait_error(PyExc_CoroSocketError);
     
     return PyInt_FromSsize_t(rv);
 }
 
+PyDoc_STRVAR(socketfile_writev_doc,
+"writev(strings) -> None\n\n\
+Write all the strings in the sequence to the fd, in as few syscalls as it takes.\n\
+EPIPE results in an exception.\n\
+");
+static PyObject * 
+socketfile_writev(CoroSocketFile *self, PyObject* args) {
+    PyObject *seq, *strings;
+    struct iovec *iov;
+    Py_ssize_t i, n, written;
+    sf_pin_t *pin;
+    int rv;
+
+    if (self->busy)
+        return PyErr_Format(PyExc_CoroError, "socketfile is busy; owner=[%s] accessor=[%s]",
+            self->owner ? self->owner->treepos : "(nil?)",
+            coev_current()->treepos), NULL;
+    
+    if (!PyArg_ParseTuple(args, "O", &seq))
+	return NULL;
+    
+    /* a copy: the list can change while we wait */
+    strings = PySequence_Tuple(seq);
+    if (strings == NULL)
+        return NULL;
+    n = PyTuple_GET_SIZE(strings);
+    iov = PyMem_New(struct iovec, n ? n : 1);
+    if (iov == NULL) {
+        Py_DECREF(strings);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < n; i++) {
+        PyObject *str = PyTuple_GET_ITEM(strings, i);
+        
+        if (!PyString_Check(str)) {
+            PyErr_Format(PyExc_TypeError, "writev() takes strings, item %zd is %.200s",
+                i, Py_TYPE(str)->tp_name);
+            PyMem_Del(iov);
+            Py_DECREF(strings);
+            return NULL;
+        }
+        iov[i].iov_base = PyString_AS_STRING(str);
+        iov[i].iov_len = PyString_GET_SIZE(str);
+    }
+    
+    /* done with strings when the kernel is */
+    pin = PyMem_New(sf_pin_t, 1);
+    if (pin == NULL) {
+        PyMem_Del(iov);
+        Py_DECREF(strings);
+        return PyErr_NoMemory();
+    }
+    pin->obj = strings;
+    
+    self->busy = 1;
+    self->owner = coev_current();
+    Py_BEGIN_ALLOW_THREADS
+    rv = coev_sendv(self->dabuf.fd, iov, n, &written, self->dabuf.iop_timeout,
+            self->zerocopy ? COEV_SEND_ZEROCOPY : 0, _sf_zcdone, pin);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+    PyMem_Del(iov);
+    _sf_unpin();
+    
+    if (rv == -1)
+        return _wait_error(PyExc_CoroSocketError);
+    
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(socketfile_sendfile_doc,
+"sendfile(file, offset, count) -> int\n\n\
+Send count bytes of the file starting at offset, straight from the page cache.\n\
+file -- file object or integer fd. Its position is not changed.\n\
+Returns how much was sent, which is less than count if the file is shorter.\n\
+");
+static PyObject * 
+socketfile_sendfile(CoroSocketFile *self, PyObject* args) {
+    PyObject *file;
+    PY_LONG_LONG offset;
+    Py_ssize_t count, sent;
+    int in_fd, rv;
+
+    if (self->busy)
+        return PyErr_Format(PyExc_CoroError, "socketfile is busy; owner=[%s] accessor=[%s]",
+            self->owner ? self->owner->treepos : "(nil?)",
+            coev_current()->treepos), NULL;
+    
+    if (!PyArg_ParseTuple(args, "OLn", &file, &offset, &count))
+	return NULL;
+    if ((in_fd = PyObject_AsFileDescriptor(file)) == -1)
+        return NULL;
+    if ((offset < 0) || (count < 0)) {
+	PyErr_SetString(PyExc_ValueError, "offset and count must not be negative");
+	return NULL;
+    }
+    
+    self->busy = 1;
+    self->owner = coev_current();
+    Py_BEGIN_ALLOW_THREADS
+    rv = coev_sendfile(self->dabuf.fd, in_fd, (off_t) offset, count, &sent, 
+            self->dabuf.iop_timeout);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+    
+    if (rv == -1)
+        return _wait_error(PyExc_CoroSocketError);
+    
+    return PyInt_FromSsize_t(sent);
+}
+
 PyDoc_STRVAR(socketfile_flush_doc,
 "flush() -> None\n\n\
 Noop.\n\
@@ -591,6 +799,8 @@ static PyMethodDef socketfile_methods[] = {
     {"read",  (PyCFunction) socketfile_read,  METH_VARARGS, socketfile_read_doc},
     {"readline", (PyCFunction) socketfile_readline, METH_VARARGS, socketfile_readline_doc},
     {"write", (PyCFunction) socketfile_write, METH_VARARGS, socketfile_write_doc},
+    {"writev", (PyCFunction) socketfile_writev, METH_VARARGS, socketfile_writev_doc},
+    {"sendfile", (PyCFunction) socketfile_sendfile, METH_VARARGS, socketfile_sendfile_doc},
     {"flush", (PyCFunction) socketfile_noop, METH_NOARGS, socketfile_flush_doc},
     {"close", (PyCFunction) socketfile_noop, METH_NOARGS, socketfile_close_doc},
     { 0 }
@@ -638,6 +848,329 @@ static PyTypeObject CoroSocketFile_Type = {
     /* tp_new            */ socketfile_new
 };
 
+/** coev.Queue - Queue.Queue on a coevchan_t */
+
+typedef struct {
+    PyObject_HEAD
+    coevchan_t *chan;
+    Py_ssize_t maxsize;
+    Py_ssize_t unfinished;  /* put()-s not yet task_done()-d */
+    coevchan_t *joiners;    /* join()-ers wait for a token here */
+    Py_ssize_t njoiners;
+} CoroQueue;
+
+PyDoc_STRVAR(queue_doc,
+"Queue(maxsize=0)\n\n\
+Queue.Queue for coroutines of a thread. Waiting getters and putters are\n\
+parked in a channel and woken by the put or get that satisfies them,\n\
+no locks involved. maxsize <= 0 is unbounded.\n\
+");
+
+static PyObject *
+queue_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
+    CoroQueue *self;
+    static char *kwds[] = { "maxsize", NULL };
+    Py_ssize_t maxsize = 0;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "|n:Queue", kwds, &maxsize))
+	return NULL;
+    self = (CoroQueue *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    if (maxsize < 0)
+        maxsize = 0;
+    self->maxsize = maxsize;
+    self->chan = coev_chan_new(maxsize);
+    self->joiners = coev_chan_new(0);
+    return (PyObject *)self;
+}
+
+static void
+queue_dealloc(CoroQueue *self) {
+    void *item;
+    
+    if (self->chan) {
+        while (coev_chan_recv(self->chan, &item, 0.0) == 0)
+            Py_DECREF((PyObject *) item);
+        coev_chan_free(self->chan);
+    }
+    if (self->joiners)
+        coev_chan_free(self->joiners);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* block and timeout as Queue.Queue takes them, to a coev_chan_*() timeout */
+static int
+_queue_timeout(PyObject *block, PyObject *timeout, double *rv) {
+    if (block && !PyObject_IsTrue(block)) {
+        *rv = 0.0;
+        return 0;
+    }
+    if (!timeout || (timeout == Py_None)) {
+        *rv = -1.0;
+        return 0;
+    }
+    *rv = PyFloat_AsDouble(timeout);
+    if ((*rv == -1.0) && PyErr_Occurred())
+        return -1;
+    if (*rv < 0.0) {
+        PyErr_SetString(PyExc_ValueError, "'timeout' must be a positive number");
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue.Full or Queue.Empty, or what errno says */
+static PyObject *
+_queue_error(const char *name) {
+    PyObject *mod, *exc;
+    
+    if (errno == EDEADLK) {
+        PyErr_SetNone(PyExc_CoroNoScheduler);
+        return NULL;
+    }
+    if ((errno == ECANCELED) || (coev_current()->status == CSW_DEADLINE))
+        return _wait_error(PyExc_CoroError);
+    mod = PyImport_ImportModule("Queue");
+    if (!mod)
+        return NULL;
+    exc = PyObject_GetAttrString(mod, name);
+    Py_DECREF(mod);
+    if (!exc)
+        return NULL;
+    PyErr_SetNone(exc);
+    Py_DECREF(exc);
+    return NULL;
+}
+
+/* tries without letting go of the GIL first: it's only needed to wait */
+static int
+_queue_send(coevchan_t *ch, void *item, double timeout) {
+    int rv;
+    
+    rv = coev_chan_send(ch, item, 0.0);
+    if ((rv == 0) || (timeout == 0.0))
+        return rv;
+    Py_BEGIN_ALLOW_THREADS
+    rv = coev_chan_send(ch, item, timeout);
+    Py_END_ALLOW_THREADS
+    return rv;
+}
+
+static int
+_queue_recv(coevchan_t *ch, void **item, double timeout) {
+    int rv;
+    
+    rv = coev_chan_recv(ch, item, 0.0);
+    if ((rv == 0) || (timeout == 0.0))
+        return rv;
+    Py_BEGIN_ALLOW_THREADS
+    rv = coev_chan_recv(ch, item, timeout);
+    Py_END_ALLOW_THREADS
+    return rv;
+}
+
+static PyObject *
+_queue_put(CoroQueue *self, PyObject *item, double timeout) {
+    Py_INCREF(item);
+    if (_queue_send(self->chan, item, timeout)) {
+        Py_DECREF(item);
+        return _queue_error("Full");
+    }
+    self->unfinished ++;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+_queue_get(CoroQueue *self, double timeout) {
+    void *item;
+    
+    if (_queue_recv(self->chan, &item, timeout))
+        return _queue_error("Empty");
+    return (PyObject *) item;
+}
+
+PyDoc_STRVAR(queue_put_doc,
+"put(item, block=True, timeout=None) -> None\n\n\
+Put an item into the queue, waiting for a free slot as Queue.Queue does.\n\
+Raises Queue.Full if there is none.\n\
+");
+
+static PyObject *
+queue_put(CoroQueue *self, PyObject *args, PyObject *kw) {
+    static char *kwds[] = { "item", "block", "timeout", NULL };
+    PyObject *item, *block = NULL, *timeout = NULL;
+    double t;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "O|OO:put", kwds, &item, &block, &timeout))
+	return NULL;
+    if (_queue_timeout(block, timeout, &t))
+        return NULL;
+    return _queue_put(self, item, t);
+}
+
+PyDoc_STRVAR(queue_put_nowait_doc,
+"put_nowait(item) -> None\n\n\
+Same as put(item, False).\n\
+");
+
+static PyObject *
+queue_put_nowait(CoroQueue *self, PyObject *item) {
+    return _queue_put(self, item, 0.0);
+}
+
+PyDoc_STRVAR(queue_get_doc,
+"get(block=True, timeout=None) -> item\n\n\
+Remove and return an item from the queue, waiting for one as\n\
+Queue.Queue does. Raises Queue.Empty if there is none.\n\
+");
+
+static PyObject *
+queue_get(CoroQueue *self, PyObject *args, PyObject *kw) {
+    static char *kwds[] = { "block", "timeout", NULL };
+    PyObject *block = NULL, *timeout = NULL;
+    double t;
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "|OO:get", kwds, &block, &timeout))
+	return NULL;
+    if (_queue_timeout(block, timeout, &t))
+        return NULL;
+    return _queue_get(self, t);
+}
+
+PyDoc_STRVAR(queue_get_nowait_doc,
+"get_nowait() -> item\n\n\
+Same as get(False).\n\
+");
+
+static PyObject *
+queue_get_nowait(CoroQueue *self) {
+    return _queue_get(self, 0.0);
+}
+
+PyDoc_STRVAR(queue_qsize_doc,
+"qsize() -> int\n\n\
+Number of items in the queue.\n\
+");
+
+static PyObject *
+queue_qsize(CoroQueue *self) {
+    return PyInt_FromSsize_t(coev_chan_len(self->chan));
+}
+
+PyDoc_STRVAR(queue_empty_doc,
+"empty() -> bool\n");
+
+static PyObject *
+queue_empty(CoroQueue *self) {
+    return PyBool_FromLong(coev_chan_len(self->chan) == 0);
+}
+
+PyDoc_STRVAR(queue_full_doc,
+"full() -> bool\n");
+
+static PyObject *
+queue_full(CoroQueue *self) {
+    return PyBool_FromLong(self->maxsize && (coev_chan_len(self->chan) >= self->maxsize));
+}
+
+PyDoc_STRVAR(queue_task_done_doc,
+"task_done() -> None\n\n\
+Tell that an item got from the queue has been dealt with.\n\
+When all have been, join()-ers resume.\n\
+");
+
+static PyObject *
+queue_task_done(CoroQueue *self) {
+    if (self->unfinished <= 0) {
+	PyErr_SetString(PyExc_ValueError, "task_done() called too many times");
+	return NULL;
+    }
+    if (--self->unfinished == 0)
+        for (; self->njoiners > 0; self->njoiners--)
+            coev_chan_send(self->joiners, NULL, 0.0);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(queue_join_doc,
+"join() -> None\n\n\
+Wait until every item put has been got and task_done() for.\n\
+");
+
+static PyObject *
+queue_join(CoroQueue *self) {
+    void *token;
+    
+    while (self->unfinished) {
+        self->njoiners ++;
+        if (_queue_recv(self->joiners, &token, -1.0)) {
+            self->njoiners --;
+            return _queue_error("Empty");
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef queue_methods[] = {
+    {"put", (PyCFunction) queue_put, METH_VARARGS | METH_KEYWORDS, queue_put_doc},
+    {"put_nowait", (PyCFunction) queue_put_nowait, METH_O, queue_put_nowait_doc},
+    {"get", (PyCFunction) queue_get, METH_VARARGS | METH_KEYWORDS, queue_get_doc},
+    {"get_nowait", (PyCFunction) queue_get_nowait, METH_NOARGS, queue_get_nowait_doc},
+    {"qsize", (PyCFunction) queue_qsize, METH_NOARGS, queue_qsize_doc},
+    {"empty", (PyCFunction) queue_empty, METH_NOARGS, queue_empty_doc},
+    {"full", (PyCFunction) queue_full, METH_NOARGS, queue_full_doc},
+    {"task_done", (PyCFunction) queue_task_done, METH_NOARGS, queue_task_done_doc},
+    {"join", (PyCFunction) queue_join, METH_NOARGS, queue_join_doc},
+    { 0 }
+};
+
+static PyMemberDef queue_members[] = {
+    {"maxsize", T_PYSSIZET, offsetof(CoroQueue, maxsize), READONLY, "as given, 0 if unbounded"},
+    { 0 }
+};
+
+static PyTypeObject CoroQueue_Type = {
+    PyObject_HEAD_INIT(NULL)
+    /* ob_size           */ 0,
+    /* tp_name           */ "coev.Queue",
+    /* tp_basicsize      */ sizeof(CoroQueue),
+    /* tp_itemsize       */ 0,
+    /* tp_dealloc        */ (destructor)queue_dealloc,
+    /* tp_print          */ 0,
+    /* tp_getattr        */ 0,
+    /* tp_setattr        */ 0,
+    /* tp_compare        */ 0,
+    /* tp_repr           */ 0,
+    /* tp_as_number      */ 0,
+    /* tp_as_sequence    */ 0,
+    /* tp_as_mapping     */ 0,
+    /* tp_hash           */ 0,
+    /* tp_call           */ 0,
+    /* tp_str            */ 0,
+    /* tp_getattro       */ 0,
+    /* tp_setattro       */ 0,
+    /* tp_as_buffer      */ 0,
+    /* tp_flags          */ Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    /* tp_doc            */ queue_doc,
+    /* tp_traverse       */ 0,
+    /* tp_clear          */ 0,
+    /* tp_richcompare    */ 0,
+    /* tp_weaklistoffset */ 0,
+    /* tp_iter           */ 0,
+    /* tp_iternext       */ 0,
+    /* tp_methods        */ queue_methods,
+    /* tp_members        */ queue_members,
+    /* tp_getset         */ 0,
+    /* tp_base           */ 0,
+    /* tp_dict           */ 0,
+    /* tp_descr_get      */ 0,
+    /* tp_descr_set      */ 0,
+    /* tp_dictoffset     */ 0,
+    /* tp_init           */ 0,
+    /* tp_alloc          */ 0,
+    /* tp_new            */ queue_new
+};
+
 /** Module definition */
 /* FIXME: wait/sleep can possibly leak reference to passed-in value */
 /* FIXME: remember WTH I was thinking when I wrote the above */
@@ -664,6 +1197,73 @@ mod_wait(PyObject *a, PyObject* args) {
     return mod_wait_bottom_half();
 }
 
+PyDoc_STRVAR(mod_wait_many_doc,
+"wait_many(fds, timeout) -> [ (fd, revents), ... ]\n\n\
+Switch to scheduler until IO events happen on any of fds or timeout.\n\
+fds -- sequence of (fd, events) pairs; fd is an integer or has fileno().\n\
+timeout -- in seconds, 0 or negative to wait forever.\n\
+Returns the pairs that fired with what did, fd as given; empty list if\n\
+timed out.");
+
+#define WAIT_MANY_ONSTACK 8
+
+static PyObject *
+mod_wait_many(PyObject *a, PyObject* args) {
+    coev_pollfd_t onstack[WAIT_MANY_ONSTACK], *pfds = onstack;
+    PyObject *seq, *fds, *rv = NULL;
+    Py_ssize_t n, i;
+    double timeout;
+    int fired;
+    
+    if (!PyArg_ParseTuple(args, "Od", &seq, &timeout))
+	return NULL;
+    fds = PySequence_Fast(seq, "fds must be a sequence");
+    if (!fds)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(fds);
+    if (n > WAIT_MANY_ONSTACK) {
+        pfds = PyMem_New(coev_pollfd_t, n);
+        if (!pfds) {
+            PyErr_NoMemory();
+            goto out;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        PyObject *fdobj;
+        
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(fds, i), "Oi;fds must be (fd, events) pairs",
+                &fdobj, &pfds[i].events))
+            goto out;
+        if ((pfds[i].fd = PyObject_AsFileDescriptor(fdobj)) == -1)
+            goto out;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    fired = coev_wait_many(pfds, (int) n, timeout);
+    Py_END_ALLOW_THREADS
+    
+    if (fired == -1 || (coev_current()->status != CSW_EVENT && coev_current()->status != CSW_TIMEOUT)) {
+        rv = mod_wait_bottom_half();
+        goto out;
+    }
+    rv = PyList_New(0);
+    for (i = 0; rv && (i < n); i++) {
+        PyObject *pair;
+        
+        if (!pfds[i].revents)
+            continue;
+        pair = Py_BuildValue("(Oi)", PyTuple_GET_ITEM(PySequence_Fast_GET_ITEM(fds, i), 0), pfds[i].revents);
+        if (!pair || PyList_Append(rv, pair))
+            Py_CLEAR(rv);
+        Py_XDECREF(pair);
+    }
+  out:
+    if (pfds != onstack)
+        PyMem_Free(pfds);
+    Py_DECREF(fds);
+    return rv;
+}
+
 static PyObject *
 mod_wait_bottom_half(void) {
     coev_t *cur;
@@ -700,6 +1300,12 @@ mod_wait_bottom_half(void) {
             PyErr_SetString(PyExc_CoroTimeout,
 		    "IO timeout");        
             return NULL;
+        case CSW_DEADLINE:
+            PyErr_SetNone(PyExc_CoroDeadline);
+            return NULL;
+        case CSW_CANCELLED:
+            PyErr_SetNone(PyExc_CoroCancelled);
+            return NULL;
      
         case CSW_TARGET_DEAD:
             PyErr_SetNone(PyExc_CoroTargetDead);
@@ -743,13 +1349,14 @@ mod_sleep(PyObject *a, PyObject *args) {
 }
 
 PyDoc_STRVAR(mod_schedule_doc,
-"schedule([coroutine], [args]) -> switch rv\n\n\
+"schedule([coroutine], [args], [prio]) -> switch rv\n\n\
 Schedule given coroutine (or self) for execution on \n\
 next runqueue pass.\n\
 If current coroutine, no argument, or None is given, then \n\
 switch to scheduler after adding itself to the runqueue.\n\n\
 coroutine -- a non-dead coroutine\n\
 args -- a tuple to pass to it \n\
+prio -- PRIO_* runqueue to use instead of coroutine's own\n\
 ");
 
 static PyObject *
@@ -758,15 +1365,18 @@ mod_schedule(PyObject *a, PyObject *args) {
     PyObject *argstuple;
     int rv;
     long target_id = 0;
+    int prio = -1;
 
     current = target = coev_current();
     argstuple = PyTuple_Pack(1, Py_None);
 
-    if (!PyArg_ParseTuple(args, "|lO!", &target_id, &PyTuple_Type, &argstuple))
+    if (!PyArg_ParseTuple(args, "|lO!i", &target_id, &PyTuple_Type, &argstuple, &prio))
 	return NULL;
     
-    target = (coev_t *)target_id;
-    current = coev_current();
+    if (target_id)
+        target = (coev_t *)target_id;
+    if (prio == -1)
+        prio = target->prio;
     
     Py_INCREF(argstuple);
     Py_CLEAR(target->A);
@@ -774,12 +1384,12 @@ mod_schedule(PyObject *a, PyObject *args) {
     
     if (target == current) {
         Py_BEGIN_ALLOW_THREADS
-        rv = coev_schedule(target);
+        rv = coev_schedule_prio(target, prio);
         Py_END_ALLOW_THREADS
         if (!rv)
             return mod_wait_bottom_half();
     } else {
-        rv = coev_schedule(target);
+        rv = coev_schedule_prio(target, prio);
     }
      
     switch(rv) {
@@ -794,6 +1404,9 @@ mod_schedule(PyObject *a, PyObject *args) {
         case CSCHED_NOSCHEDULER:
             PyErr_SetString(PyExc_CoroError, "target is self, but no scheduler in vicinity.");
             break;
+        case CSCHED_BADPRIO:
+            PyErr_SetString(PyExc_ValueError, "invalid priority.");
+            break;
         default:
             PyErr_SetString(PyExc_CoroError, "unknown coev_schedule return value.");
             break;
@@ -801,6 +1414,192 @@ mod_schedule(PyObject *a, PyObject *args) {
     return NULL;
 }
 
+PyDoc_STRVAR(mod_setprio_doc,
+"setprio(coroutine, prio) -> None\n\n\
+Set runqueue priority the coroutine gets on wakeups and schedule().\n\n\
+prio -- PRIO_ACCEPT, PRIO_IO (default) or PRIO_BACKGROUND\n\
+");
+
+static PyObject *
+mod_setprio(PyObject *a, PyObject *args) {
+    long target_id;
+    int prio;
+
+    if (!PyArg_ParseTuple(args, "li:setprio", &target_id, &prio))
+	return NULL;
+    
+    if (coev_setprio((coev_t *) target_id, prio)) {
+        PyErr_SetString(PyExc_ValueError, "invalid priority.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_deadline_push_doc,
+"deadline_push(seconds) -> None\n\n\
+Bound every wait of the current coroutine until the matching deadline_pop():\n\
+when the deadline passes, whatever is waiting raises Deadline. Nested \n\
+deadlines can only shorten. See coev.deadline for the with-statement form.\n\
+");
+
+static PyObject *
+mod_deadline_push(PyObject *a, PyObject *args) {
+    double timeout;
+    
+    if (!PyArg_ParseTuple(args, "d:deadline_push", &timeout))
+	return NULL;
+    if (coev_deadline_push(timeout)) {
+        PyErr_SetString(PyExc_CoroError, "deadlines nested too deep");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_deadline_pop_doc,
+"deadline_pop() -> None\n\n\
+Drop the innermost deadline.");
+
+static PyObject *
+mod_deadline_pop(PyObject *a, PyObject *b) {
+    coev_deadline_pop();
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_deadline_left_doc,
+"deadline_left() -> float or None\n\n\
+Seconds left until the innermost deadline, None if there's none.");
+
+static PyObject *
+mod_deadline_left(PyObject *a, PyObject *b) {
+    double left = coev_deadline_left();
+    
+    if (left < 0.0)
+        Py_RETURN_NONE;
+    return PyFloat_FromDouble(left);
+}
+
+PyDoc_STRVAR(mod_cancel_doc,
+"cancel(coroutine) -> None\n\n\
+Abort the coroutine's wait in progress (or the next one if it isn't waiting)\n\
+with Cancelled. Untimed lock acquires aren't aborted.\n\
+");
+
+static PyObject *
+mod_cancel(PyObject *a, PyObject *args) {
+    long target_id;
+
+    if (!PyArg_ParseTuple(args, "l:cancel", &target_id))
+	return NULL;
+    
+    if (coev_cancel((coev_t *) target_id)) {
+        PyErr_SetNone(PyExc_CoroTargetDead);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* C API: coev_offload() with the GIL let go. -1 and an exception on error. */
+static int
+PyCoev_offload(void (*fn)(void *), void *arg) {
+    int rv;
+    
+    Py_BEGIN_ALLOW_THREADS
+    rv = coev_offload(fn, arg);
+    Py_END_ALLOW_THREADS
+    if (rv) {
+        PyErr_SetFromErrno(PyExc_CoroError);
+        return -1;
+    }
+    return 0;
+}
+
+/* a PyCObject's pointer or an integer address */
+static int
+_offload_ptr(PyObject *o, void **p) {
+    if (PyCObject_Check(o))
+        *p = PyCObject_AsVoidPtr(o);
+    else
+        *p = PyLong_AsVoidPtr(o);
+    return !PyErr_Occurred();
+}
+
+PyDoc_STRVAR(mod_offload_doc,
+"offload(fn[, arg]) -> None\n\n\
+Call a C function void fn(void *arg) on an offload pool thread, letting\n\
+other coroutines run meanwhile. For blocking C calls: the function must\n\
+not touch Python objects or the interpreter.\n\n\
+fn -- a PyCObject holding the function pointer, or its address as an integer.\n\
+arg -- a PyCObject or an integer address; if not given and fn is a PyCObject,\n\
+    its description pointer.\n\
+");
+
+static PyObject *
+mod_offload(PyObject *a, PyObject *args) {
+    PyObject *fnobj, *argobj = NULL;
+    void *fn, *arg = NULL;
+    
+    if (!PyArg_ParseTuple(args, "O|O:offload", &fnobj, &argobj))
+	return NULL;
+    if (!_offload_ptr(fnobj, &fn))
+        return NULL;
+    if (argobj) {
+        if (!_offload_ptr(argobj, &arg))
+            return NULL;
+    } else if (PyCObject_Check(fnobj))
+        arg = PyCObject_GetDesc(fnobj);
+    if (!fn) {
+        PyErr_SetString(PyExc_ValueError, "offload(): NULL function");
+        return NULL;
+    }
+    if (PyCoev_offload((void (*)(void *)) fn, arg))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_setoffload_doc,
+"setoffload(nthreads) -> None\n\n\
+Set the offload pool size. Threads are started on the next offload()\n\
+and never stopped, so it can't go below what was started already.");
+
+static PyObject *
+mod_setoffload(PyObject *a, PyObject *args) {
+    int n;
+    
+    if (!PyArg_ParseTuple(args, "i:setoffload", &n))
+	return NULL;
+    if (coev_setoffload(n)) {
+        PyErr_SetString(PyExc_ValueError, "can't shrink the offload pool");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_waitpid_doc,
+"waitpid(pid, [timeout]) -> (pid, status)\n\n\
+Wait for a child process to exit, switching to the scheduler meanwhile.\n\
+Returns (0, 0) if it still runs after timeout seconds.\n\n\
+pid -- child's pid, or -1 for any child.\n\
+timeout -- 0 doesn't wait, forever if not given or negative.\n\
+");
+
+static PyObject *
+mod_waitpid(PyObject *a, PyObject *args) {
+    int pid, status = 0;
+    double timeout = -1.0;
+    pid_t rv;
+    
+    if (!PyArg_ParseTuple(args, "i|d:waitpid", &pid, &timeout))
+	return NULL;
+    
+    Py_BEGIN_ALLOW_THREADS
+    rv = coev_waitpid(pid, &status, timeout);
+    Py_END_ALLOW_THREADS
+    
+    if (rv == -1)
+        return _wait_error(PyExc_OSError);
+    return Py_BuildValue("(ii)", (int) rv, status);
+}
+
 PyDoc_STRVAR(mod_scheduler_doc,
 "scheduler() -> None\n\n\
 Run scheduler: dispatch pending IO or timer events");
@@ -813,6 +1612,7 @@ mod_scheduler(PyObject *a, PyObject *b) {
     Py_BEGIN_ALLOW_THREADS
     sched = coev_loop();
     Py_END_ALLOW_THREADS    
+    _sf_unpin();
     
     /* this returns if: 
          - an ev_unloop() has been called by coev_unloop() or in interrupt handler. 
@@ -861,9 +1661,61 @@ _add_K_to_dict(PyObject *dick, const char *key, uint64_t val) {
     return rv;
 }
 
+/* latencies in microseconds, buckets as [(lower bound, count), ...], nonempty only */
+static int
+_add_hist_to_dict(PyObject *dick, const char *key, const coev_hist_t *h, double ns_per_tick) {
+    PyObject *buckets, *hd;
+    double us = ns_per_tick / 1e3;
+    int b, rv;
+    
+    buckets = PyList_New(0);
+    if (!buckets) {
+        Py_DECREF(dick);
+        return -1;
+    }
+    for (b = 0; b < COEV_HIST_BUCKETS; b++) {
+        PyObject *t;
+        
+        if (!h->buckets[b])
+            continue;
+        t = Py_BuildValue("(dK)", coev_hist_lower(b) * us, h->buckets[b]);
+        if (!t || PyList_Append(buckets, t)) {
+            Py_XDECREF(t);
+            Py_DECREF(buckets);
+            Py_DECREF(dick);
+            return -1;
+        }
+        Py_DECREF(t);
+    }
+    hd = Py_BuildValue("{s:K,s:d,s:d,s:d,s:d,s:d,s:d,s:N}",
+        "count", h->count,
+        "mean", h->count ? h->sum * us / h->count : 0.0,
+        "max", h->max * us,
+        "p50", coev_hist_quantile(h, 0.5) * us,
+        "p90", coev_hist_quantile(h, 0.9) * us,
+        "p99", coev_hist_quantile(h, 0.99) * us,
+        "p999", coev_hist_quantile(h, 0.999) * us,
+        "buckets", buckets);
+    if (!hd) {
+        Py_DECREF(dick);
+        return -1;
+    }
+    rv = PyDict_SetItemString(dick, key, hd);
+    Py_DECREF(hd);
+    if (rv)
+        Py_DECREF(dick);
+    return rv;
+}
+
 PyDoc_STRVAR(mod_stats_doc,
 "stats() -> {...}\n\n\
-Returns a dict with instrumentation");
+Returns a dict with instrumentation.\n\
+latency.* are histograms: {'count', 'mean', 'max', 'p50', 'p90', 'p99',\n\
+'p999', 'buckets': [(lower bound, count), ...]}, all in microseconds:\n\
+  latency.runq_delay  made runnable to actually switched into\n\
+  latency.iowait      waiting for an fd to become ready\n\
+  latency.loop_pass   scheduler running the runqueue once through\n\
+  latency.loop_block  scheduler inside the event loop, per pass");
 
 static PyObject *
 mod_stats(PyObject *a, PyObject *b) {
@@ -885,6 +1737,9 @@ mod_stats(PyObject *a, PyObject *b) {
     if (_add_K_to_dict(dick, "c_news", i.c_news)) return NULL;
     if (_add_K_to_dict(dick, "stacks.allocated", i.stacks_allocated)) return NULL;
     if (_add_K_to_dict(dick, "stacks.used", i.stacks_used)) return NULL;
+    if (_add_K_to_dict(dick, "stacks.bytes_reserved", i.stack_bytes_reserved)) return NULL;
+    if (_add_K_to_dict(dick, "stacks.bytes_resident", i.stack_bytes_resident)) return NULL;
+    if (_add_K_to_dict(dick, "stacks.c_releases", i.c_stack_releases)) return NULL;
     if (_add_K_to_dict(dick, "cnrbufs.allocated", i.cnrbufs_allocated)) return NULL;
     if (_add_K_to_dict(dick, "cnrbufs.used", i.cnrbufs_used)) return NULL;
     if (_add_K_to_dict(dick, "coevs.allocated", i.coevs_allocated)) return NULL;
@@ -892,12 +1747,45 @@ mod_stats(PyObject *a, PyObject *b) {
     if (_add_K_to_dict(dick, "coevs.waiting", i.waiters)) return NULL;
     if (_add_K_to_dict(dick, "coevs.slacking", i.slackers)) return NULL;  
     if (_add_K_to_dict(dick, "coevs.on_lock", i.coevs_on_lock)) return NULL;  
+    if (_add_K_to_dict(dick, "coevs.c_parks", i.c_parks)) return NULL;
+    if (_add_K_to_dict(dick, "coevs.c_unparks", i.c_unparks)) return NULL;
     if (_add_K_to_dict(dick, "locks.allocated", i.colocks_allocated)) return NULL;
     if (_add_K_to_dict(dick, "locks.used", i.colocks_used)) return NULL;
     if (_add_K_to_dict(dick, "locks.c_acquires", i.c_lock_acquires)) return NULL;
     if (_add_K_to_dict(dick, "locks.c_acfails", i.c_lock_acfails)) return NULL;
+    if (_add_K_to_dict(dick, "locks.c_timeouts", i.c_lock_timeouts)) return NULL;
     if (_add_K_to_dict(dick, "locks.c_waits", i.c_lock_waits)) return NULL;
     if (_add_K_to_dict(dick, "locks.c_releases", i.c_lock_releases)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_uring_enters", i.c_uring_enters)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_uring_sqes", i.c_uring_sqes)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_iotimer_ops", i.c_iotimer_ops)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_io_direct", i.c_io_direct)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_io_spun", i.c_io_spun)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_io_parked", i.c_io_parked)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_io_persistent", i.c_io_persistent)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_io_uring", i.c_io_uring)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_zc_sends", i.c_zc_sends)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_zc_copied", i.c_zc_copied)) return NULL;
+    if (_add_K_to_dict(dick, "io.c_zc_abandoned", i.c_zc_abandoned)) return NULL;
+    if (_add_K_to_dict(dick, "chans.c_sends", i.c_chan_sends)) return NULL;
+    if (_add_K_to_dict(dick, "chans.c_handoffs", i.c_chan_handoffs)) return NULL;
+    if (_add_K_to_dict(dick, "chans.c_waits", i.c_chan_waits)) return NULL;
+    if (_add_K_to_dict(dick, "chans.c_timeouts", i.c_chan_timeouts)) return NULL;
+    if (_add_K_to_dict(dick, "sync.c_waits", i.c_sync_waits)) return NULL;
+    if (_add_K_to_dict(dick, "sync.c_wakeups", i.c_sync_wakeups)) return NULL;
+    if (_add_K_to_dict(dick, "sync.c_timeouts", i.c_sync_timeouts)) return NULL;
+    if (_add_K_to_dict(dick, "deadlines.c_deadlines", i.c_deadlines)) return NULL;
+    if (_add_K_to_dict(dick, "deadlines.c_cancels", i.c_cancels)) return NULL;
+    if (_add_K_to_dict(dick, "offload.c_offloads", i.c_offloads)) return NULL;
+    if (_add_K_to_dict(dick, "offload.c_inline", i.c_offload_inline)) return NULL;
+    if (_add_K_to_dict(dick, "child.c_waits", i.c_child_waits)) return NULL;
+    if (_add_K_to_dict(dick, "child.c_kept", i.c_child_kept)) return NULL;
+    if (_add_K_to_dict(dick, "child.c_dropped", i.c_child_dropped)) return NULL;
+    if (_add_hist_to_dict(dick, "latency.runq_delay", &i.h_runq_delay, i.ns_per_tick)) return NULL;
+    if (_add_hist_to_dict(dick, "latency.iowait", &i.h_iowait, i.ns_per_tick)) return NULL;
+    if (_add_hist_to_dict(dick, "latency.loop_pass", &i.h_loop_pass, i.ns_per_tick)) return NULL;
+    if (_add_hist_to_dict(dick, "latency.loop_block", &i.h_loop_block, i.ns_per_tick)) return NULL;
+    if (_add_hist_to_dict(dick, "latency.offload", &i.h_offload, i.ns_per_tick)) return NULL;
 
     return dick;
 }
@@ -923,20 +1811,244 @@ mod_setdebug(PyObject *a, PyObject *args, PyObject *kwargs) {
     Py_RETURN_NONE;
 }
 
+PyDoc_STRVAR(mod_setstackhiwat_doc,
+"setstackhiwat(bytes) -> None\n\n\
+Set how much memory idle coroutine stacks may keep resident.\n\
+Idle stacks above that are released back to the OS.\n");
+
+static PyObject *
+mod_setstackhiwat(PyObject *a, PyObject *args) {
+    Py_ssize_t bytes;
+    
+    if (!PyArg_ParseTuple(args, "n:setstackhiwat", &bytes))
+	return NULL;
+    if (bytes < 0) {
+	PyErr_SetString(PyExc_ValueError, "high-water mark must not be negative");
+	return NULL;
+    }
+    coev_setstackhiwat(bytes);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_setstackprof_doc,
+"setstackprof(mode) -> None\n\n\
+Set stack usage profiling mode: STACKPROF_OFF, STACKPROF_SAMPLE or\n\
+STACKPROF_AUTO. In the latter, coroutine stacks are sized by measured\n\
+usage of their entry point, thread.stack_size() being the upper bound.\n");
+
+static PyObject *
+mod_setstackprof(PyObject *a, PyObject *args) {
+    int mode;
+    
+    if (!PyArg_ParseTuple(args, "i:setstackprof", &mode))
+	return NULL;
+    if ((mode < COEV_STACKPROF_OFF) || (mode > COEV_STACKPROF_AUTO)) {
+	PyErr_SetString(PyExc_ValueError, "unknown stack profiling mode");
+	return NULL;
+    }
+    coev_setstackprof(mode);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_stackprof_doc,
+"stackprof() -> [{...}, ...]\n\n\
+Returns stack usage profiles, one dict per entry point.\n\
+key is id() of the code object (or class, or type) of the thread function.\n\
+hist is a list of sample counts by used size: i-th bucket counts\n\
+those that fit into (pagesize << i) bytes.\n");
+
+static PyObject *
+mod_stackprof(PyObject *a, PyObject *b) {
+    coev_stackprof_t *profs;
+    PyObject *rv, *d, *hist;
+    int n, k, i;
+    
+    n = coev_getstackprof(NULL, 0);
+    profs = PyMem_New(coev_stackprof_t, n + 1);
+    if (!profs)
+        return PyErr_NoMemory();
+    n = coev_getstackprof(profs, n);
+    
+    rv = PyList_New(0);
+    if (!rv)
+        goto failed;
+    
+    for (k = 0; k < n; k++) {
+        hist = PyList_New(COEV_STACK_CLASSES);
+        if (!hist)
+            goto failed;
+        for (i = 0; i < COEV_STACK_CLASSES; i++)
+            PyList_SET_ITEM(hist, i, PyInt_FromLong(profs[k].hist[i]));
+        d = Py_BuildValue("{s:l,s:K,s:K,s:n,s:n,s:N}",
+            "key", (long) profs[k].key,
+            "spawns", profs[k].spawns,
+            "samples", profs[k].samples,
+            "max_used", (Py_ssize_t) profs[k].max_used,
+            "auto_size", (Py_ssize_t) profs[k].auto_size,
+            "hist", hist);
+        if (!d)
+            goto failed;
+        if (PyList_Append(rv, d)) {
+            Py_DECREF(d);
+            goto failed;
+        }
+        Py_DECREF(d);
+    }
+    PyMem_Free(profs);
+    return rv;
+
+failed:
+    Py_XDECREF(rv);
+    PyMem_Free(profs);
+    return NULL;
+}
+
+PyDoc_STRVAR(mod_trace_enable_doc,
+"trace_enable(nevents) -> None\n\n\
+Start recording switches, waits, wakeups, timeouts, spawns, deaths and\n\
+lock events into a ring of the last nevents (rounded up to a power\n\
+of two). 0 stops it. Re-enabling discards what was recorded.\n");
+
+static PyObject *
+mod_trace_enable(PyObject *a, PyObject *args) {
+    Py_ssize_t nevents;
+    
+    if (!PyArg_ParseTuple(args, "n:trace_enable", &nevents))
+	return NULL;
+    if (nevents < 0) {
+	PyErr_SetString(PyExc_ValueError, "event count must not be negative");
+	return NULL;
+    }
+    if (coev_trace_enable(nevents))
+        return PyErr_SetFromErrno(PyExc_OSError);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_trace_dump_doc,
+"trace_dump(file) -> None\n\n\
+Write recorded events as Chrome trace JSON, to be loaded into\n\
+chrome://tracing or ui.perfetto.dev. file is a file object or an fd.\n\
+Tracks are coroutine ids, as in getpos(). Only this thread's events\n\
+are written.\n");
+
+static PyObject *
+mod_trace_dump(PyObject *a, PyObject *args) {
+    PyObject *file, *rv;
+    int fd;
+    
+    if (!PyArg_ParseTuple(args, "O:trace_dump", &file))
+	return NULL;
+    fd = PyObject_AsFileDescriptor(file);
+    if (fd == -1)
+        return NULL;
+    /* whatever the file object has buffered goes first */
+    if (PyObject_HasAttrString(file, "flush")) {
+        rv = PyObject_CallMethod(file, "flush", NULL);
+        if (!rv)
+            return NULL;
+        Py_DECREF(rv);
+    }
+    if (coev_trace_dump(fd))
+        return PyErr_SetFromErrno(PyExc_IOError);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_top_doc,
+"top([n]) -> [{...}, ...]\n\n\
+Returns up to n (default 20) coroutines of this thread that ran the\n\
+most, hottest first, as dicts: ident (as thread.get_ident() would\n\
+return in it), treepos, state, cpu (seconds run), switches (times\n\
+switched into) and idle (seconds since last switched in or out).\n");
+
+static PyObject *
+mod_top(PyObject *a, PyObject *args) {
+    coev_top_t *top;
+    PyObject *rv, *d;
+    const char *state;
+    int n = 20, k;
+    
+    if (!PyArg_ParseTuple(args, "|i:top", &n))
+	return NULL;
+    if (n < 0) {
+	PyErr_SetString(PyExc_ValueError, "n must not be negative");
+	return NULL;
+    }
+    top = PyMem_New(coev_top_t, n + 1);
+    if (!top)
+        return PyErr_NoMemory();
+    k = coev_top(top, n);
+    if (k < n)
+        n = k;
+    
+    rv = PyList_New(0);
+    if (!rv)
+        goto failed;
+    
+    for (k = 0; k < n; k++) {
+        state = coev_state(top[k].coev);
+        d = Py_BuildValue("{s:l,s:s,s:s#,s:d,s:K,s:d}",
+            "ident", (long) top[k].coev,
+            "treepos", coev_treepos(top[k].coev),
+            "state", state, (Py_ssize_t) strcspn(state, " "),
+            "cpu", top[k].cpu_ns / 1e9,
+            "switches", top[k].switches,
+            "idle", top[k].idle_ns / 1e9);
+        if (!d)
+            goto failed;
+        if (PyList_Append(rv, d)) {
+            Py_DECREF(d);
+            goto failed;
+        }
+        Py_DECREF(d);
+    }
+    PyMem_Free(top);
+    return rv;
+
+failed:
+    Py_XDECREF(rv);
+    PyMem_Free(top);
+    return NULL;
+}
+
+PyDoc_STRVAR(mod_iobackend_doc,
+"iobackend() -> 'libev' or 'io_uring'\n\n\
+Returns the I/O backend in use.");
+
+static PyObject *
+mod_iobackend(PyObject *a, PyObject *b) {
+    return PyString_FromString(coev_iobackend());
+}
+
 static PyMethodDef CoevMethods[] = {
     {   "current", mod_current, METH_NOARGS, mod_current_doc },
     {   "switch", mod_switch, METH_VARARGS, mod_switch_doc },
     {   "throw", mod_throw, METH_VARARGS, mod_throw_doc },
     {   "wait", mod_wait, METH_VARARGS, mod_wait_doc },
+    {   "wait_many", mod_wait_many, METH_VARARGS, mod_wait_many_doc },
     {   "sleep", mod_sleep, METH_VARARGS, mod_sleep_doc },
     {   "stall", mod_stall, METH_NOARGS, mod_stall_doc },
     {   "switch2scheduler", mod_switch2scheduler, METH_NOARGS, mod_switch2scheduler_doc },
     {   "schedule", mod_schedule, METH_VARARGS, mod_schedule_doc},
+    {   "setprio", mod_setprio, METH_VARARGS, mod_setprio_doc},
+    {   "deadline_push", mod_deadline_push, METH_VARARGS, mod_deadline_push_doc},
+    {   "deadline_pop", mod_deadline_pop, METH_NOARGS, mod_deadline_pop_doc},
+    {   "deadline_left", mod_deadline_left, METH_NOARGS, mod_deadline_left_doc},
+    {   "cancel", mod_cancel, METH_VARARGS, mod_cancel_doc},
+    {   "offload", mod_offload, METH_VARARGS, mod_offload_doc},
+    {   "setoffload", mod_setoffload, METH_VARARGS, mod_setoffload_doc},
+    {   "waitpid", mod_waitpid, METH_VARARGS, mod_waitpid_doc},
     {   "scheduler", mod_scheduler, METH_NOARGS, mod_scheduler_doc },
     {   "stats", mod_stats, METH_NOARGS, mod_stats_doc },
     {   "setdebug", (PyCFunction)mod_setdebug,
         METH_VARARGS | METH_KEYWORDS, mod_setdebug_doc },
     {   "getpos", mod_getpos, METH_VARARGS, mod_getpos_doc},
+    {   "setstackhiwat", mod_setstackhiwat, METH_VARARGS, mod_setstackhiwat_doc},
+    {   "setstackprof", mod_setstackprof, METH_VARARGS, mod_setstackprof_doc},
+    {   "stackprof", mod_stackprof, METH_NOARGS, mod_stackprof_doc},
+    {   "iobackend", mod_iobackend, METH_NOARGS, mod_iobackend_doc},
+    {   "top", mod_top, METH_VARARGS, mod_top_doc},
+    {   "trace_enable", mod_trace_enable, METH_VARARGS, mod_trace_enable_doc},
+    {   "trace_dump", mod_trace_dump, METH_VARARGS, mod_trace_dump_doc},
         
     { 0 }
 };
@@ -964,6 +2076,8 @@ init_coev(void) {
     
     if (PyType_Ready(&CoroSocketFile_Type) < 0)
         return;
+    if (PyType_Ready(&CoroQueue_Type) < 0)
+        return;
 
     { /* add exceptions */
         PyObject* exc_obj;
@@ -1005,9 +2119,12 @@ init_coev(void) {
     
     Py_INCREF(&CoroSocketFile_Type);
     PyModule_AddObject(m, "socketfile", (PyObject*) &CoroSocketFile_Type);
+    Py_INCREF(&CoroQueue_Type);
+    PyModule_AddObject(m, "Queue", (PyObject*) &CoroQueue_Type);
     
      /* Initialize the C API pointer array */
     PyCoev_API[PyCoev_wait_bottom_half_NUM] = (void *)mod_wait_bottom_half;
+    PyCoev_API[PyCoev_offload_NUM] = (void *)PyCoev_offload;
     
     /* Create a CObject containing the API pointer array's address */
     c_api_object = PyCObject_FromVoidPtr((void *)PyCoev_API, NULL);
@@ -11,8 +11,14 @@ extern "C" {
 #define PyCoev_wait_bottom_half_RETURN PyObject *
 #define PyCoev_wait_bottom_half_PROTO (void)
 
+/* runs fn(arg) on an offload pool thread, the GIL let go, see coev_offload().
+   fn must not touch Python. Return -1 and set exception on error, 0 on success. */
+#define PyCoev_offload_NUM 1
+#define PyCoev_offload_RETURN int
+#define PyCoev_offload_PROTO (void (*fn)(void *), void *arg)
+
 /* Total number of C API pointers */
-#define PyCoev_API_pointers 1
+#define PyCoev_API_pointers 2
 
 #ifndef COEV_MODULE
 /* This section is used in modules that use spammodule's API */
@@ -23,18 +29,22 @@ static void **PyCoev_API;
  (*(PyCoev_wait_bottom_half_RETURN (*)PyCoev_wait_bottom_half_PROTO) \
     PyCoev_API[PyCoev_wait_bottom_half_NUM])
 
+#define PyCoev_offload \
+ (*(PyCoev_offload_RETURN (*)PyCoev_offload_PROTO) \
+    PyCoev_API[PyCoev_offload_NUM])
+
 /* Return -1 and set exception on error, 0 on success. */
 static int
 import_coev(void)
 {
-    PyObject *module = PyImport_ImportModule("coev");
+    PyObject *module = PyImport_ImportModule("_coev");
 
     if (module != NULL) {
         PyObject *c_api_object = PyObject_GetAttrString(module, "_C_API");
         if (c_api_object == NULL)
             return -1;
         if (PyCObject_Check(c_api_object))
-            PySpam_API = (void **)PyCObject_AsVoidPtr(c_api_object);
+            PyCoev_API = (void **)PyCObject_AsVoidPtr(c_api_object);
         Py_DECREF(c_api_object);
     }
     return 0;
@@ -0,0 +1,52 @@
+"""
+Python coroutine spawn benchmark.
+
+Handlers are started with thread.start_new_thread() in waves of WAVE,
+the way a server spawns one per accepted connection, and the scheduler
+is run until the wave is done.
+
+  start     time per start_new_thread() call.
+  lifetime  start to finish of a handler that does nothing: the start,
+            the first switch in, and the teardown.
+
+The coevs line tells how many of the spawns were fresh coroutines and
+how many were taken from the pool. pool sets thread.coroutine_pool(),
+0 turns reuse off.
+
+Usage: python spawnbench.py [spawns [pool]]
+"""
+
+import sys, time, thread
+import _coev
+
+SPAWNS = 100000
+WAVE = 100
+
+def noop():
+    pass
+
+def bench_spawn(n):
+    s0 = _coev.stats()
+    started = 0.0
+    t0 = time.time()
+    for w in xrange(n / WAVE):
+        t1 = time.time()
+        for i in xrange(WAVE):
+            thread.start_new_thread(noop, ())
+        started += time.time() - t1
+        _coev.scheduler()
+    elapsed = time.time() - t0
+    s1 = _coev.stats()
+    n = n / WAVE * WAVE
+    print "%-10s %10d spawns: %6.2fus per start" % ("start", n, 1e6 * started / n)
+    print "%-10s %10d spawns: %6.2fus per lifetime" % ("lifetime", n, 1e6 * elapsed / n)
+    print "%-10s %10d new, %d unparked" % ("coevs", s1['c_news'] - s0['c_news'],
+        s1.get('coevs.c_unparks', 0) - s0.get('coevs.c_unparks', 0))
+
+if __name__ == '__main__':
+    n = SPAWNS
+    if len(sys.argv) > 1:
+        n = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        thread.coroutine_pool(int(sys.argv[2]))
+    bench_spawn(n)
@@ -0,0 +1,72 @@
+"""
+Python-level context switch benchmark: switches per second.
+
+  switch    _coev.switch() back and forth between the main coroutine
+            and a child.
+  runqueue  coroutines yielding through _coev.stall() to the scheduler.
+  sleep     coroutines doing time.sleep(0.0001), a timer per switch.
+
+Each switch crosses Py_BEGIN/END_ALLOW_THREADS, which is a release and
+an acquire of the interpreter lock unless built with UCOEV_NOGIL; the
+locks column is colock acquires per switch.
+
+Usage: python switchbench.py [switches]
+"""
+
+import sys, time, thread
+import _coev
+
+SWITCHES = 200000
+STALLERS = 100
+SLEEPERS = 100
+SLEEPS = 100
+
+def lock_acquires():
+    return _coev.stats()['locks.c_acquires']
+
+def report(what, count, elapsed, locks):
+    print "%-10s %10d switches in %.3fs: %10.0f switches/s, %.2f locks" % (
+        what, count, elapsed, count / elapsed, float(locks) / count)
+
+def bench_switch(n):
+    main = _coev.current()
+    def child():
+        while True:
+            _coev.switch(main)
+    c = thread.start_new_thread(child, ())
+    l0, t0 = lock_acquires(), time.time()
+    for i in xrange(n / 2):
+        _coev.switch(c)
+    report("switch", n, time.time() - t0, lock_acquires() - l0)
+
+def bench_runqueue(n):
+    stalls = n / STALLERS / 2
+    def staller():
+        for i in xrange(stalls):
+            _coev.stall()
+    for i in xrange(STALLERS):
+        thread.start_new_thread(staller, ())
+    l0, t0 = lock_acquires(), time.time()
+    _coev.scheduler()
+    # each stall is a switch into the staller and one back into the loop
+    report("runqueue", 2 * STALLERS * (stalls + 1), time.time() - t0,
+        lock_acquires() - l0)
+
+def bench_sleep():
+    def sleeper():
+        for i in xrange(SLEEPS):
+            time.sleep(0.0001)
+    for i in xrange(SLEEPERS):
+        thread.start_new_thread(sleeper, ())
+    l0, t0 = lock_acquires(), time.time()
+    _coev.scheduler()
+    report("sleep", 2 * SLEEPERS * (SLEEPS + 1), time.time() - t0,
+        lock_acquires() - l0)
+
+if __name__ == '__main__':
+    n = SWITCHES
+    if len(sys.argv) > 1:
+        n = int(sys.argv[1])
+    bench_switch(n)
+    bench_runqueue(n)
+    bench_sleep()
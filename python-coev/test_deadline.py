@@ -0,0 +1,94 @@
+import errno
+import time
+import thread
+import _coev
+
+# 2.6's errno module has no ECANCELED, this is Linux's
+ECANCELED = getattr(errno, 'ECANCELED', 125)
+
+# each case runs its waiter as a thread, that is a coroutine, and
+# checks that the deadline or cancel() ended the wait, not its timeout.
+
+def _run(*fns):
+    for fn in fns:
+        thread.start_new_thread(fn, ())
+    _coev.scheduler()
+
+def _under_deadline(wait):
+    got = []
+    def waiter():
+        t0 = time.time()
+        _coev.deadline_push(0.05)
+        try:
+            got.append(wait())
+        except Exception, e:
+            got.append(e)
+        _coev.deadline_pop()
+        got.append(time.time() - t0)
+    _run(waiter)
+    return got
+
+def _cancelled(wait):
+    got = []
+    idents = []
+    def waiter():
+        idents.append(thread.get_ident())
+        t0 = time.time()
+        try:
+            got.append(wait())
+        except Exception, e:
+            got.append(e)
+        got.append(time.time() - t0)
+    def canceller():
+        _coev.sleep(0.05)
+        _coev.cancel(idents[0])
+    _run(waiter, canceller)
+    return got
+
+def test_deadline_queue_get():
+    q = _coev.Queue()
+    e, took = _under_deadline(lambda: q.get(True, 5.0))
+    assert isinstance(e, _coev.Deadline), e
+    assert took < 1.0
+
+def test_cancel_queue_get():
+    q = _coev.Queue()
+    e, took = _cancelled(lambda: q.get(True, 5.0))
+    assert isinstance(e, _coev.Cancelled), e
+    assert took < 1.0
+
+def test_deadline_timed_lock():
+    sem = thread._Semaphore(1)
+    sem.acquire()
+    rv, took = _under_deadline(lambda: sem.acquire(1, 5.0))
+    assert rv is False, rv
+    assert took < 1.0
+
+def test_cancel_timed_lock():
+    sem = thread._Semaphore(1)
+    sem.acquire()
+    e, took = _cancelled(lambda: sem.acquire(1, 5.0))
+    assert isinstance(e, thread.error) and e.args[0] == ECANCELED, e
+    assert took < 1.0
+
+def test_deadline_sleep():
+    s0 = _coev.stats()
+    e, took = _under_deadline(lambda: _coev.sleep(5.0))
+    assert isinstance(e, _coev.Deadline), e
+    assert took < 1.0
+    assert _coev.stats()['deadlines.c_deadlines'] > s0['deadlines.c_deadlines']
+
+def test_cancel_sleep():
+    s0 = _coev.stats()
+    e, took = _cancelled(lambda: _coev.sleep(5.0))
+    assert isinstance(e, _coev.Cancelled), e
+    assert took < 1.0
+    assert _coev.stats()['deadlines.c_cancels'] > s0['deadlines.c_cancels']
+
+if __name__ == '__main__':
+    import sys
+    mod = sys.modules[__name__]
+    for name, fn in sorted((name, getattr(mod, name)) for name in dir(mod) if name.startswith('test_')):
+        print fn.__name__
+        fn()
+        print ''
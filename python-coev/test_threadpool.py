@@ -0,0 +1,45 @@
+import ctypes
+import thread
+import _coev
+
+# a callback from C goes through PyGILState_Ensure(), which has to find
+# the thread state a reused coroutine already has. PyDLL keeps the
+# interpreter held across the call, so a second thread state made
+# there would have to take it again.
+_libc = ctypes.PyDLL(None)
+_CMP = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.POINTER(ctypes.c_int), ctypes.POINTER(ctypes.c_int))
+
+def _qsort(values):
+    arr = (ctypes.c_int * len(values))(*values)
+    cmp = _CMP(lambda a, b: a[0] - b[0])
+    _libc.qsort(arr, len(arr), ctypes.sizeof(ctypes.c_int), cmp)
+    return list(arr)
+
+def _wave(fn, n):
+    for i in range(n):
+        thread.start_new_thread(fn, ())
+    _coev.scheduler()
+
+def test_ctypes_callback_in_pooled_thread():
+    results = []
+    def sorter():
+        results.append(_qsort([3, 1, 2]))
+    old = thread.coroutine_pool(8)
+    try:
+        _wave(lambda: None, 8)
+        s0 = _coev.stats()
+        _wave(sorter, 8)
+        s1 = _coev.stats()
+    finally:
+        thread.coroutine_pool(old)
+    assert results == [[1, 2, 3]] * 8
+    assert s1['coevs.c_unparks'] - s0['coevs.c_unparks'] == 8
+    assert s1['c_news'] == s0['c_news']
+
+if __name__ == '__main__':
+    import sys
+    mod = sys.modules[__name__]
+    for name, fn in sorted((name, getattr(mod, name)) for name in dir(mod) if name.startswith('test_')):
+        print fn.__name__
+        fn()
+        print ''
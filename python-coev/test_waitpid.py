@@ -0,0 +1,47 @@
+import os
+import thread
+import _coev
+
+# the scheduler reaps children by itself: one that exits while nobody
+# waits for it has its status kept for a later waitpid().
+
+def _child(code):
+    pid = os.fork()
+    if pid == 0:
+        os._exit(code)
+    return pid
+
+def test_waitpid_after_reaped():
+    got = []
+    def parent():
+        pid = _child(3)
+        _coev.sleep(0.3)
+        got.append((pid, os.waitpid(pid, 0)))
+    s0 = _coev.stats()
+    thread.start_new_thread(parent, ())
+    _coev.scheduler()
+    s1 = _coev.stats()
+    pid, (rpid, status) = got[0]
+    assert rpid == pid, (rpid, pid)
+    assert os.WIFEXITED(status) and os.WEXITSTATUS(status) == 3, status
+    assert s1['child.c_kept'] > s0['child.c_kept']
+
+def test_waitpid_after_reaped_no_scheduler():
+    pids = []
+    def parent():
+        pids.append(_child(5))
+        _coev.sleep(0.3)
+    thread.start_new_thread(parent, ())
+    _coev.scheduler()
+    # ECHILD from the kernel, the kept status from the scheduler
+    rpid, status = os.waitpid(pids[0], 0)
+    assert rpid == pids[0], (rpid, pids[0])
+    assert os.WIFEXITED(status) and os.WEXITSTATUS(status) == 5, status
+
+if __name__ == '__main__':
+    import sys
+    mod = sys.modules[__name__]
+    for name, fn in sorted((name, getattr(mod, name)) for name in dir(mod) if name.startswith('test_')):
+        print fn.__name__
+        fn()
+        print ''
@@ -1,4 +1,4 @@
-import socket, errno, urlparse, urllib, posixpath, sys, logging
+import socket, errno, urlparse, urllib, posixpath, sys, logging, os, stat
 import coev, thread
 from BaseHTTPServer import BaseHTTPRequestHandler
 
@@ -60,7 +60,11 @@ class CoevWSGIServer(object):
 
     ``wsgi_timeout``
 
-        Per request timeout for the wsgi app. Not enforced yet.
+        Per request timeout for the wsgi app, None for none. Every wait
+        the app does through coev (sockets, sleeps, queues, psycoev)
+        is bound by it; when it passes, coev.Deadline is raised in there,
+        the request gets a 500 if nothing was sent yet, and the 
+        connection is closed.
         
     """
     
@@ -86,6 +90,7 @@ class CoevWSGIServer(object):
         self.accept_limit_window = accept_limit_window
         self.RequestHandlerClass = RequestHandlerClass
         self.__serving = False
+        self.__wakeup = None
         self.iop_timeout = iop_timeout
         self.wsgi_application = wsgi_application
         self.wsgi_timeout = wsgi_timeout
@@ -119,6 +124,10 @@ class CoevWSGIServer(object):
         self.__serving = True
         stall = False
         fd = self.socket.fileno()
+        # shutdown() pokes this so that serve() does not sit out accept_timeout
+        self.__wakeup = os.pipe()
+        waitfds = [ (fd, coev.READ), (self.__wakeup[0], coev.READ) ]
+        coev.setprio(coev.current(), coev.PRIO_ACCEPT)
         while self.__serving:
             accepted = 0
             while accepted < self.accept_bunch_size and not self.overload():
@@ -143,21 +152,26 @@ class CoevWSGIServer(object):
                 stall = False
                 continue
             
-            # wait for connects
+            # wait for connects or shutdown()
             try:
-                coev.wait(fd, coev.READ, self.accept_timeout)
-            except (coev.WaitAbort, coev.Timeout):
+                coev.wait_many(waitfds, self.accept_timeout)
+            except coev.WaitAbort:
                 pass
             except:
                 self.el.exception('serve(): unhandled: ')
 
         self.__serving = False
+        os.close(self.__wakeup[0])
+        os.close(self.__wakeup[1])
+        self.__wakeup = None
 
     def handler(self, *args):
         self.RequestHandlerClass(*args)
 
     def shutdown(self):
         self.__serving = False
+        if self.__wakeup:
+            os.write(self.__wakeup[1], 'x')
 
 class ContinueHook(object):
     """
@@ -203,6 +217,40 @@ class ContinueHook(object):
         self._ContinueFile_send()
         return self._ContinueFile_rfile.readlines(sizehint)
 
+class FileWrapper(object):
+    """
+    wsgi.file_wrapper: if the file-like object is a regular file, 
+    the server sends it with sendfile() from its current position
+    up to the end. Otherwise it's iterated over in blksize blocks.
+    """
+
+    def __init__(self, filelike, blksize=8192):
+        self.filelike = filelike
+        self.blksize = blksize
+        if hasattr(filelike, 'close'):
+            self.close = filelike.close
+
+    def __iter__(self):
+        return self
+
+    def next(self):
+        data = self.filelike.read(self.blksize)
+        if data:
+            return data
+        raise StopIteration
+
+    def extent(self):
+        """(fd, offset, count) to sendfile(), or None if it can't be."""
+        try:
+            fd = self.filelike.fileno()
+            st = os.fstat(fd)
+            offset = self.filelike.tell()
+        except (AttributeError, EnvironmentError, ValueError):
+            return None
+        if not stat.S_ISREG(st.st_mode) or offset > st.st_size:
+            return None
+        return (fd, offset, st.st_size - offset)
+
 class WSGIHandlerMixin(object):
     """
     WSGI mix-in for HTTPRequestHandler
@@ -240,11 +288,12 @@ class WSGIHandlerMixin(object):
         else:
             return self.server_version + ' ' + self.sys_version
 
-    def wsgi_write_chunk(self, chunk):
+    def wsgi_write_chunk(self, chunk, *more):
         """
-        Write a chunk of the output stream; send headers if they
+        Write a chunk (or more) of the output stream; send headers if they
         have not already been sent.
         """
+        chunks = (chunk,) + more
         if not self.wsgi_headers_sent and not self.wsgi_curr_headers:
             raise RuntimeError(
                 "Content returned before start_response called")
@@ -271,8 +320,28 @@ class WSGIHandlerMixin(object):
                 self.close_connection = 1
                 self.send_header('Connection', 'close')
 
-            self.end_headers()
-        self.wfile.write(chunk)
+            self.wsgi_end_headers(chunks)
+        else:
+            self.wsgi_write_body(chunks)
+
+    def wsgi_end_headers(self, chunks):
+        """
+        End the headers and write the first chunks of the output stream.
+        Override to have it all go out in one write.
+        """
+        self.end_headers()
+        self.wsgi_write_body(chunks)
+
+    def wsgi_write_body(self, chunks):
+        for chunk in chunks:
+            self.wfile.write(chunk)
+
+    def wsgi_write_file(self, fw):
+        """
+        Write a FileWrapper. Override to have it sent by other means.
+        """
+        for chunk in fw:
+            self.wsgi_write_chunk(chunk)
 
     def wsgi_start_response(self, status, response_headers, exc_info=None):
         if exc_info:
@@ -324,6 +393,7 @@ class WSGIHandlerMixin(object):
                ,'wsgi.multithread': True
                ,'wsgi.multiprocess': False
                ,'wsgi.run_once': False
+               ,'wsgi.file_wrapper': FileWrapper
                # CGI variables required by PEP-333
                ,'REQUEST_METHOD': self.command
                ,'SCRIPT_NAME': '' # application is root of server
@@ -388,8 +458,14 @@ class WSGIHandlerMixin(object):
             result = self.server.wsgi_application(self.wsgi_environ,
                                                   self.wsgi_start_response)
             try:
-                for chunk in result:
-                    self.wsgi_write_chunk(chunk)
+                if isinstance(result, FileWrapper):
+                    self.wsgi_write_file(result)
+                elif isinstance(result, (list, tuple)) and result:
+                    # all at once, headers included
+                    self.wsgi_write_chunk(*result)
+                else:
+                    for chunk in result:
+                        self.wsgi_write_chunk(chunk)
                 if not self.wsgi_headers_sent:
                     self.wsgi_write_chunk('')
             finally:
@@ -421,7 +497,7 @@ class CoevWSGIHandler(WSGIHandlerMixin, BaseHTTPRequestHandler):
         self.connection = self.request
         self.rfile = self.wfile = coev.socketfile(self.request.fileno(), 
             self.server.iop_timeout, self.server.max_request_size)
-        self.rq_header = ''
+        self.rq_header = []
 
         self.server.stats_collector.incr('coewsgi.c_accepts')
         self.el = logging.getLogger('coewsgi.cwhandler')
@@ -451,14 +527,14 @@ class CoevWSGIHandler(WSGIHandlerMixin, BaseHTTPRequestHandler):
             else:
                 message = ''
         if self.request_version != 'HTTP/0.9':
-            self.rq_header += "%s %d %s\r\n" % (self.protocol_version, code, message)
+            self.rq_header.append("%s %d %s\r\n" % (self.protocol_version, code, message))
         self.send_header('Server', self.version_string())
         self.send_header('Date', self.date_time_string())
 
     def send_header(self, keyword, value):
         """Send a MIME header."""
         if self.request_version != 'HTTP/0.9':
-            self.rq_header += "%s: %s\r\n" % (keyword, value)
+            self.rq_header.append("%s: %s\r\n" % (keyword, value))
 
         if keyword.lower() == 'connection':
             if value.lower() == 'close':
@@ -468,10 +544,32 @@ class CoevWSGIHandler(WSGIHandlerMixin, BaseHTTPRequestHandler):
 
     def end_headers(self):
         """Send the blank line ending the MIME headers."""
+        self.wsgi_end_headers(())
+
+    def wsgi_end_headers(self, chunks):
+        """Status line, headers and body chunks go out in one writev()."""
         if self.request_version != 'HTTP/0.9':
-            self.rq_header += "\r\n"
-        self.wfile.write(self.rq_header)
-        self.rq_header = ''
+            self.rq_header.append("\r\n")
+        self.rq_header.extend(chunks)
+        self.wfile.writev(self.rq_header)
+        self.rq_header = []
+
+    def wsgi_write_body(self, chunks):
+        self.wfile.writev(chunks)
+
+    def wsgi_write_file(self, fw):
+        """Straight from the page cache to the socket, if it's a file."""
+        extent = fw.extent()
+        if extent is None:
+            return WSGIHandlerMixin.wsgi_write_file(self, fw)
+        fd, offset, count = extent
+        self.wsgi_write_chunk('')
+        sent = self.wfile.sendfile(fd, offset, count)
+        if sent < count:
+            # file got shorter since fstat(): Content-Length is a lie now,
+            # the client can only tell by the connection going away.
+            self.el.warning('sendfile: sent %d of %d bytes', sent, count)
+            self.close_connection = 1
 
     def handle_one_request(self):
         try:
@@ -505,8 +603,17 @@ class CoevWSGIHandler(WSGIHandlerMixin, BaseHTTPRequestHandler):
             self.close_connection = 1
             self.server.stats_collector.incr('coewsgi.c_503')
             
+        if self.server.wsgi_timeout:
+            coev.deadline_push(self.server.wsgi_timeout)
         try:
-            self.wsgi_execute()
+            try:
+                self.wsgi_execute()
+            finally:
+                if self.server.wsgi_timeout:
+                    coev.deadline_pop()
+        except coev.Deadline:
+            self.server.stats_collector.incr('coewsgi.c_wsgi_timeouts')
+            self.close_connection = 1
         except:
             self.server.stats_collector.incr('coewsgi.c_unhexcs')
             self.el.exception('handle_one_request')
@@ -693,9 +800,10 @@ def server_runner(wsgi_app, global_conf, **kwargs):
     serve(wsgi_app, **kwargs)
 
 class CoevStatsMiddleware(StatsMiddleware):
-    def __init__(self, path, app, **kwargs):
+    def __init__(self, path, app, top_count=20, **kwargs):
         self.app = app
         self.path = path
+        self.top_count = top_count
         self.ext_data = {}
     
     def incr(self, key):
@@ -711,6 +819,11 @@ class CoevStatsMiddleware(StatsMiddleware):
             
         for k,v in self.ext_data.items():
             rv += "{0}={1}\n".format(k,v)
+        
+        # hottest coroutines: cpu and idle in seconds
+        for i, t in enumerate(coev.top(self.top_count)):
+            rv += "coev.top.{0}={1[treepos]} {1[state]} cpu={1[cpu]:.6f} " \
+                  "switches={1[switches]} idle={1[idle]:.6f}\n".format(i, t)
             
         return rv
 
@@ -580,6 +580,29 @@ class Client(object):
 
         return (server_keys, prefixed_to_orig_key)
 
+    def _worker_runner(self, results, worker, args):
+        try:
+            results.put((True, worker(*args)))
+        except Exception, e:
+            results.put((False, e))
+
+    def _run_workers(self, el, worker, jobs):
+        """ runs worker(*args) for each args in jobs in its own coroutine, 
+            returns the list of what the ones that did not raise returned. """
+        results = coev.Queue()
+        for args in jobs:
+            thread.start_new_thread(self._worker_runner, (results, worker, args))
+        el.debug('workers spawned')
+        rvs = []
+        for i in range(len(jobs)):
+            ok, rv = results.get()
+            if ok:
+                rvs.append(rv)
+            else:
+                el.error('worker failed: %s', rv)
+        el.info('[%s] workers collected; returning', coev.getpos())
+        return rvs
+
     def set_multi_worker(self, server, keys, prefixed_to_orig_key, mapping, ttl, min_compress_len):
         el = logging.getLogger("evmemc.set_multi_worker")
         retval = []
@@ -646,25 +669,12 @@ class Client(object):
         
         server_keys, prefixed_to_orig_key = self._map_and_prefix_keys(mapping.iterkeys(), key_prefix)
 
-        for server, keys in server_keys.items():
-            thread.start_new_thread(self.set_multi_worker, (server, keys, prefixed_to_orig_key, mapping, ttl, min_compress_len))
-    
-        el.debug('workers spawned')
-        # wait for workers to die
-        wcount = len(server_keys)
+        jobs = [ (server, keys, prefixed_to_orig_key, mapping, ttl, min_compress_len) 
+                    for server, keys in server_keys.items() ]
         retval = []
-        el.info('[%s] initial wcount=%d', coev.getpos(), wcount)
-        while wcount > 0:
-            el.info('[%s] wcount=%d', coev.getpos(), wcount)
-            wcount -= 1
-            try:
-                rv = coev.switch2scheduler()
-                el.debug("worker retval %r", retval)
-                retval += rv 
-            except Exception, e:
-                el.error('worker failed: %s', e)
+        for rv in self._run_workers(el, self.set_multi_worker, jobs):
+            retval += rv 
         el.debug('returning %d keys', len(retval))
-        el.info('[%s] workers collected; returning', coev.getpos())
         return retval
 
     def old_set_multi(self, mapping, time=0, key_prefix='', min_compress_len=0):
@@ -909,23 +919,11 @@ class Client(object):
         
         server_keys, prefixed_to_orig_key = self._map_and_prefix_keys(keys, key_prefix)
 
-        for server, keys in server_keys.items():
-            thread.start_new_thread(self.get_multi_worker, (server, keys, prefixed_to_orig_key))
-    
-        el.debug('workers spawned')
-        # wait for workers to die
-        wcount = len(server_keys)
+        jobs = [ (server, keys, prefixed_to_orig_key) for server, keys in server_keys.items() ]
         retval = {}
-        el.info('[%s] initial wcount=%d', coev.getpos(), wcount)
-        while wcount > 0:
-            el.info('[%s] wcount=%d', coev.getpos(), wcount)
-            wcount -= 1
-            try:
-                retval.update(coev.switch2scheduler())
-            except Exception, e:
-                el.error('worker failed: %s', e)
+        for rv in self._run_workers(el, self.get_multi_worker, jobs):
+            retval.update(rv)
         el.debug('returning %d kvpairs', len(retval))
-        el.info('[%s] workers collected; returning', coev.getpos())
         return retval
 
     def _expectvalue(self, server, line=None):
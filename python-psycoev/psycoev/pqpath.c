@@ -65,6 +65,13 @@ pqp_raise_from_coev(void) {
     switch (coev_current()->status) {
         case CSW_TIMEOUT:
             PyErr_SetString(Error, "I/O Timeout");
+            break;
+        case CSW_DEADLINE:
+            PyErr_SetString(Error, "I/O Deadline passed");
+            break;
+        case CSW_CANCELLED:
+            PyErr_SetString(Error, "I/O Cancelled");
+            break;
         default:
             PyErr_Format(Error, "Unexpected status after coev_wait(): [%s/%s], treepos=[%s]",
                     coev_state(coev_current()), coev_status(coev_current()), coev_treepos(coev_current()));
@@ -172,6 +172,13 @@ PyAPI_FUNC(void) PyGILState_Release(PyGILState_STATE);
 */
 PyAPI_FUNC(PyThreadState *) PyGILState_GetThisThreadState(void);
 
+#ifdef UCOEV_THREADS
+/* A pooled coroutine comes back from PyThread_park_coroutine() with
+   its thread-local keys cleared: note the thread state it keeps again.
+*/
+PyAPI_FUNC(void) _PyGILState_NoteUnparked(PyThreadState *);
+#endif
+
 /* The implementation of sys._current_frames()  Returns a dict mapping
    thread id to that thread's current frame.
 */
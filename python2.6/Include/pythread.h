@@ -14,6 +14,14 @@ extern "C" {
 
 PyAPI_FUNC(void) PyThread_init_thread(void);
 PyAPI_FUNC(long) PyThread_start_new_thread(void (*)(void *), void *);
+#ifdef UCOEV_THREADS
+/* key identifies the entry point for stack usage profiling and sizing */
+PyAPI_FUNC(long) PyThread_start_new_coroutine(void (*)(void *), void *, const void *);
+/* a finished coroutine parks itself to be reused, 0 when it is, -1 if 
+   it can't be kept; reuse takes key as above, NULL for any stack */
+PyAPI_FUNC(int) PyThread_park_coroutine(void);
+PyAPI_FUNC(long) PyThread_reuse_coroutine(long, const void *);
+#endif
 PyAPI_FUNC(void) PyThread_exit_thread(void);
 PyAPI_FUNC(void) PyThread__PyThread_exit_thread(void);
 PyAPI_FUNC(long) PyThread_get_thread_ident(void);
@@ -36,6 +36,11 @@ _start_new_thread = thread.start_new_thread
 _allocate_lock = thread.allocate_lock
 _get_ident = thread.get_ident
 ThreadError = thread.error
+# Under coroutines (UCOEV_THREADS) these park the waiter in the scheduler
+# until it is released, set or notified; otherwise None.
+_CoSemaphore = getattr(thread, '_Semaphore', None)
+_CoEvent = getattr(thread, '_Event', None)
+_CoCondVar = getattr(thread, '_CondVar', None)
 del thread
 
 
@@ -200,6 +205,8 @@ class _Condition(_Verbose):
         except AttributeError:
             pass
         self.__waiters = []
+        if _CoCondVar is not None:
+            self.__cv = _CoCondVar()
 
     def __enter__(self):
         return self.__lock.__enter__()
@@ -288,6 +295,29 @@ class _Condition(_Verbose):
     def notifyAll(self):
         self.notify(len(self.__waiters))
 
+    if _CoCondVar is not None:
+        def __repr__(self):
+            return "<Condition(%s, %d)>" % (self.__lock, self.__cv.waiters())
+
+        def wait(self, timeout=None):
+            if not self._is_owned():
+                raise RuntimeError("cannot wait on un-aquired lock")
+            if self.__cv.wait(self, timeout):
+                if __debug__:
+                    self._note("%s.wait(%s): got it", self, timeout)
+            elif __debug__:
+                self._note("%s.wait(%s): timed out", self, timeout)
+
+        def notify(self, n=1):
+            if not self._is_owned():
+                raise RuntimeError("cannot notify on un-aquired lock")
+            self.__cv.notify(n)
+
+        def notifyAll(self):
+            if not self._is_owned():
+                raise RuntimeError("cannot notify on un-aquired lock")
+            self.__cv.notify_all()
+
     notify_all = notifyAll
 
 
@@ -338,6 +368,36 @@ class _Semaphore(_Verbose):
     def __exit__(self, t, v, tb):
         self.release()
 
+if _CoSemaphore is not None:
+    class _Semaphore(_Verbose):
+
+        def __init__(self, value=1, verbose=None):
+            if value < 0:
+                raise ValueError("semaphore initial value must be >= 0")
+            _Verbose.__init__(self, verbose)
+            self.__sem = _CoSemaphore(value)
+
+        # for _BoundedSemaphore
+        __value = property(lambda self: self.__sem.value())
+
+        def acquire(self, blocking=1):
+            rc = self.__sem.acquire(blocking)
+            if __debug__:
+                self._note("%s.acquire(%s): %s, value=%s", self, blocking,
+                           rc and "success" or "failure", self.__sem.value())
+            return rc
+
+        __enter__ = acquire
+
+        def release(self):
+            self.__sem.release()
+            if __debug__:
+                self._note("%s.release: success, value=%s",
+                           self, self.__sem.value())
+
+        def __exit__(self, t, v, tb):
+            self.release()
+
 
 def BoundedSemaphore(*args, **kwargs):
     return _BoundedSemaphore(*args, **kwargs)
@@ -394,6 +454,27 @@ class _Event(_Verbose):
         finally:
             self.__cond.release()
 
+if _CoEvent is not None:
+    class _Event(_Verbose):
+
+        def __init__(self, verbose=None):
+            _Verbose.__init__(self, verbose)
+            self.__event = _CoEvent()
+
+        def isSet(self):
+            return self.__event.is_set()
+
+        is_set = isSet
+
+        def set(self):
+            self.__event.set()
+
+        def clear(self):
+            self.__event.clear()
+
+        def wait(self, timeout=None):
+            self.__event.wait(timeout)
+
 # Helper to generate new thread names
 _counter = 0
 def _newname(template="Thread-%d"):
@@ -70,6 +70,10 @@ enum py_ssl_version {
 /* Include symbols from _socket module */
 #include "socketmodule.h"
 
+#ifdef UCOEV_THREADS
+#include <ucoev.h>
+#endif
+
 #if defined(HAVE_POLL_H)
 #include <poll.h>
 #elif defined(HAVE_SYS_POLL_H)
@@ -1085,15 +1089,40 @@ check_socket_and_wait_for_timeout(PySocketSockObject *s, int writing)
 	int rc;
 
 	/* Nothing to do unless we're in timeout mode (not non-blocking) */
+#ifdef UCOEV_THREADS
+	/* blocking sockets' fds are non-blocking too, and are waited for
+	   here, by a coroutine if a scheduler runs: see socketmodule.c */
+	if (s->sock_timeout == 0.0)
+		return SOCKET_IS_NONBLOCKING;
+#else
 	if (s->sock_timeout < 0.0)
 		return SOCKET_IS_BLOCKING;
 	else if (s->sock_timeout == 0.0)
 		return SOCKET_IS_NONBLOCKING;
+#endif
 
 	/* Guard against closed socket */
 	if (s->sock_fd < 0)
 		return SOCKET_HAS_BEEN_CLOSED;
 
+#ifdef UCOEV_THREADS
+	if (coev_is_scheduling()) {
+		Py_BEGIN_ALLOW_THREADS
+		coev_wait(s->sock_fd, writing ? COEV_WRITE : COEV_READ,
+			  s->sock_timeout > 0.0 ? s->sock_timeout : 0.0);
+		Py_END_ALLOW_THREADS
+		switch (coev_current()->status) {
+		case CSW_EVENT:
+			return SOCKET_OPERATION_OK;
+		case CSW_TIMEOUT:
+		case CSW_DEADLINE:
+		case CSW_CANCELLED:
+			return SOCKET_HAS_TIMED_OUT;
+		}
+		/* the scheduler itself: block below */
+	}
+#endif
+
 	/* Prefer poll, if available, since you can poll() any fd
 	 * which can't be done with select(). */
 #ifdef HAVE_POLL
@@ -1105,7 +1134,10 @@ check_socket_and_wait_for_timeout(PySocketSockObject *s, int writing)
 		pollfd.events = writing ? POLLOUT : POLLIN;
 
 		/* s->sock_timeout is in seconds, timeout in ms */
-		timeout = (int)(s->sock_timeout * 1000 + 0.5);
+		if (s->sock_timeout < 0.0)
+			timeout = -1;
+		else
+			timeout = (int)(s->sock_timeout * 1000 + 0.5);
 		PySSL_BEGIN_ALLOW_THREADS
 		rc = poll(&pollfd, 1, timeout);
 		PySSL_END_ALLOW_THREADS
@@ -1129,9 +1161,11 @@ check_socket_and_wait_for_timeout(PySocketSockObject *s, int writing)
 	/* See if the socket is ready */
 	PySSL_BEGIN_ALLOW_THREADS
 	if (writing)
-		rc = select(s->sock_fd+1, NULL, &fds, NULL, &tv);
+		rc = select(s->sock_fd+1, NULL, &fds, NULL,
+			    s->sock_timeout < 0.0 ? NULL : &tv);
 	else
-		rc = select(s->sock_fd+1, &fds, NULL, NULL, &tv);
+		rc = select(s->sock_fd+1, &fds, NULL, NULL,
+			    s->sock_timeout < 0.0 ? NULL : &tv);
 	PySSL_END_ALLOW_THREADS
 
 #ifdef HAVE_POLL
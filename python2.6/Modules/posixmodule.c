@@ -34,6 +34,11 @@
 #    include <unixio.h>
 #endif /* defined(__VMS) */
 
+#ifdef UCOEV_THREADS
+#include <poll.h>
+#include <ucoev.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -5780,10 +5785,30 @@ wait_helper(pid_t pid, int status, struct rusage *ru)
 }
 #endif /* HAVE_WAIT3 || HAVE_WAIT4 */
 
+#if defined(UCOEV_THREADS) && defined(HAVE_WAITPID)
+/* libev's default loop reaps every child that exits and keeps what 
+   nobody waited for, so the kernel's wait*() says ECHILD for those:
+   this takes a kept status then. Process groups can't be looked up. */
+static pid_t
+coev_kept_status(pid_t pid, int *status)
+{
+	pid_t rv = 0;
+
+	if ((pid > 0) || (pid == -1))
+		rv = coev_waitpid(pid, status, 0.0);
+	if (rv == 0) {
+		errno = ECHILD;
+		return -1;
+	}
+	return rv;
+}
+#endif
+
 #ifdef HAVE_WAIT3
 PyDoc_STRVAR(posix_wait3__doc__,
 "wait3(options) -> (pid, status, rusage)\n\n\
-Wait for completion of a child process.");
+Wait for completion of a child process.\n\
+A child libev's loop reaped already comes with a zeroed rusage.");
 
 static PyObject *
 posix_wait3(PyObject *self, PyObject *args)
@@ -5799,6 +5824,12 @@ posix_wait3(PyObject *self, PyObject *args)
 
 	Py_BEGIN_ALLOW_THREADS
 	pid = wait3(&status, options, &ru);
+#if defined(UCOEV_THREADS) && defined(HAVE_WAITPID)
+	if ((pid == -1) && (errno == ECHILD)) {
+		pid = coev_kept_status(-1, &WAIT_STATUS_INT(status));
+		memset(&ru, 0, sizeof(ru));
+	}
+#endif
 	Py_END_ALLOW_THREADS
 
 	return wait_helper(pid, WAIT_STATUS_INT(status), &ru);
@@ -5808,12 +5839,13 @@ posix_wait3(PyObject *self, PyObject *args)
 #ifdef HAVE_WAIT4
 PyDoc_STRVAR(posix_wait4__doc__,
 "wait4(pid, options) -> (pid, status, rusage)\n\n\
-Wait for completion of a given child process.");
+Wait for completion of a given child process.\n\
+A child libev's loop reaped already comes with a zeroed rusage.");
 
 static PyObject *
 posix_wait4(PyObject *self, PyObject *args)
 {
-	pid_t pid;
+	pid_t pid, rpid;
 	int options;
 	struct rusage ru;
 	WAIT_TYPE status;
@@ -5823,17 +5855,52 @@ posix_wait4(PyObject *self, PyObject *args)
 		return NULL;
 
 	Py_BEGIN_ALLOW_THREADS
-	pid = wait4(pid, &status, options, &ru);
+	rpid = wait4(pid, &status, options, &ru);
+#if defined(UCOEV_THREADS) && defined(HAVE_WAITPID)
+	if ((rpid == -1) && (errno == ECHILD)) {
+		rpid = coev_kept_status(pid, &WAIT_STATUS_INT(status));
+		memset(&ru, 0, sizeof(ru));
+	}
+#endif
+	pid = rpid;
 	Py_END_ALLOW_THREADS
 
 	return wait_helper(pid, WAIT_STATUS_INT(status), &ru);
 }
 #endif /* HAVE_WAIT4 */
 
+#if defined(UCOEV_THREADS) && defined(HAVE_WAITPID)
+/* libev's default loop reaps children by itself and keeps what it got
+   for coev_waitpid(), which also parks just the coroutine. Options 
+   other than WNOHANG and process groups still go to waitpid(), which
+   blocks the process, and falls back to the kept statuses on ECHILD. */
+static pid_t
+coev_posix_waitpid(pid_t pid, int *status, int options)
+{
+	pid_t rv;
+
+	if (((pid > 0) || (pid == -1)) && !(options & ~WNOHANG)) {
+		rv = coev_waitpid(pid, status, 
+				  (options & WNOHANG) ? 0.0 : -1.0);
+		if ((rv != -1) || (errno != EDEADLK))
+			return rv;
+	}
+	rv = waitpid(pid, status, options);
+	if ((rv == -1) && (errno == ECHILD))
+		rv = coev_kept_status(pid, status);
+	return rv;
+}
+#endif
+
 #ifdef HAVE_WAITPID
 PyDoc_STRVAR(posix_waitpid__doc__,
 "waitpid(pid, options) -> (pid, status)\n\n\
-Wait for completion of a given child process.");
+Wait for completion of a given child process.\n\
+With coev, only the coroutine waits, unless options has more than\n\
+WNOHANG or pid is a process group: that blocks the process. libev's\n\
+loop reaps every child, so a child that stopped or continued is not\n\
+reported once it did, and of a process group's exited children\n\
+only those the loop did not get are.");
 
 static PyObject *
 posix_waitpid(PyObject *self, PyObject *args)
@@ -5846,7 +5913,11 @@ posix_waitpid(PyObject *self, PyObject *args)
 	if (!PyArg_ParseTuple(args, "ii:waitpid", &pid, &options))
 		return NULL;
 	Py_BEGIN_ALLOW_THREADS
+#ifdef UCOEV_THREADS
+	pid = coev_posix_waitpid(pid, &WAIT_STATUS_INT(status), options);
+#else
 	pid = waitpid(pid, &status, options);
+#endif
 	Py_END_ALLOW_THREADS
 	if (pid == -1)
 		return posix_error();
@@ -5893,7 +5964,11 @@ posix_wait(PyObject *self, PyObject *noargs)
 	WAIT_STATUS_INT(status) = 0;
 
 	Py_BEGIN_ALLOW_THREADS
+#if defined(UCOEV_THREADS) && defined(HAVE_WAITPID)
+	pid = coev_posix_waitpid(-1, &WAIT_STATUS_INT(status), 0);
+#else
 	pid = wait(&status);
+#endif
 	Py_END_ALLOW_THREADS
 	if (pid == -1)
 		return posix_error();
@@ -6349,6 +6424,72 @@ posix_lseek(PyObject *self, PyObject *args)
 }
 
 
+#ifdef UCOEV_THREADS
+/* Blocking read()/write() on a pipe, tty or such stops every coroutine,
+   so if fd isn't ready and is in blocking mode it's the coroutine that
+   waits for it. Call without the GIL. Returns 0 when it's fine to do 
+   the syscall, or -1 with errno set if the wait got cut short. */
+static int
+coev_fdready(int fd, int writing)
+{
+	struct pollfd pfd;
+	int flags;
+
+	if (!coev_is_scheduling())
+		return 0;
+	pfd.fd = fd;
+	pfd.events = writing ? POLLOUT : POLLIN;
+	if (poll(&pfd, 1, 0) != 0)
+		return 0; /* ready, or let the syscall itself fail */
+	flags = fcntl(fd, F_GETFL);
+	if ((flags == -1) || (flags & O_NONBLOCK))
+		return 0;
+	coev_wait(fd, writing ? COEV_WRITE : COEV_READ, 0.0);
+	switch (coev_current()->status) {
+	case CSW_DEADLINE:
+		errno = ETIMEDOUT;
+		return -1;
+	case CSW_CANCELLED:
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+/* os.write() on a blocking pipe: PIPE_BUF bytes at a time, which is
+   what a writable pipe surely has room for, waiting for room before
+   each piece, so that all of it goes out and only the coroutine blocks.
+   Less than len is returned only if a deadline or cancel cuts the wait
+   short after some of it went out. Call without the GIL. */
+static Py_ssize_t
+coev_fdwrite(int fd, const char *buf, size_t len)
+{
+	STRUCT_STAT st;
+	size_t done = 0;
+	ssize_t n;
+	int flags;
+
+	if (coev_fdready(fd, 1))
+		return -1;
+	if ((len <= PIPE_BUF) || !coev_is_scheduling())
+		return write(fd, buf, len);
+	flags = fcntl(fd, F_GETFL);
+	if (FSTAT(fd, &st) || !S_ISFIFO(st.st_mode)
+	    || (flags == -1) || (flags & O_NONBLOCK))
+		return write(fd, buf, len);
+	while (done < len) {
+		if (done && coev_fdready(fd, 1))
+			break;
+		n = write(fd, buf + done,
+			  len - done < PIPE_BUF ? len - done : PIPE_BUF);
+		if (n < 0)
+			break;
+		done += n;
+	}
+	return done ? (Py_ssize_t)done : -1;
+}
+#endif
+
 PyDoc_STRVAR(posix_read__doc__,
 "read(fd, buffersize) -> string\n\n\
 Read a file descriptor.");
@@ -6368,6 +6509,11 @@ posix_read(PyObject *self, PyObject *args)
 	if (buffer == NULL)
 		return NULL;
 	Py_BEGIN_ALLOW_THREADS
+#ifdef UCOEV_THREADS
+	if (coev_fdready(fd, 0))
+		n = -1;
+	else
+#endif
 	n = read(fd, PyString_AsString(buffer), size);
 	Py_END_ALLOW_THREADS
 	if (n < 0) {
@@ -6394,7 +6540,11 @@ posix_write(PyObject *self, PyObject *args)
 	if (!PyArg_ParseTuple(args, "is*:write", &fd, &pbuf))
 		return NULL;
 	Py_BEGIN_ALLOW_THREADS
+#ifdef UCOEV_THREADS
+	size = coev_fdwrite(fd, pbuf.buf, (size_t)pbuf.len);
+#else
 	size = write(fd, pbuf.buf, (size_t)pbuf.len);
+#endif
 	Py_END_ALLOW_THREADS
 		PyBuffer_Release(&pbuf);
 	if (size < 0)
@@ -32,6 +32,10 @@
 #include <sys/poll.h>
 #endif
 
+#ifdef UCOEV_THREADS
+#include <ucoev.h>
+#endif
+
 #ifdef __sgi
 /* This is missing from unistd.h */
 extern void bzero(void *, int);
@@ -186,6 +190,140 @@ set2list(fd_set *set, pylist fd2obj[FD_SETSIZE + 1])
 	return NULL;
 }
 
+#ifdef UCOEV_THREADS
+static int
+coev_events(short events)
+{
+	int rv = 0;
+
+	if (events & (POLLIN | POLLPRI))
+		rv |= COEV_READ;
+	if (events & POLLOUT)
+		rv |= COEV_WRITE;
+	return rv ? rv : COEV_READ; /* hangups */
+}
+
+/* poll() that stops just the coroutine: if nothing is ready right away
+   and a scheduler runs, it's coev_wait() for one fd, coev_wait_many()
+   for several and coev_sleep() for none, and then a zero-timeout poll()
+   for the actual revents. timeout is in seconds, < 0 is forever.
+   Returns what poll() does, a coev deadline or cancel are -1 with
+   ETIMEDOUT or ECANCELED. Call without the GIL. */
+static int
+coev_poll(struct pollfd *ufds, int n, double timeout)
+{
+	coev_pollfd_t *cfds;
+	int i, rv, ms;
+
+	ms = timeout < 0.0 ? -1 : (int)(timeout * 1000 + 0.5);
+	if (!coev_is_scheduling() || (ms == 0))
+		return poll(ufds, n, ms);
+	rv = poll(ufds, n, 0);
+	if (rv != 0)
+		return rv;
+
+	if (n == 0) {
+		if (timeout < 0.0) {
+			/* forever, but only a deadline or cancel ends it */
+			do
+				coev_sleep(86400.0);
+			while (coev_current()->status == CSW_WAKEUP);
+		} else
+			coev_sleep(timeout);
+	} else if (n == 1) {
+		coev_wait(ufds[0].fd, coev_events(ufds[0].events),
+			  timeout > 0.0 ? timeout : 0.0);
+	} else {
+		cfds = malloc(n * sizeof(coev_pollfd_t));
+		if (cfds == NULL)
+			return poll(ufds, n, ms);
+		for (i = 0; i < n; i++) {
+			cfds[i].fd = ufds[i].fd;
+			cfds[i].events = coev_events(ufds[i].events);
+		}
+		coev_wait_many(cfds, n, timeout > 0.0 ? timeout : 0.0);
+		free(cfds);
+	}
+
+	switch (coev_current()->status) {
+	case CSW_EVENT:
+		return poll(ufds, n, 0);
+	case CSW_WAKEUP:
+	case CSW_TIMEOUT:
+		return 0;
+	case CSW_DEADLINE:
+		errno = ETIMEDOUT;
+		return -1;
+	case CSW_CANCELLED:
+		errno = ECANCELED;
+		return -1;
+	}
+	/* the scheduler itself */
+	return poll(ufds, n, ms);
+}
+
+/* select() on top of the above, same arguments and return as select(). */
+static int
+coev_select(int max, fd_set *ifds, fd_set *ofds, fd_set *efds, 
+	    struct timeval *tvp)
+{
+	struct pollfd *ufds;
+	int fd, i, n, nfds = 0;
+
+	ufds = malloc((max > 0 ? max : 1) * sizeof(struct pollfd));
+	if (ufds == NULL)
+		return select(max, ifds, ofds, efds, tvp);
+	for (fd = 0; fd < max; fd++) {
+		short events = 0;
+
+		if (FD_ISSET(fd, ifds))
+			events |= POLLIN;
+		if (FD_ISSET(fd, ofds))
+			events |= POLLOUT;
+		if (FD_ISSET(fd, efds))
+			events |= POLLPRI;
+		if (!events)
+			continue;
+		ufds[nfds].fd = fd;
+		ufds[nfds].events = events;
+		ufds[nfds].revents = 0;
+		nfds++;
+	}
+
+	n = coev_poll(ufds, nfds, tvp ? tvp->tv_sec + tvp->tv_usec / 1e6 : -1.0);
+	if (n > 0) {
+		FD_ZERO(ifds);
+		FD_ZERO(ofds);
+		FD_ZERO(efds);
+		n = 0;
+		for (i = 0; i < nfds; i++) {
+			short ev = ufds[i].events, rev = ufds[i].revents;
+
+			if (rev & POLLNVAL) {
+				errno = EBADF;
+				n = -1;
+				break;
+			}
+			/* what select() itself reports for these */
+			if ((ev & POLLIN) && (rev & (POLLIN | POLLHUP | POLLERR))) {
+				FD_SET(ufds[i].fd, ifds);
+				n++;
+			}
+			if ((ev & POLLOUT) && (rev & (POLLOUT | POLLERR))) {
+				FD_SET(ufds[i].fd, ofds);
+				n++;
+			}
+			if ((ev & POLLPRI) && (rev & POLLPRI)) {
+				FD_SET(ufds[i].fd, efds);
+				n++;
+			}
+		}
+	}
+	free(ufds);
+	return n;
+}
+#endif
+
 #undef SELECT_USES_HEAP
 #if FD_SETSIZE > 1024
 #define SELECT_USES_HEAP
@@ -275,6 +413,11 @@ select_select(PyObject *self, PyObject *args)
 	if (emax > max) max = emax;
 
 	Py_BEGIN_ALLOW_THREADS
+#ifdef UCOEV_THREADS
+	if (coev_is_scheduling() && (!tvp || (tvp->tv_sec >= 0 && tvp->tv_usec >= 0)))
+		n = coev_select(max, &ifdset, &ofdset, &efdset, tvp);
+	else
+#endif
 	n = select(max, &ifdset, &ofdset, &efdset, tvp);
 	Py_END_ALLOW_THREADS
 
@@ -534,7 +677,12 @@ poll_poll(pollObject *self, PyObject *args)
 
 	/* call poll() */
 	Py_BEGIN_ALLOW_THREADS
+#ifdef UCOEV_THREADS
+	poll_result = coev_poll(self->ufds, self->ufd_len, 
+				timeout < 0 ? -1.0 : timeout / 1000.0);
+#else
 	poll_result = poll(self->ufds, self->ufd_len, timeout);
+#endif
 	Py_END_ALLOW_THREADS
  
 	if (poll_result < 0) {
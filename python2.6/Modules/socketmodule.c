@@ -256,6 +256,10 @@ shutdown(how) -- shut down traffic in one or both directions\n\
 #define PySocket_BUILDING_SOCKET
 #include "socketmodule.h"
 
+#ifdef UCOEV_THREADS
+#include <ucoev.h>
+#endif
+
 /* Addressing includes */
 
 #ifndef MS_WINDOWS
@@ -620,6 +624,13 @@ internal_setblocking(PySocketSockObject *s, int block)
 #endif
 #endif
 
+#ifdef UCOEV_THREADS
+	/* Blocking is done by internal_wait(), so that it's a coroutine
+	   that waits and not the whole process: the fd is always
+	   non-blocking. */
+	block = 0;
+#endif
+
 	Py_BEGIN_ALLOW_THREADS
 #ifdef __BEOS__
 	block = !block;
@@ -661,20 +672,50 @@ internal_setblocking(PySocketSockObject *s, int block)
    The argument writing indicates the direction.
    This does not raise an exception; we'll let our caller do that
    after they've reacquired the interpreter lock.
-   Returns 1 on timeout, -1 on error, 0 otherwise. */
+   Returns 1 on timeout, -1 on error, 0 otherwise.
+
+   With UCOEV_THREADS blocking sockets (sock_timeout < 0) are waited for
+   too, and while a scheduler runs it's coev_wait() that does the 
+   waiting. A coev deadline or cancel is an error, ETIMEDOUT or 
+   ECANCELED. */
 static int
-internal_select(PySocketSockObject *s, int writing)
+internal_wait(PySocketSockObject *s, int writing)
 {
 	int n;
 
 	/* Nothing to do unless we're in timeout mode (not non-blocking) */
+#ifdef UCOEV_THREADS
+	if (s->sock_timeout == 0.0)
+		return 0;
+#else
 	if (s->sock_timeout <= 0.0)
 		return 0;
+#endif
 
 	/* Guard against closed socket */
 	if (s->sock_fd < 0)
 		return 0;
 
+#ifdef UCOEV_THREADS
+	if (coev_is_scheduling()) {
+		coev_wait(s->sock_fd, writing ? COEV_WRITE : COEV_READ,
+			  s->sock_timeout > 0.0 ? s->sock_timeout : 0.0);
+		switch (coev_current()->status) {
+		case CSW_EVENT:
+			return 0;
+		case CSW_TIMEOUT:
+			return 1;
+		case CSW_DEADLINE:
+			errno = ETIMEDOUT;
+			return -1;
+		case CSW_CANCELLED:
+			errno = ECANCELED;
+			return -1;
+		}
+		/* the scheduler itself: block below */
+	}
+#endif
+
 	/* Prefer poll, if available, since you can poll() any fd
 	 * which can't be done with select(). */
 #ifdef HAVE_POLL
@@ -686,7 +727,10 @@ internal_select(PySocketSockObject *s, int writing)
 		pollfd.events = writing ? POLLOUT : POLLIN;
 
 		/* s->sock_timeout is in seconds, timeout in ms */
-		timeout = (int)(s->sock_timeout * 1000 + 0.5); 
+		if (s->sock_timeout < 0.0)
+			timeout = -1;
+		else
+			timeout = (int)(s->sock_timeout * 1000 + 0.5); 
 		n = poll(&pollfd, 1, timeout);
 	}
 #else
@@ -701,9 +745,11 @@ internal_select(PySocketSockObject *s, int writing)
 
 		/* See if the socket is ready */
 		if (writing)
-			n = select(s->sock_fd+1, NULL, &fds, NULL, &tv);
+			n = select(s->sock_fd+1, NULL, &fds, NULL,
+				   s->sock_timeout < 0.0 ? NULL : &tv);
 		else
-			n = select(s->sock_fd+1, &fds, NULL, NULL, &tv);
+			n = select(s->sock_fd+1, &fds, NULL, NULL,
+				   s->sock_timeout < 0.0 ? NULL : &tv);
 	}
 #endif
 	
@@ -714,6 +760,20 @@ internal_select(PySocketSockObject *s, int writing)
 	return 0;
 }
 
+#ifdef UCOEV_THREADS
+/* An op is tried first, and internal_wait()-ed for and retried only if
+   it says EAGAIN: saves a scheduler round trip when it's ready already.
+   SOCK_RETRY() sets timeout to what internal_wait() said. */
+#define internal_select(s, writing) 0
+#define SOCK_RETRY(s, failed, writing, timeout) \
+	((failed) && ((s)->sock_timeout != 0.0) && \
+	 ((errno == EAGAIN) || (errno == EWOULDBLOCK)) && \
+	 !((timeout) = internal_wait((s), (writing))))
+#else
+#define internal_select internal_wait
+#define SOCK_RETRY(s, failed, writing, timeout) 0
+#endif
+
 /* Initialize a new socket object. */
 
 static double defaulttimeout = -1.0; /* Default timeout for new sockets */
@@ -733,8 +793,12 @@ init_sockobject(PySocketSockObject *s,
 
 	s->errorhandler = &set_error;
 
+#ifdef UCOEV_THREADS
+	internal_setblocking(s, 0);
+#else
 	if (defaulttimeout >= 0.0)
 		internal_setblocking(s, 0);
+#endif
 
 #ifdef RISCOS
 	if (taskwindow)
@@ -767,6 +831,42 @@ PyThread_type_lock netdb_lock;
 #endif
 
 
+#ifdef UCOEV_THREADS
+/* getaddrinfo() on a coev offload pool thread, so that resolving a name
+   stops one coroutine and not the process. */
+struct coev_gai {
+	const char *host, *port;
+	const struct addrinfo *hints;
+	struct addrinfo **res;
+	int error;
+};
+
+static void
+coev_gai_job(void *arg)
+{
+	struct coev_gai *g = (struct coev_gai *)arg;
+
+	g->error = getaddrinfo(g->host, g->port, g->hints, g->res);
+}
+
+static int
+sock_getaddrinfo(const char *host, const char *port,
+		 const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct coev_gai g;
+
+	g.host = host;
+	g.port = port;
+	g.hints = hints;
+	g.res = res;
+	if (coev_offload(coev_gai_job, &g))
+		return getaddrinfo(host, port, hints, res);
+	return g.error;
+}
+#else
+#define sock_getaddrinfo getaddrinfo
+#endif
+
 /* Convert a string specifying a host name or one of a few symbolic
    names to a numeric IP address.  This usually calls gethostbyname()
    to do the work; the names "" and "<broadcast>" are special.
@@ -862,7 +962,7 @@ setipaddr(char *name, struct sockaddr *addr_ret, size_t addr_ret_size, int af)
 	hints.ai_family = af;
 	Py_BEGIN_ALLOW_THREADS
 	ACQUIRE_GETADDRINFO_LOCK
-	error = getaddrinfo(name, NULL, &hints, &res);
+	error = sock_getaddrinfo(name, NULL, &hints, &res);
 #if defined(__digital__) && defined(__unix__)
 	if (error == EAI_NONAME && af == AF_UNSPEC) {
 		/* On Tru64 V5.1, numeric-to-addr conversion fails
@@ -1614,7 +1714,9 @@ sock_accept(PySocketSockObject *s)
 	Py_BEGIN_ALLOW_THREADS
 	timeout = internal_select(s, 0);
 	if (!timeout)
-		newfd = accept(s->sock_fd, SAS2SA(&addrbuf), &addrlen);
+		do
+			newfd = accept(s->sock_fd, SAS2SA(&addrbuf), &addrlen);
+		while (SOCK_RETRY(s, newfd < 0, 0, timeout));
 	Py_END_ALLOW_THREADS
 
 	if (timeout == 1) {
@@ -1985,9 +2087,13 @@ internal_connect(PySocketSockObject *s, struct sockaddr *addr, int addrlen,
 
 #else
 
+#ifdef UCOEV_THREADS
+	if (s->sock_timeout != 0.0) {
+#else
 	if (s->sock_timeout > 0.0) {
+#endif
                 if (res < 0 && errno == EINPROGRESS && IS_SELECTABLE(s)) {
-                        timeout = internal_select(s, 1);
+                        timeout = internal_wait(s, 1);
                         if (timeout == 0) {
                                 /* Bug #1019808: in case of an EINPROGRESS, 
                                    use getsockopt(SO_ERROR) to get the real 
@@ -2310,7 +2416,9 @@ sock_recv_guts(PySocketSockObject *s, char* cbuf, int len, int flags)
 	Py_BEGIN_ALLOW_THREADS
 	timeout = internal_select(s, 0);
 	if (!timeout)
-		outlen = recv(s->sock_fd, cbuf, len, flags);
+		do
+			outlen = recv(s->sock_fd, cbuf, len, flags);
+		while (SOCK_RETRY(s, outlen < 0, 0, timeout));
 	Py_END_ALLOW_THREADS
 
 	if (timeout == 1) {
@@ -2508,7 +2616,7 @@ sock_recvfrom_guts(PySocketSockObject *s, char* cbuf, int len, int flags,
 	Py_BEGIN_ALLOW_THREADS
 	memset(&addrbuf, 0, addrlen);
 	timeout = internal_select(s, 0);
-	if (!timeout) {
+	if (!timeout) do {
 #ifndef MS_WINDOWS
 #if defined(PYOS_OS2) && !defined(PYCC_GCC)
 		n = recvfrom(s->sock_fd, cbuf, len, flags,
@@ -2521,7 +2629,7 @@ sock_recvfrom_guts(PySocketSockObject *s, char* cbuf, int len, int flags,
 		n = recvfrom(s->sock_fd, cbuf, len, flags,
 			     SAS2SA(&addrbuf), &addrlen);
 #endif
-	}
+	} while (SOCK_RETRY(s, n < 0, 0, timeout));
 	Py_END_ALLOW_THREADS
 
 	if (timeout == 1) {
@@ -2662,11 +2770,13 @@ sock_send(PySocketSockObject *s, PyObject *args)
 	Py_BEGIN_ALLOW_THREADS
 	timeout = internal_select(s, 1);
 	if (!timeout)
+		do
 #ifdef __VMS
-		n = sendsegmented(s->sock_fd, buf, len, flags);
+			n = sendsegmented(s->sock_fd, buf, len, flags);
 #else
-		n = send(s->sock_fd, buf, len, flags);
+			n = send(s->sock_fd, buf, len, flags);
 #endif
+		while (SOCK_RETRY(s, n < 0, 1, timeout));
 	Py_END_ALLOW_THREADS
 
 	PyBuffer_Release(&pbuf);
@@ -2713,11 +2823,13 @@ sock_sendall(PySocketSockObject *s, PyObject *args)
 		n = -1;
 		if (timeout)
 			break;
+		do
 #ifdef __VMS
-		n = sendsegmented(s->sock_fd, buf, len, flags);
+			n = sendsegmented(s->sock_fd, buf, len, flags);
 #else
-		n = send(s->sock_fd, buf, len, flags);
+			n = send(s->sock_fd, buf, len, flags);
 #endif
+		while (SOCK_RETRY(s, n < 0, 1, timeout));
 		if (n < 0)
 			break;
 		buf += n;
@@ -2781,7 +2893,9 @@ sock_sendto(PySocketSockObject *s, PyObject *args)
 	Py_BEGIN_ALLOW_THREADS
 	timeout = internal_select(s, 1);
 	if (!timeout)
-		n = sendto(s->sock_fd, buf, len, flags, SAS2SA(&addrbuf), addrlen);
+		do
+			n = sendto(s->sock_fd, buf, len, flags, SAS2SA(&addrbuf), addrlen);
+		while (SOCK_RETRY(s, n < 0, 1, timeout));
 	Py_END_ALLOW_THREADS
 
 	PyBuffer_Release(&pbuf);
@@ -3996,7 +4110,7 @@ socket_getaddrinfo(PyObject *self, PyObject *args)
 	hints.ai_flags = flags;
 	Py_BEGIN_ALLOW_THREADS
 	ACQUIRE_GETADDRINFO_LOCK
-	error = getaddrinfo(hptr, pptr, &hints, &res0);
+	error = sock_getaddrinfo(hptr, pptr, &hints, &res0);
 	Py_END_ALLOW_THREADS
 	RELEASE_GETADDRINFO_LOCK  /* see comment in setipaddr() */
 	if (error) {
@@ -159,6 +159,382 @@ newlockobject(void)
 	return self;
 }
 
+#ifdef UCOEV_THREADS
+/* Semaphores, events and condition variables on libucoev's, for
+   threading.py. Waiters park in the scheduler until released, set or
+   notified, instead of polling a lock. */
+
+#include <errno.h>
+
+/* None is forever, negative is now */
+static int
+sync_timeout(PyObject *timeout, double *t)
+{
+	if (timeout == NULL || timeout == Py_None) {
+		*t = -1.0;
+		return 0;
+	}
+	*t = PyFloat_AsDouble(timeout);
+	if (*t == -1.0 && PyErr_Occurred())
+		return -1;
+	if (*t < 0.0)
+		*t = 0.0;
+	return 0;
+}
+
+/* 1 if done, 0 if timed out, -1 with an exception */
+static int
+sync_result(int rv)
+{
+	if (rv == 0)
+		return 1;
+	switch (errno) {
+	case EAGAIN:
+	case ETIMEDOUT:
+		return 0;
+	case EDEADLK:
+		PyErr_SetString(ThreadError, "can't wait without a scheduler");
+		return -1;
+	default:
+		PyErr_SetFromErrno(ThreadError);
+		return -1;
+	}
+}
+
+typedef struct {
+	PyObject_HEAD
+	cosem_t *sem;
+} semobject;
+
+static void
+sem_dealloc(semobject *self)
+{
+	cosem_free(self->sem);
+	PyObject_Del(self);
+}
+
+static PyObject *
+sem_acquire(semobject *self, PyObject *args)
+{
+	PyObject *timeout = NULL;
+	int blocking = 1, rv;
+	double t;
+
+	if (!PyArg_ParseTuple(args, "|iO:acquire", &blocking, &timeout))
+		return NULL;
+	if (sync_timeout(timeout, &t))
+		return NULL;
+	if (!blocking)
+		t = 0.0;
+	rv = cosem_acquire(self->sem, 0.0);
+	if (rv && t != 0.0) {
+		Py_BEGIN_ALLOW_THREADS
+		rv = cosem_acquire(self->sem, t);
+		Py_END_ALLOW_THREADS
+	}
+	if ((rv = sync_result(rv)) < 0)
+		return NULL;
+	return PyBool_FromLong(rv);
+}
+
+static PyObject *
+sem_release(semobject *self, PyObject *args)
+{
+	long n = 1;
+
+	if (!PyArg_ParseTuple(args, "|l:release", &n))
+		return NULL;
+	cosem_release(self->sem, n);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+sem_value(semobject *self)
+{
+	return PyInt_FromLong(cosem_value(self->sem));
+}
+
+static PyMethodDef sem_methods[] = {
+	{"acquire",	(PyCFunction)sem_acquire, METH_VARARGS,
+	 "acquire([blocking[, timeout]]) -> bool"},
+	{"release",	(PyCFunction)sem_release, METH_VARARGS,
+	 "release([n]) -- wakes up to n waiters, in order"},
+	{"value",	(PyCFunction)sem_value, METH_NOARGS,
+	 "value() -> int"},
+	{NULL,		NULL}		/* sentinel */
+};
+
+static PyObject *
+sem_getattr(semobject *self, char *name)
+{
+	return Py_FindMethod(sem_methods, (PyObject *)self, name);
+}
+
+static PyTypeObject Semtype = {
+	PyVarObject_HEAD_INIT(&PyType_Type, 0)
+	"thread._Semaphore",		/*tp_name*/
+	sizeof(semobject),		/*tp_size*/
+	0,				/*tp_itemsize*/
+	/* methods */
+	(destructor)sem_dealloc,	/*tp_dealloc*/
+	0,				/*tp_print*/
+	(getattrfunc)sem_getattr,	/*tp_getattr*/
+};
+
+static PyObject *
+thread_semaphore(PyObject *self, PyObject *args)
+{
+	semobject *sem;
+	long value = 1;
+
+	if (!PyArg_ParseTuple(args, "|l:_Semaphore", &value))
+		return NULL;
+	if (value < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"semaphore initial value must be >= 0");
+		return NULL;
+	}
+	sem = PyObject_New(semobject, &Semtype);
+	if (sem == NULL)
+		return NULL;
+	sem->sem = cosem_new(value);
+	return (PyObject *) sem;
+}
+
+PyDoc_STRVAR(semaphore_doc,
+"_Semaphore([value]) -> semaphore object\n\
+\n\
+A counting semaphore; waiters get released units in order.");
+
+typedef struct {
+	PyObject_HEAD
+	coevent_t *ev;
+} eventobject;
+
+static void
+event_dealloc(eventobject *self)
+{
+	coevent_free(self->ev);
+	PyObject_Del(self);
+}
+
+static PyObject *
+event_wait(eventobject *self, PyObject *args)
+{
+	PyObject *timeout = NULL;
+	int rv;
+	double t;
+
+	if (!PyArg_ParseTuple(args, "|O:wait", &timeout))
+		return NULL;
+	if (sync_timeout(timeout, &t))
+		return NULL;
+	rv = coevent_wait(self->ev, 0.0);
+	if (rv && t != 0.0) {
+		Py_BEGIN_ALLOW_THREADS
+		rv = coevent_wait(self->ev, t);
+		Py_END_ALLOW_THREADS
+	}
+	if ((rv = sync_result(rv)) < 0)
+		return NULL;
+	return PyBool_FromLong(rv);
+}
+
+static PyObject *
+event_set(eventobject *self)
+{
+	coevent_set(self->ev);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+event_clear(eventobject *self)
+{
+	coevent_clear(self->ev);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+event_is_set(eventobject *self)
+{
+	return PyBool_FromLong(coevent_is_set(self->ev));
+}
+
+static PyMethodDef event_methods[] = {
+	{"wait",	(PyCFunction)event_wait, METH_VARARGS,
+	 "wait([timeout]) -> bool"},
+	{"set",		(PyCFunction)event_set, METH_NOARGS,
+	 "set() -- wakes all waiters, or the first one if one-shot"},
+	{"clear",	(PyCFunction)event_clear, METH_NOARGS,
+	 "clear()"},
+	{"is_set",	(PyCFunction)event_is_set, METH_NOARGS,
+	 "is_set() -> bool"},
+	{NULL,		NULL}		/* sentinel */
+};
+
+static PyObject *
+event_getattr(eventobject *self, char *name)
+{
+	return Py_FindMethod(event_methods, (PyObject *)self, name);
+}
+
+static PyTypeObject Eventtype = {
+	PyVarObject_HEAD_INIT(&PyType_Type, 0)
+	"thread._Event",		/*tp_name*/
+	sizeof(eventobject),		/*tp_size*/
+	0,				/*tp_itemsize*/
+	/* methods */
+	(destructor)event_dealloc,	/*tp_dealloc*/
+	0,				/*tp_print*/
+	(getattrfunc)event_getattr,	/*tp_getattr*/
+};
+
+static PyObject *
+thread_event(PyObject *self, PyObject *args)
+{
+	eventobject *ev;
+	int oneshot = 0;
+
+	if (!PyArg_ParseTuple(args, "|i:_Event", &oneshot))
+		return NULL;
+	ev = PyObject_New(eventobject, &Eventtype);
+	if (ev == NULL)
+		return NULL;
+	ev->ev = coevent_new(oneshot ? COEVENT_ONESHOT : 0);
+	return (PyObject *) ev;
+}
+
+PyDoc_STRVAR(event_doc,
+"_Event([oneshot]) -> event object\n\
+\n\
+An event stays set until cleared, unless it is one-shot: then each\n\
+set() is taken by exactly one wait().");
+
+typedef struct {
+	PyObject_HEAD
+	cocond_t *cv;
+} condobject;
+
+static void
+cond_dealloc(condobject *self)
+{
+	cocond_free(self->cv);
+	PyObject_Del(self);
+}
+
+/* The lock is threading's, so it is released and restored through the
+   Condition's own _release_save() and _acquire_restore(). Nothing can
+   switch between the release and the park, thus a notify can't be
+   missed. */
+static PyObject *
+cond_wait(condobject *self, PyObject *args)
+{
+	PyObject *cond, *timeout = NULL, *saved, *res;
+	int rv, err = 0;
+	double t;
+
+	if (!PyArg_ParseTuple(args, "O|O:wait", &cond, &timeout))
+		return NULL;
+	if (sync_timeout(timeout, &t))
+		return NULL;
+	saved = PyObject_CallMethod(cond, "_release_save", NULL);
+	if (saved == NULL)
+		return NULL;
+	if (t == 0.0) {
+		rv = -1;
+		err = ETIMEDOUT;
+	}
+	else {
+		Py_BEGIN_ALLOW_THREADS
+		rv = cocond_wait(self->cv, NULL, t);
+		err = errno;
+		Py_END_ALLOW_THREADS
+	}
+	res = PyObject_CallMethod(cond, "_acquire_restore", "(O)", saved);
+	Py_DECREF(saved);
+	if (res == NULL)
+		return NULL;
+	Py_DECREF(res);
+	/* errors are raised with the thread state back, and
+	   _acquire_restore() may have clobbered errno meanwhile */
+	errno = err;
+	if ((rv = sync_result(rv)) < 0)
+		return NULL;
+	return PyBool_FromLong(rv);
+}
+
+static PyObject *
+cond_notify(condobject *self, PyObject *args)
+{
+	long n = 1;
+
+	if (!PyArg_ParseTuple(args, "|l:notify", &n))
+		return NULL;
+	if (n > 0)
+		cocond_notify(self->cv, n);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+cond_notify_all(condobject *self)
+{
+	cocond_notify(self->cv, -1);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+cond_waiters(condobject *self)
+{
+	return PyInt_FromSize_t(cocond_waiters(self->cv));
+}
+
+static PyMethodDef cond_methods[] = {
+	{"wait",	(PyCFunction)cond_wait, METH_VARARGS,
+	 "wait(condition[, timeout]) -> bool, False if timed out"},
+	{"notify",	(PyCFunction)cond_notify, METH_VARARGS,
+	 "notify([n]) -- wakes up to n waiters, in order"},
+	{"notify_all",	(PyCFunction)cond_notify_all, METH_NOARGS,
+	 "notify_all()"},
+	{"waiters",	(PyCFunction)cond_waiters, METH_NOARGS,
+	 "waiters() -> int"},
+	{NULL,		NULL}		/* sentinel */
+};
+
+static PyObject *
+cond_getattr(condobject *self, char *name)
+{
+	return Py_FindMethod(cond_methods, (PyObject *)self, name);
+}
+
+static PyTypeObject Condtype = {
+	PyVarObject_HEAD_INIT(&PyType_Type, 0)
+	"thread._CondVar",		/*tp_name*/
+	sizeof(condobject),		/*tp_size*/
+	0,				/*tp_itemsize*/
+	/* methods */
+	(destructor)cond_dealloc,	/*tp_dealloc*/
+	0,				/*tp_print*/
+	(getattrfunc)cond_getattr,	/*tp_getattr*/
+};
+
+static PyObject *
+thread_condvar(PyObject *self)
+{
+	condobject *cv;
+
+	cv = PyObject_New(condobject, &Condtype);
+	if (cv == NULL)
+		return NULL;
+	cv->cv = cocond_new();
+	return (PyObject *) cv;
+}
+
+PyDoc_STRVAR(condvar_doc,
+"_CondVar() -> condition variable object\n\
+\n\
+wait(condition) releases and restores the threading.Condition's lock.");
+#endif /* UCOEV_THREADS */
+
 /* Thread-local objects */
 
 #include "structmember.h"
@@ -414,8 +790,86 @@ struct bootstate {
 	PyObject *func;
 	PyObject *args;
 	PyObject *keyw;
+#ifdef UCOEV_THREADS
+	long ident;			/* of the coroutine, while parked */
+	struct bootstate *next;
+#endif
 };
 
+#ifdef UCOEV_THREADS
+/* Coroutine pool.  A finished coroutine parks here with its bootstate,
+   PyThreadState and stack instead of dying, and start_new_thread()
+   hands the next function to the one parked last.  To everybody else
+   it died as usual, see coev_park(). */
+static struct bootstate *parked = NULL;
+static int parked_count = 0;
+static int parked_max = 64;
+
+/* Returns 0 when given another function, or NULL in boot->func if it
+   is to exit after all; -1 if it can't be kept. */
+static int
+t_park(struct bootstate *boot, PyThreadState *tstate)
+{
+	coev_t *subject;
+	int rv;
+
+	if (parked_count >= parked_max)
+		return -1;
+
+	/* what the next function should not inherit: thread-locals,
+	   exception state, tracing */
+	PyThreadState_Clear(tstate);
+	tstate->use_tracing = 0;
+	tstate->recursion_depth = 0;
+
+	boot->ident = PyThread_get_thread_ident();
+	boot->next = parked;
+	parked = boot;
+	parked_count++;
+
+	Py_BEGIN_ALLOW_THREADS
+	rv = PyThread_park_coroutine();
+	Py_END_ALLOW_THREADS
+
+	if (rv) {
+		/* nothing ran, still on top */
+		parked = boot->next;
+		parked_count--;
+		return -1;
+	}
+
+	/* thread-locals went with the park, the GILState mapping too */
+	_PyGILState_NoteUnparked(tstate);
+
+	/* what the last run left and the parent didn't take */
+	subject = coev_current();
+	Py_CLEAR(subject->A);
+	Py_CLEAR(subject->X);
+	Py_CLEAR(subject->Y);
+	Py_CLEAR(subject->S);
+	return 0;
+}
+
+/* Takes a parked coroutine for a function with this key, already
+   scheduled: fill in the bootstate before anything can switch. */
+static struct bootstate *
+t_unpark(const void *key)
+{
+	struct bootstate *boot;
+
+	while ((boot = parked) != NULL) {
+		parked = boot->next;
+		parked_count--;
+		if (PyThread_reuse_coroutine(boot->ident, key) != -1)
+			return boot;
+		/* stack too small for this one, let it go */
+		boot->func = NULL;
+		PyThread_reuse_coroutine(boot->ident, NULL);
+	}
+	return NULL;
+}
+#endif
+
 static void
 t_bootstrap(void *boot_raw)
 {
@@ -426,6 +880,12 @@ t_bootstrap(void *boot_raw)
 	tstate = PyThreadState_New(boot->interp);
 
 	PyEval_AcquireThread(tstate);
+#ifdef UCOEV_THREADS
+	/* no function: warming up the pool */
+	if (boot->func == NULL)
+		goto park;
+  run:
+#endif
 	res = PyEval_CallObjectWithKeywords(
 		boot->func, boot->args, boot->keyw);
 #ifdef UCOEV_THREADS
@@ -476,12 +936,33 @@ t_bootstrap(void *boot_raw)
 	Py_DECREF(boot->func);
 	Py_DECREF(boot->args);
 	Py_XDECREF(boot->keyw);
+#ifdef UCOEV_THREADS
+  park:
+	if ((t_park(boot, tstate) == 0) && (boot->func != NULL))
+		goto run;
+#endif
 	PyMem_DEL(boot_raw);
 	PyThreadState_Clear(tstate);
 	PyThreadState_DeleteCurrent();
 	PyThread_exit_thread();
 }
 
+#ifdef UCOEV_THREADS
+/* entry point identity for libucoev stack profiling: code object of
+   functions and methods, the class itself for classes, type otherwise. */
+static const void *
+coroutine_key(PyObject *func)
+{
+	if (PyMethod_Check(func))
+		func = PyMethod_GET_FUNCTION(func);
+	if (PyFunction_Check(func))
+		return PyFunction_GET_CODE(func);
+	if (PyType_Check(func) || PyClass_Check(func))
+		return func;
+	return Py_TYPE(func);
+}
+#endif
+
 static PyObject *
 thread_PyThread_start_new_thread(PyObject *self, PyObject *fargs)
 {
@@ -507,6 +988,18 @@ thread_PyThread_start_new_thread(PyObject *self, PyObject *fargs)
 				"optional 3rd arg must be a dictionary");
 		return NULL;
 	}
+#ifdef UCOEV_THREADS
+	boot = t_unpark(coroutine_key(func));
+	if (boot != NULL) {
+		boot->func = func;
+		boot->args = args;
+		boot->keyw = keyw;
+		Py_INCREF(func);
+		Py_INCREF(args);
+		Py_XINCREF(keyw);
+		return PyInt_FromLong(boot->ident);
+	}
+#endif
 	boot = PyMem_NEW(struct bootstate, 1);
 	if (boot == NULL)
 		return PyErr_NoMemory();
@@ -518,7 +1011,12 @@ thread_PyThread_start_new_thread(PyObject *self, PyObject *fargs)
 	Py_INCREF(args);
 	Py_XINCREF(keyw);
 	PyEval_InitThreads(); /* Start the interpreter's thread-awareness */
+#ifdef UCOEV_THREADS
+	ident = PyThread_start_new_coroutine(t_bootstrap, (void*) boot,
+					     coroutine_key(func));
+#else
 	ident = PyThread_start_new_thread(t_bootstrap, (void*) boot);
+#endif
 	if (ident == -1) {
 		PyErr_SetString(ThreadError, "can't start new thread");
 		Py_DECREF(func);
@@ -530,6 +1028,53 @@ thread_PyThread_start_new_thread(PyObject *self, PyObject *fargs)
 	return PyInt_FromLong(ident);
 }
 
+#ifdef UCOEV_THREADS
+static PyObject *
+thread_coroutine_pool(PyObject *self, PyObject *args)
+{
+	struct bootstate *boot;
+	int size = -1, warm = 0, old_size = parked_max;
+
+	if (!PyArg_ParseTuple(args, "|ii:coroutine_pool", &size, &warm))
+		return NULL;
+	if (size >= 0)
+		parked_max = size;
+
+	/* the ones that no longer fit get woken up to exit */
+	while (parked_count > parked_max) {
+		boot = parked;
+		parked = boot->next;
+		parked_count--;
+		boot->func = NULL;
+		PyThread_reuse_coroutine(boot->ident, NULL);
+	}
+
+	PyEval_InitThreads();
+	for (; warm > 0; warm--) {
+		boot = PyMem_NEW(struct bootstate, 1);
+		if (boot == NULL)
+			return PyErr_NoMemory();
+		boot->interp = PyThreadState_GET()->interp;
+		boot->func = NULL;
+		if (PyThread_start_new_coroutine(t_bootstrap, (void*) boot,
+						 (const void *) t_bootstrap) == -1) {
+			PyMem_DEL(boot);
+			PyErr_SetString(ThreadError, "can't start new thread");
+			return NULL;
+		}
+	}
+	return PyInt_FromLong(old_size);
+}
+
+PyDoc_STRVAR(coroutine_pool_doc,
+"coroutine_pool([size[, warm]]) -> size\n\
+\n\
+Return the number of finished coroutines kept, with their stacks and\n\
+thread states, for start_new_thread() to reuse, and set it if size is\n\
+given.  warm more coroutines are started to fill the pool in advance,\n\
+they get there once the scheduler runs them.");
+#endif
+
 PyDoc_STRVAR(start_new_doc,
 "start_new_thread(function, args[, kwargs])\n\
 (start_new() is an obsolete synonym)\n\
@@ -695,6 +1240,16 @@ static PyMethodDef thread_methods[] = {
 	{"stack_size",		(PyCFunction)thread_stack_size,
 				METH_VARARGS,
 				stack_size_doc},
+#ifdef UCOEV_THREADS
+	{"_Semaphore",		(PyCFunction)thread_semaphore,
+	 METH_VARARGS, semaphore_doc},
+	{"_Event",		(PyCFunction)thread_event,
+	 METH_VARARGS, event_doc},
+	{"_CondVar",		(PyCFunction)thread_condvar,
+	 METH_NOARGS, condvar_doc},
+	{"coroutine_pool",	(PyCFunction)thread_coroutine_pool,
+	 METH_VARARGS, coroutine_pool_doc},
+#endif
 #ifndef NO_EXIT_PROG
 	{"exit_prog",		(PyCFunction)thread_PyThread_exit_prog,
 	 METH_VARARGS},
@@ -19,6 +19,10 @@
 
 #include <ctype.h>
 
+#ifdef UCOEV_THREADS
+#include <ucoev.h>
+#endif
+
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif /* HAVE_SYS_TYPES_H */
@@ -893,11 +897,44 @@ floattime(void)
 
 /* Implement floatsleep() for various platforms.
    When interrupted (or when another error occurs), return -1 and
-   set an exception; else return 0. */
+   set an exception; else return 0. 
+   
+   With UCOEV_THREADS it's the coroutine that sleeps, if a scheduler 
+   runs; a coev deadline or cancel is an IOError, ETIMEDOUT or
+   ECANCELED. */
 
 static int
 floatsleep(double secs)
 {
+#ifdef UCOEV_THREADS
+	if (coev_is_scheduling() && secs == 0.0) {
+		/* sleep(0) is a yield; a zero coev_sleep() would never end */
+		int rv;
+
+		Py_BEGIN_ALLOW_THREADS
+		rv = coev_stall();
+		Py_END_ALLOW_THREADS
+		if (rv == CSCHED_NOERROR)
+			return 0;
+	} else if (coev_is_scheduling() && secs > 0.0) {
+		Py_BEGIN_ALLOW_THREADS
+		coev_sleep(secs);
+		Py_END_ALLOW_THREADS
+		switch (coev_current()->status) {
+		case CSW_DEADLINE:
+			errno = ETIMEDOUT;
+			PyErr_SetFromErrno(PyExc_IOError);
+			return -1;
+		case CSW_CANCELLED:
+			errno = ECANCELED;
+			PyErr_SetFromErrno(PyExc_IOError);
+			return -1;
+		}
+		if (!CSW_ERROR(coev_current()))
+			return 0;
+		/* the scheduler itself: block below */
+	}
+#endif
 /* XXX Should test for MS_WINDOWS first! */
 #if defined(HAVE_SELECT) && !defined(__BEOS__) && !defined(__EMX__)
 	struct timeval t;
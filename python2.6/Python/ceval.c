@@ -212,7 +212,25 @@ PyEval_GetCallStats(PyObject *self)
 #endif
 #include "pythread.h"
 
+#ifdef UCOEV_NOGIL
+#ifndef UCOEV_THREADS
+#error "UCOEV_NOGIL needs UCOEV_THREADS"
+#endif
+/* Coroutines all run in the one OS thread and switch only from inside
+   Py_BEGIN/END_ALLOW_THREADS, so there is nothing left for the lock to
+   protect: letting go of the interpreter is swapping the thread state
+   out, taking it is swapping one in.  interpreter_lock only remembers
+   that PyEval_InitThreads() was called. */
+static int interpreter_lock = 0;
+#define GIL_ALLOCATE()	1
+#define GIL_ACQUIRE()	(void)0
+#define GIL_RELEASE()	(void)0
+#else
 static PyThread_type_lock interpreter_lock = 0; /* This is the GIL */
+#define GIL_ALLOCATE()	PyThread_allocate_lock()
+#define GIL_ACQUIRE()	PyThread_acquire_lock(interpreter_lock, 1)
+#define GIL_RELEASE()	PyThread_release_lock(interpreter_lock)
+#endif
 static long main_thread = 0;
 
 int
@@ -226,21 +244,21 @@ PyEval_InitThreads(void)
 {
 	if (interpreter_lock)
 		return;
-	interpreter_lock = PyThread_allocate_lock();
-	PyThread_acquire_lock(interpreter_lock, 1);
+	interpreter_lock = GIL_ALLOCATE();
+	GIL_ACQUIRE();
 	main_thread = PyThread_get_thread_ident();
 }
 
 void
 PyEval_AcquireLock(void)
 {
-	PyThread_acquire_lock(interpreter_lock, 1);
+	GIL_ACQUIRE();
 }
 
 void
 PyEval_ReleaseLock(void)
 {
-	PyThread_release_lock(interpreter_lock);
+	GIL_RELEASE();
 }
 
 void
@@ -250,7 +268,7 @@ PyEval_AcquireThread(PyThreadState *tstate)
 		Py_FatalError("PyEval_AcquireThread: NULL new thread state");
 	/* Check someone has called PyEval_InitThreads() to create the lock */
 	assert(interpreter_lock);
-	PyThread_acquire_lock(interpreter_lock, 1);
+	GIL_ACQUIRE();
 	if (PyThreadState_Swap(tstate) != NULL)
 		Py_FatalError(
 			"PyEval_AcquireThread: non-NULL old thread state");
@@ -263,7 +281,7 @@ PyEval_ReleaseThread(PyThreadState *tstate)
 		Py_FatalError("PyEval_ReleaseThread: NULL thread state");
 	if (PyThreadState_Swap(NULL) != tstate)
 		Py_FatalError("PyEval_ReleaseThread: wrong thread state");
-	PyThread_release_lock(interpreter_lock);
+	GIL_RELEASE();
 }
 
 /* This function is called from PyOS_AfterFork to ensure that newly
@@ -283,8 +301,8 @@ PyEval_ReInitThreads(void)
 	  much error-checking.  Doing this cleanly would require
 	  adding a new function to each thread_*.h.  Instead, just
 	  create a new lock and waste a little bit of memory */
-	interpreter_lock = PyThread_allocate_lock();
-	PyThread_acquire_lock(interpreter_lock, 1);
+	interpreter_lock = GIL_ALLOCATE();
+	GIL_ACQUIRE();
 	main_thread = PyThread_get_thread_ident();
 
 	/* Update the threading module with the new state.
@@ -318,7 +336,7 @@ PyEval_SaveThread(void)
 		Py_FatalError("PyEval_SaveThread: NULL tstate");
 #ifdef WITH_THREAD
 	if (interpreter_lock)
-		PyThread_release_lock(interpreter_lock);
+		GIL_RELEASE();
 #endif
 	return tstate;
 }
@@ -329,11 +347,20 @@ PyEval_RestoreThread(PyThreadState *tstate)
 	if (tstate == NULL)
 		Py_FatalError("PyEval_RestoreThread: NULL tstate");
 #ifdef WITH_THREAD
+#ifdef UCOEV_NOGIL
+	/* nobody to wait for, but somebody may have switched away
+	   without releasing, and then there's no lock to catch it */
+	if (PyThreadState_Swap(tstate) != NULL)
+		Py_FatalError("PyEval_RestoreThread: "
+			      "coroutine switched holding the interpreter");
+	return;
+#else
 	if (interpreter_lock) {
 		int err = errno;
-		PyThread_acquire_lock(interpreter_lock, 1);
+		GIL_ACQUIRE();
 		errno = err;
 	}
+#endif
 #endif
 	PyThreadState_Swap(tstate);
 }
@@ -862,17 +889,19 @@ PyEval_EvalFrameEx(PyFrameObject *f, int throwflag)
 			}
 #ifdef WITH_THREAD
 			if (interpreter_lock) {
+#ifndef UCOEV_NOGIL
 				/* Give another thread a chance */
 
 				if (PyThreadState_Swap(NULL) != tstate)
 					Py_FatalError("ceval: tstate mix-up");
-				PyThread_release_lock(interpreter_lock);
+				GIL_RELEASE();
 
 				/* Other threads may run now */
 
-				PyThread_acquire_lock(interpreter_lock, 1);
+				GIL_ACQUIRE();
 				if (PyThreadState_Swap(tstate) != NULL)
 					Py_FatalError("ceval: orphan tstate");
+#endif
 
 				/* Check for thread interrupts */
 
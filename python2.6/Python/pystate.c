@@ -27,8 +27,14 @@ the expense of doing their own locking).
 #include "pythread.h"
 static PyThread_type_lock head_mutex = NULL; /* Protects interp->tstate_head */
 #define HEAD_INIT() (void)(head_mutex || (head_mutex = PyThread_allocate_lock()))
+#ifdef UCOEV_NOGIL
+/* one OS thread, and no coroutine switches in here, see ceval.c */
+#define HEAD_LOCK() /* Nothing */
+#define HEAD_UNLOCK() /* Nothing */
+#else
 #define HEAD_LOCK() PyThread_acquire_lock(head_mutex, WAIT_LOCK)
 #define HEAD_UNLOCK() PyThread_release_lock(head_mutex)
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -555,6 +561,14 @@ _PyGILState_NoteThreadState(PyThreadState* tstate)
 	tstate->gilstate_counter = 1;
 }
 
+#ifdef UCOEV_THREADS
+void
+_PyGILState_NoteUnparked(PyThreadState *tstate)
+{
+	_PyGILState_NoteThreadState(tstate);
+}
+#endif
+
 /* The public functions */
 PyThreadState *
 PyGILState_GetThisThreadState(void)
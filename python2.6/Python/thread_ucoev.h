@@ -118,12 +118,19 @@ _wrapper(coev_t *c) {
 
 long
 PyThread_start_new_thread(func_t func, void *arg) {
+    return PyThread_start_new_coroutine(func, arg, func);
+}
+
+/* _stacksize is the upper bound when libucoev sizes stacks 
+   by entry point, see coev_setstackprof(). */
+long
+PyThread_start_new_coroutine(func_t func, void *arg, const void *key) {
     coev_t *c;
     
     if (!initialized)
         PyThread_init_thread();
         
-    c = coev_new( _wrapper, _stacksize );
+    c = coev_new_keyed( _wrapper, _stacksize, key );
     
     Py_CLEAR(c->A);
     Py_CLEAR(c->X);
@@ -136,6 +143,23 @@ PyThread_start_new_thread(func_t func, void *arg) {
     return (long) c;
 }
 
+/* the runner stays in whatever called this until reused, 
+   see coev_park() and threadmodule.c's t_park() */
+int
+PyThread_park_coroutine(void) {
+    return coev_park();
+}
+
+long
+PyThread_reuse_coroutine(long ident, const void *key) {
+    coev_t *c = (coev_t *) ident;
+    
+    if (coev_unpark(c, key ? _stacksize : 0, key))
+        return -1;
+    coev_schedule(c);
+    return ident;
+}
+
 long
 PyThread_get_thread_ident(void) {
     if (!initialized)
@@ -255,7 +279,8 @@ PyThread_delete_key_value(int key) {
 void
 PyThread_ReInitTLS(void) {
     coev_fork_notify();
-    tuco_dprintf("PyThread_ReInitTLS(): called coev_fork_notify().\n");
+    cls_drop_others();
+    tuco_dprintf("PyThread_ReInitTLS(): called coev_fork_notify(), cls_drop_others().\n");
 }
 
 /* set the thread stack size.
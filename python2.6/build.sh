@@ -2,6 +2,7 @@
 
 PREFIX=${PREFIX:=~/prefix}
 
+# add -DUCOEV_NOGIL for the lockless interpreter lock mode, see ceval.c
 export CPPFLAGS="-I${PREFIX}/include -DUCOEV_THREADS"
 export LDFLAGS="-L/${PREFIX}/lib -Wl,-rpath=${PREFIX}/lib"
 export LIBS=-lucoev
@@ -149,7 +149,16 @@ class PyBuildExt(build_ext):
         # Python header files
         headers = glob("Include/*.h") + ["pyconfig.h"]
 
+        # Macros configure got in CPPFLAGS, -DUCOEV_THREADS in particular,
+        # are for the extensions too: compiler_so below is CFLAGS only.
+        cpp_macros = []
+        for arg in (sysconfig.get_config_var('CPPFLAGS') or '').split():
+            if arg.startswith('-D'):
+                name, eq, value = arg[2:].partition('=')
+                cpp_macros.append((name, eq and value or None))
+
         for ext in self.extensions[:]:
+            ext.define_macros.extend(cpp_macros)
             ext.sources = [ find_module_file(filename, moddirlist)
                             for filename in ext.sources ]
             if ext.depends is not None: